@@ -0,0 +1,137 @@
+/* cgroup.c
+   cgroup v2 groups for sandbox processes
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "cgroup.h"
+
+#define CPU_PERIOD_USEC 100000
+
+static bool write_file(cgroup_t*cg, const char*name, const char*value)
+{
+    char filename[strlen(cg->path) + strlen(name) + 2];
+    sprintf(filename, "%s/%s", cg->path, name);
+    int fd = open(filename, O_WRONLY|O_CLOEXEC);
+    if(fd < 0) {
+        return false;
+    }
+    int len = strlen(value);
+    bool ok = write(fd, value, len) == len;
+    close(fd);
+    return ok;
+}
+
+static int read_file(cgroup_t*cg, const char*name, char*buffer, int size)
+{
+    char filename[strlen(cg->path) + strlen(name) + 2];
+    sprintf(filename, "%s/%s", cg->path, name);
+    int fd = open(filename, O_RDONLY|O_CLOEXEC);
+    if(fd < 0) {
+        return -1;
+    }
+    int len = read(fd, buffer, size - 1);
+    close(fd);
+    if(len < 0) {
+        return -1;
+    }
+    buffer[len] = 0;
+    return len;
+}
+
+cgroup_t* cgroup_new(const char*parent)
+{
+    static int count = 0;
+    char path[strlen(parent) + 64];
+    sprintf(path, "%s/sandbox-%d-%d", parent, getpid(), __sync_fetch_and_add(&count, 1));
+    if(mkdir(path, 0755) && errno != EEXIST) {
+        return NULL;
+    }
+    cgroup_t*cg = calloc(1, sizeof(cgroup_t));
+    cg->path = strdup(path);
+    return cg;
+}
+
+void cgroup_destroy(cgroup_t*cg)
+{
+    /* the process may still be on its way out (e.g. if a zygote reaps
+       it, not us), so give it a little time */
+    int i;
+    for(i = 0; i < 100 && rmdir(cg->path) && errno == EBUSY; i++) {
+        if(!i) {
+            write_file(cg, "cgroup.kill", "1");
+        }
+        usleep(1000);
+    }
+    free(cg->path);
+    free(cg);
+}
+
+bool cgroup_set_limits(cgroup_t*cg, int64_t max_memory, int cpu_percent, int max_pids)
+{
+    char value[64];
+    bool ok = true;
+    if(max_memory > 0) {
+        sprintf(value, "%lld", (long long)max_memory);
+        /* without swap, memory.max is a hard limit */
+        ok &= write_file(cg, "memory.max", value);
+        write_file(cg, "memory.swap.max", "0");
+    }
+    if(cpu_percent > 0) {
+        sprintf(value, "%d %d", CPU_PERIOD_USEC * cpu_percent / 100, CPU_PERIOD_USEC);
+        ok &= write_file(cg, "cpu.max", value);
+    }
+    if(max_pids > 0) {
+        sprintf(value, "%d", max_pids);
+        ok &= write_file(cg, "pids.max", value);
+    }
+    return ok;
+}
+
+bool cgroup_add(cgroup_t*cg, pid_t pid)
+{
+    char value[32];
+    sprintf(value, "%d", pid);
+    return write_file(cg, "cgroup.procs", value);
+}
+
+int64_t cgroup_memory_peak(cgroup_t*cg)
+{
+    char buffer[64];
+    if(read_file(cg, "memory.peak", buffer, sizeof(buffer)) <= 0) {
+        return -1;
+    }
+    return atoll(buffer);
+}
+
+int64_t cgroup_cpu_usec(cgroup_t*cg)
+{
+    char buffer[1024];
+    if(read_file(cg, "cpu.stat", buffer, sizeof(buffer)) <= 0) {
+        return -1;
+    }
+    /* "usage_usec" is the first line, but let's not count on that */
+    const char*s = strstr(buffer, "usage_usec ");
+    if(!s) {
+        return -1;
+    }
+    return atoll(s + strlen("usage_usec "));
+}
@@ -0,0 +1,60 @@
+/* cgroup.h
+   cgroup v2 groups for sandbox processes
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#ifndef __cgroup_h__
+#define __cgroup_h__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A leaf cgroup (v2) of its own for one sandbox process. Unlike
+   RLIMIT_DATA, memory.max counts everything the process maps, and
+   cpu.max keeps a busy sandbox from taking more than its share. */
+typedef struct _cgroup {
+    char*path;
+} cgroup_t;
+
+/* Create a new group below parent, which has to be a cgroup we're
+   allowed to write to, with the memory, cpu and pids controllers enabled
+   in its cgroup.subtree_control. NULL on error. */
+cgroup_t* cgroup_new(const char*parent);
+
+/* Kill whatever still runs in the group, and remove it */
+void cgroup_destroy(cgroup_t*cg);
+
+/* Limits (0 = none): memory in bytes, CPU in percent of one CPU, number
+   of processes */
+bool cgroup_set_limits(cgroup_t*cg, int64_t max_memory, int cpu_percent, int max_pids);
+
+/* Move pid (0 = ourselves) into the group */
+bool cgroup_add(cgroup_t*cg, pid_t pid);
+
+/* Most memory the group used at once, in bytes (memory.peak, needs Linux
+   5.19), and CPU time it used in all, in usec. -1 if unknown. */
+int64_t cgroup_memory_peak(cgroup_t*cg);
+int64_t cgroup_cpu_usec(cgroup_t*cg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
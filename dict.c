@@ -19,18 +19,16 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include "util.h"
 #include "dict.h"
 
 // ------------------------------- crc32 -------------------------------
 static unsigned int crc32[256];
-static char crc32_initialized=0;
-static void crc32_init(void)
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+static void crc32_fill(void)
 {
     int t;
-    if(crc32_initialized)
-        return;
-    crc32_initialized = 1;
     for(t=0; t<256; t++) {
         unsigned int c = t;
         int s;
@@ -40,6 +38,10 @@ static void crc32_init(void)
         crc32[t] = c;
     }
 }
+static void crc32_init(void)
+{
+    pthread_once(&crc32_once, crc32_fill);
+}
 // ------------------------------- hash function -----------------------
 unsigned int crc32_add_byte(unsigned int checksum, unsigned char b) 
 {
@@ -15,8 +15,78 @@ value_t void_value = {
 
 typedef struct {
     int size;
+    value_arena_t*arena; /* if the array lives in an arena */
 } array_internal_t;
 
+/* Inline slots have their lowest bit set, with the type in the rest of
+   the low byte, and the payload in the upper 32 bits. Boxed slots are
+   value_t pointers, which are at least 2-byte aligned. */
+#define SLOT_IS_INLINE(s) ((s) & 1)
+#define SLOT_INLINE(type, bits) (((value_slot_t)(bits) << 32) | ((value_slot_t)(type) << 1) | 1)
+#define SLOT_TYPE(s) ((type_t)(((s) & 0xff) >> 1))
+#define SLOT_BITS(s) ((uint32_t)((s) >> 32))
+#define SLOT_BOX(v) ((value_slot_t)(uintptr_t)(v))
+#define SLOT_BOXED(s) ((value_t*)(uintptr_t)(s))
+
+static void array_append_slot(value_t*array, value_slot_t slot);
+
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_ALIGN 16
+
+typedef struct _arena_block {
+    struct _arena_block*prev;
+    size_t size;
+    size_t pos;
+    char data[0] __attribute__((aligned(ARENA_ALIGN)));
+} arena_block_t;
+
+/* Heap values appended to arrays in the arena */
+typedef struct _arena_owned {
+    value_t*value;
+    struct _arena_owned*next;
+} arena_owned_t;
+
+/* Lives at the start of the arena's first block */
+struct _value_arena {
+    arena_block_t*first;
+    arena_block_t*block;
+    arena_owned_t*owned;
+};
+
+/* One first-sized block is kept around, so that small trees (i.e., most
+   call results and arguments) don't need to malloc at all */
+static arena_block_t*spare_block = NULL;
+
+typedef struct _function_signature {
+    int num_params;
+    int num_cargs; /* packed arrays are passed as two C arguments */
+    type_t*param;
+    type_t ret;
+} function_signature_t;
+
+#define IS_PACKED_ARRAY(type) ((type) == TYPE_INT32_ARRAY || (type) == TYPE_FLOAT32_ARRAY)
+
+/* Where an argument is kept on its way to ffi_call(). Conversions to
+   strings write the string to tmp_str. Conversions to packed arrays set
+   length, and, if they had to unpack an array, the buffer to free after
+   the call. */
+typedef struct _arg_data {
+    union {
+        int32_t i32;
+        float f32;
+        bool b;
+        void*ptr;
+    };
+    int32_t length;
+    void*buffer;
+#define TMP_STR_SIZE 32
+    char tmp_str[TMP_STR_SIZE];
+} arg_data_t;
+
+/* Convert a value to the C type of a parameter. False if it can't be
+   converted. */
+typedef bool (*arg_converter_t)(value_t*o, arg_data_t*data);
+
 typedef struct _c_function_def {
     void*runtime;
     const char*name;
@@ -24,13 +94,15 @@ typedef struct _c_function_def {
     void*context;
     char*params;
     char*ret;
-} c_function_def_t;
 
-typedef struct _function_signature {
-    int num_params;
-    type_t*param;
-    type_t ret;
-} function_signature_t;
+    /* The call descriptor, parsed and prepared once, so that a call only
+       has to convert its arguments, and do the ffi_call() */
+    function_signature_t*sig;
+    ffi_type**atypes;
+    ffi_cif cif;
+    bool prepared;
+    arg_converter_t*convert;
+} c_function_def_t;
 
 int count_function_defs(c_function_def_t*methods) 
 {
@@ -49,6 +121,8 @@ static int _parse_type(const char*s, type_t*type)
         case 'b': *type = TYPE_BOOLEAN; break;
         case 'i': *type = TYPE_INT32; break;
         case 'f': *type = TYPE_FLOAT32; break;
+        case 'I': *type = TYPE_INT32_ARRAY; break;
+        case 'F': *type = TYPE_FLOAT32_ARRAY; break;
         default:        
         case 's': *type = TYPE_STRING; break;
         case '[': *type = TYPE_ARRAY; break;
@@ -89,6 +163,12 @@ const char* type_to_string(type_t type)
         case TYPE_ARRAY:
             return "array";
         break;
+        case TYPE_INT32_ARRAY:
+            return "int32 array";
+        break;
+        case TYPE_FLOAT32_ARRAY:
+            return "float32 array";
+        break;
         default:
             return "<unknown>";
         break;
@@ -116,11 +196,22 @@ value_t* value_clone(const value_t*src)
             value_t*array = array_new();
             int i;
             for(i=0;i<src->length;i++) {
-                array_append(array, value_clone(src->data[i]));
+                value_slot_t slot = src->slots[i];
+                if(SLOT_IS_INLINE(slot)) {
+                    array_append_slot(array, slot);
+                } else {
+                    array_append_take(array, value_clone(SLOT_BOXED(slot)));
+                }
             }
             return array;
         }
         break;
+        case TYPE_INT32_ARRAY:
+            return value_new_int32_array(src->i32s, src->length);
+        break;
+        case TYPE_FLOAT32_ARRAY:
+            return value_new_float32_array(src->f32s, src->length);
+        break;
     }
     return NULL; 
 }
@@ -142,6 +233,8 @@ static ffi_type* _type_to_ffi_type(type_t type)
         break;
         case TYPE_STRING:
         case TYPE_ARRAY:
+        case TYPE_INT32_ARRAY:
+        case TYPE_FLOAT32_ARRAY:
             return &ffi_type_pointer;
         break;
         default:
@@ -160,7 +253,7 @@ ffi_type * function_ffi_rtype(c_function_def_t*method)
 
 ffi_type ** function_ffi_args_plus_one(c_function_def_t*method)
 {
-    int num_params = function_count_args(method) + 1;
+    int num_params = function_count_args(method) * 2 + 1;
     ffi_type **atypes = malloc(sizeof(ffi_type*) * num_params);
     const char*a = method->params;
     atypes[0] = &ffi_type_pointer;
@@ -168,10 +261,12 @@ ffi_type ** function_ffi_args_plus_one(c_function_def_t*method)
     while(*a) {
         type_t type;
         a += _parse_type(a, &type);
-        atypes[i] = _type_to_ffi_type(type);
-        i++;
+        atypes[i++] = _type_to_ffi_type(type);
+        if(IS_PACKED_ARRAY(type)) {
+            atypes[i++] = &ffi_type_sint32;
+        }
     }
-    assert(i == num_params);
+    assert(i <= num_params);
     return atypes;
 }
 
@@ -191,11 +286,14 @@ function_signature_t* function_get_signature(c_function_def_t*f)
     }
 
     sig->param = malloc(sizeof(type_t)*sig->num_params);
+    sig->num_cargs = sig->num_params;
     a = f->params;
     i = 0;
     while(*a) {
-        type_t type;
-        a += _parse_type(a, &sig->param[i++]);
+        a += _parse_type(a, &sig->param[i]);
+        if(IS_PACKED_ARRAY(sig->param[i]))
+            sig->num_cargs++;
+        i++;
     }
 
     _parse_type(f->ret, &sig->ret);
@@ -264,21 +362,164 @@ static void dump_ffi_call(const ffi_cif*cif)
     printf("):%s\n", _ffi_arg_type(cif->rtype));
 }
 
+static bool convert_to_float32(value_t*o, arg_data_t*data)
+{
+    switch(o->type) {
+        case TYPE_FLOAT32: data->f32 = o->f32; return true;
+        case TYPE_INT32: data->f32 = o->i32; return true;
+        case TYPE_BOOLEAN: data->f32 = o->b; return true;
+        default: return false;
+    }
+}
+
+static bool convert_to_int32(value_t*o, arg_data_t*data)
+{
+    switch(o->type) {
+        case TYPE_FLOAT32: data->i32 = (int)o->f32; return true;
+        case TYPE_INT32: data->i32 = o->i32; return true;
+        case TYPE_BOOLEAN: data->i32 = o->b; return true;
+        default: return false;
+    }
+}
+
+static bool convert_to_boolean(value_t*o, arg_data_t*data)
+{
+    switch(o->type) {
+        case TYPE_FLOAT32: data->b = (int)o->f32; return true;
+        case TYPE_INT32: data->b = o->i32; return true;
+        case TYPE_BOOLEAN: data->b = o->b; return true;
+        default: return false;
+    }
+}
+
+static bool convert_to_string(value_t*o, arg_data_t*data)
+{
+    switch(o->type) {
+        case TYPE_FLOAT32:
+            snprintf(data->tmp_str, TMP_STR_SIZE, "%f", o->f32);
+            data->ptr = data->tmp_str;
+            return true;
+        case TYPE_INT32:
+            snprintf(data->tmp_str, TMP_STR_SIZE, "%d", o->i32);
+            data->ptr = data->tmp_str;
+            return true;
+        case TYPE_BOOLEAN:
+            data->ptr = o->b?"true":"false";
+            return true;
+        case TYPE_STRING:
+            data->ptr = o->str;
+            return true;
+        case TYPE_ARRAY:
+            snprintf(data->tmp_str, TMP_STR_SIZE, "<array, %d items>", o->length);
+            data->ptr = data->tmp_str;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool convert_to_void(value_t*o, arg_data_t*data)
+{
+    data->ptr = NULL;
+    return o->type == TYPE_VOID;
+}
+
+static bool convert_to_array(value_t*o, arg_data_t*data)
+{
+    data->ptr = o;
+    return o->type == TYPE_ARRAY;
+}
+
+/* Packed arrays of the wanted type are passed as they are. Anything else
+   that holds numbers (or booleans) is unpacked into a temporary buffer. */
+static bool convert_to_packed(value_t*o, arg_data_t*data, type_t type)
+{
+    if(o->type != TYPE_ARRAY && !IS_PACKED_ARRAY(o->type)) {
+        return false;
+    }
+    data->length = o->length;
+    if(o->type == type) {
+        data->ptr = o->i32s;
+        return true;
+    }
+    int32_t*buffer = malloc(sizeof(int32_t) * (o->length ? o->length : 1));
+    int i;
+    for(i=0;i<o->length;i++) {
+        arg_data_t e;
+        if(o->type == TYPE_INT32_ARRAY) {
+            e.i32 = o->i32s[i];
+            if(type == TYPE_FLOAT32_ARRAY)
+                e.f32 = e.i32;
+        } else if(o->type == TYPE_FLOAT32_ARRAY) {
+            e.f32 = o->f32s[i];
+            if(type == TYPE_INT32_ARRAY)
+                e.i32 = (int)e.f32;
+        } else {
+            value_t tmp;
+            value_t*entry = array_get(o, i, &tmp);
+            if(!(type == TYPE_INT32_ARRAY ? convert_to_int32 : convert_to_float32)(entry, &e)) {
+                free(buffer);
+                return false;
+            }
+        }
+        memcpy(&buffer[i], &e, sizeof(int32_t));
+    }
+    data->ptr = data->buffer = buffer;
+    return true;
+}
+
+static bool convert_to_int32_array(value_t*o, arg_data_t*data)
+{
+    return convert_to_packed(o, data, TYPE_INT32_ARRAY);
+}
+
+static bool convert_to_float32_array(value_t*o, arg_data_t*data)
+{
+    return convert_to_packed(o, data, TYPE_FLOAT32_ARRAY);
+}
+
+static arg_converter_t converter_for(type_t type)
+{
+    switch(type) {
+        case TYPE_FLOAT32: return convert_to_float32;
+        case TYPE_INT32: return convert_to_int32;
+        case TYPE_BOOLEAN: return convert_to_boolean;
+        case TYPE_STRING: return convert_to_string;
+        case TYPE_VOID: return convert_to_void;
+        case TYPE_ARRAY: return convert_to_array;
+        case TYPE_INT32_ARRAY: return convert_to_int32_array;
+        case TYPE_FLOAT32_ARRAY: return convert_to_float32_array;
+        default: return NULL;
+    }
+}
+
+/* Parse the signature, and prepare the ffi call, once for all calls */
+static void cfunction_prepare(c_function_def_t*f)
+{
+    f->sig = function_get_signature(f);
+    f->atypes = function_ffi_args_plus_one(f);
+    f->prepared = ffi_prep_cif(&f->cif, FFI_DEFAULT_ABI, f->sig->num_cargs + 1,
+                               function_ffi_rtype(f), f->atypes) == FFI_OK;
+    if(!f->prepared) {
+        /* every call will fail, so say why once, here */
+        language_error(f->runtime, "%s: Can't prepare a call with signature (%s)%s\n", f->name, f->params, f->ret);
+    }
+    f->convert = malloc(sizeof(arg_converter_t) * (f->sig->num_params + 1));
+    int i;
+    for(i=0;i<f->sig->num_params;i++) {
+        f->convert[i] = converter_for(f->sig->param[i]);
+    }
+}
+
 value_t* cfunction_call(value_t*self, value_t*_args)
 {
     c_function_def_t*f = self->internal;
+    function_signature_t*sig = f->sig;
 
-    function_signature_t*sig = function_get_signature(f);
-
-    ffi_cif cif;
-    ffi_type **atypes = function_ffi_args_plus_one(f);
-    ffi_status status = ffi_prep_cif(&cif, FFI_DEFAULT_ABI, sig->num_params + 1, 
-                                     function_ffi_rtype(f), 
-                                     atypes);
-    if(status != FFI_OK) {
+    if(!f->prepared) {
+        /* reported by cfunction_prepare() */
         return NULL;
     }
-
     if(_args->type != TYPE_ARRAY) {
         language_error(f->runtime, "%s: function parameters must be an array\n", f->name);
         return NULL;
@@ -292,135 +533,53 @@ value_t* cfunction_call(value_t*self, value_t*_args)
     printf("[ffi] ");function_signature_dump(sig);
     printf("[ffi] args: ");value_dump(_args);printf("\n");
 #endif
+    arg_data_t args_data[_args->length+1];
     union {
         int32_t i32;
         float f32;
         bool b;
         void*ptr;
-#define TMP_STR_SIZE 32
-        char tmp_str[TMP_STR_SIZE];
-    } args_data[_args->length+1], ret_raw;
+        ffi_arg raw;
+    } ret_raw;
 
-    void**ffi_args = alloca(sizeof(void*) * (_args->length + 1));
+    void**ffi_args = alloca(sizeof(void*) * (sig->num_cargs + 1));
 
-    int i;
+    int i, j;
 
     ffi_args[0] = &f->context;
 
-    for(i=0;i<_args->length;i++) {
-        value_t*o = _args->data[i];
-
-        type_t t = sig->param[i];
-        ffi_args[i+1] = &args_data[i+1];
-
-        bool error = false;
-        switch(_args->data[i]->type) {
-            case TYPE_FLOAT32: {
-                float v = o->f32;
-                if(t == TYPE_FLOAT32) {
-                    args_data[i+1].f32 = v;
-                } else if(t == TYPE_INT32) {
-                    args_data[i+1].i32 = (int)v;
-                } else if(t == TYPE_BOOLEAN) {
-                    args_data[i+1].b = (int)v;
-                } else if(t == TYPE_STRING) {
-                    char*str = args_data[i+i].tmp_str;
-                    snprintf(str, TMP_STR_SIZE, "%f", v);
-                    args_data[i+1].ptr = str;
-                } else {
-                    error = true;
-                }
-            }
-            break;
-            case TYPE_INT32: {
-                int v = o->i32;
-                if(t == TYPE_FLOAT32) {
-                    args_data[i+1].f32 = v;
-                } else if(t == TYPE_INT32) {
-                    args_data[i+1].i32 = v;
-                } else if(t == TYPE_BOOLEAN) {
-                    args_data[i+1].b = v;
-                } else if(t == TYPE_STRING) {
-                    char*str = args_data[i+i].tmp_str;
-                    snprintf(str, TMP_STR_SIZE, "%d", v);
-                    args_data[i+1].ptr = str;
-                } else {
-                    error = true;
-                }
-            }
-            break;
-            case TYPE_BOOLEAN: {
-                bool v = o->b;
-                if(t == TYPE_FLOAT32) {
-                    args_data[i+1].f32 = v;
-                } else if(t == TYPE_INT32) {
-                    args_data[i+1].i32 = v;
-                } else if(t == TYPE_BOOLEAN) {
-                    args_data[i+1].b = v;
-                } else if(t == TYPE_STRING) {
-                    args_data[i+1].ptr = v?"true":"false";
-                } else {
-                    error = true;
-                }
-            }
-            break;
-            case TYPE_STRING: {
-                char* v = o->str;
-                if(t == TYPE_STRING) {
-                    args_data[i+1].ptr = v;
-                } else {
-                    error = true;
-                }
-            }
-            break;
-            case TYPE_VOID: {
-                if(t == TYPE_VOID) {
-                    args_data[i+1].ptr = NULL;
-                } else {
-                    error = true;
-                }
-            }
-            break;
-            case TYPE_ARRAY: {
-                value_t* v = o;
-                if(t == TYPE_ARRAY) {
-                    args_data[i+1].ptr = v;
-                } else if(t == TYPE_STRING) {
-                    char*str = args_data[i+i].tmp_str;
-                    snprintf(str, TMP_STR_SIZE, "<array, %d items>", v->length);
-                    args_data[i+1].ptr = str;
-                } else {
-                    error = true;
-                }
-            }
-            break;
-            default: {
-                error = true;
-            }
-            break;
+    for(i=0,j=1;i<_args->length;i++) {
+        value_t tmp;
+        value_t*o = array_get(_args, i, &tmp);
+        args_data[i+1].buffer = NULL;
+        ffi_args[j++] = &args_data[i+1];
+        if(IS_PACKED_ARRAY(sig->param[i])) {
+            ffi_args[j++] = &args_data[i+1].length;
         }
-        if(error) {
+        if(!f->convert[i] || !f->convert[i](o, &args_data[i+1])) {
             language_error(f->runtime, "%s: Can't convert parameter %d from %s to %s\n",
                     f->name,
                     i+1, 
                     type_to_string(o->type), 
-                    type_to_string(t));
-            function_signature_destroy(sig);
-            free(atypes);
+                    type_to_string(sig->param[i]));
+            while(i > 0) {
+                free(args_data[i--].buffer);
+            }
             return NULL;
         }
     }
 
 #ifdef DEBUG
-    printf("[ffi] call: "); dump_ffi_call(&cif);
+    printf("[ffi] call: "); dump_ffi_call(&f->cif);
 #endif
-    ffi_call(&cif, f->call, &ret_raw, ffi_args);
+    ffi_call(&f->cif, f->call, &ret_raw, ffi_args);
+
+    for(i=0;i<_args->length;i++) {
+        free(args_data[i+1].buffer);
+    }
 
-    free(atypes);
-    type_t ret_type = sig->ret;
-    
     value_t* ret = NULL;
-    switch(ret_type) {
+    switch(sig->ret) {
         case TYPE_VOID:
             ret = value_new_void();
         break;
@@ -437,6 +596,8 @@ value_t* cfunction_call(value_t*self, value_t*_args)
             ret = value_new_string(ret_raw.ptr);
         break;
         case TYPE_ARRAY:
+        case TYPE_INT32_ARRAY:
+        case TYPE_FLOAT32_ARRAY:
             ret = (value_t*)ret_raw.ptr;
         break;
         default:
@@ -447,7 +608,6 @@ value_t* cfunction_call(value_t*self, value_t*_args)
     printf("[ffi] call returning: "); value_dump(ret);
     printf("\n");
 #endif
-    function_signature_destroy(sig);
     return ret;
 }
 
@@ -480,7 +640,26 @@ void value_dump(value_t*v)
             for(i=0;i<v->length;i++) {
                 if(i>0)
                     printf(", ");
-                value_dump(v->data[i]);
+                value_t tmp;
+                value_dump(array_get(v, i, &tmp));
+            }
+            printf("]");
+        }
+        break;
+        case TYPE_INT32_ARRAY: {
+            int i;
+            printf("(i32)[");
+            for(i=0;i<v->length;i++) {
+                printf(i ? ", %d" : "%d", v->i32s[i]);
+            }
+            printf("]");
+        }
+        break;
+        case TYPE_FLOAT32_ARRAY: {
+            int i;
+            printf("(f32)[");
+            for(i=0;i<v->length;i++) {
+                printf(i ? ", %f" : "%f", v->f32s[i]);
             }
             printf("]");
         }
@@ -491,7 +670,29 @@ void value_dump(value_t*v)
         break;
     }
 }
-void array_append(value_t*array, value_t* value)
+static void* arena_alloc(value_arena_t*arena, size_t size);
+static void arena_own(value_arena_t*arena, value_t*value);
+static void value_destroy_in_arena(value_t*v);
+
+value_t* array_get(const value_t*array, int i, value_t*tmp)
+{
+    value_slot_t slot = array->slots[i];
+    if(!SLOT_IS_INLINE(slot)) {
+        return SLOT_BOXED(slot);
+    }
+    uint32_t bits = SLOT_BITS(slot);
+    memset(tmp, 0, sizeof(value_t));
+    tmp->type = SLOT_TYPE(slot);
+    switch(tmp->type) {
+        case TYPE_INT32: tmp->i32 = (int32_t)bits; break;
+        case TYPE_FLOAT32: memcpy(&tmp->f32, &bits, sizeof(tmp->f32)); break;
+        case TYPE_BOOLEAN: tmp->b = !!bits; break;
+        default: break;
+    }
+    return tmp;
+}
+
+static void array_append_slot(value_t*array, value_slot_t slot)
 {
     assert(array->type == TYPE_ARRAY);
     array_internal_t*internal = array->internal;
@@ -499,29 +700,70 @@ void array_append(value_t*array, value_t* value)
         internal->size |= 3;
         internal->size <<= 1;
         internal->size += 1;
-        if(!array->data) {
-            array->data = malloc(internal->size * sizeof(void*));
+        if(internal->arena) {
+            value_slot_t*slots = arena_alloc(internal->arena, internal->size * sizeof(value_slot_t));
+            if(array->length)
+                memcpy(slots, array->slots, array->length * sizeof(value_slot_t));
+            array->slots = slots;
+        } else if(!array->slots) {
+            array->slots = malloc(internal->size * sizeof(value_slot_t));
         } else {
-            array->data = realloc(array->data, internal->size * sizeof(void*));
+            array->slots = realloc(array->slots, internal->size * sizeof(value_slot_t));
         }
     }
-    array->data[array->length++] = value;
+    array->slots[array->length++] = slot;
+}
+
+void array_append(value_t*array, value_t* value)
+{
+    array_append_slot(array, SLOT_BOX(value));
+    array_internal_t*internal = array->internal;
+    if(internal->arena && value->destroy != value_destroy_in_arena) {
+        arena_own(internal->arena, value);
+    }
+}
+void array_append_take(value_t*array, value_t* value)
+{
+    uint32_t bits = 0;
+    switch(value->type) {
+        case TYPE_VOID:
+        break;
+        case TYPE_INT32:
+            bits = (uint32_t)value->i32;
+        break;
+        case TYPE_FLOAT32:
+            memcpy(&bits, &value->f32, sizeof(bits));
+        break;
+        case TYPE_BOOLEAN:
+            bits = value->b;
+        break;
+        default:
+            array_append(array, value);
+            return;
+    }
+    array_append_slot(array, SLOT_INLINE(value->type, bits));
+    /* static values (VOID_VALUE) have no destructor */
+    if(value->destroy) {
+        value_destroy(value);
+    }
 }
 void array_append_int32(value_t*array, int32_t i32)
 {
-    array_append(array, value_new_int32(i32));
+    array_append_slot(array, SLOT_INLINE(TYPE_INT32, (uint32_t)i32));
 }
 void array_append_float32(value_t*array, float f32)
 {
-    array_append(array, value_new_float32(f32));
+    uint32_t bits;
+    memcpy(&bits, &f32, sizeof(bits));
+    array_append_slot(array, SLOT_INLINE(TYPE_FLOAT32, bits));
 }
 void array_append_string(value_t*array, char* str)
 {
-    array_append(array, value_new_string(str));
+    array_append_take(array, value_new_string(str));
 }
 void array_append_boolean(value_t*array, bool b)
 {
-    array_append(array, value_new_boolean(b));
+    array_append_slot(array, SLOT_INLINE(TYPE_BOOLEAN, b));
 }
 void array_destroy(value_t*array)
 {
@@ -551,13 +793,13 @@ static void value_destroy_string(value_t*v)
 
 static void value_destroy_array(value_t*v)
 {
-    array_internal_t*internal = v->internal;
     int i;
     for(i=0;i<v->length;i++) {
-       value_destroy(v->data[i]);
-       v->data[i] = NULL;
+        if(!SLOT_IS_INLINE(v->slots[i])) {
+            value_destroy(SLOT_BOXED(v->slots[i]));
+        }
     }
-    free(v->data);
+    free(v->slots);
     free(v->internal);
     free(v);
 }
@@ -565,6 +807,9 @@ static void value_destroy_array(value_t*v)
 static void value_destroy_cfunction(value_t*v)
 {
     c_function_def_t*f = (c_function_def_t*)v->internal;
+    function_signature_destroy(f->sig);
+    free(f->atypes);
+    free(f->convert);
     free(f->params);
     free(f->ret);
     free(v->internal);
@@ -629,6 +874,211 @@ value_t* array_new()
     return value_new_array();
 }
 
+/* The buffer comes right after the value, in the same allocation */
+static value_t* value_new_packed(type_t type, const void*data, int length)
+{
+    value_t*v = calloc(sizeof(value_t) + sizeof(int32_t) * length, 1);
+    v->destroy = value_destroy_simple;
+    v->type = type;
+    v->length = length;
+    v->i32s = (int32_t*)(v + 1);
+    if(data && length)
+        memcpy(v->i32s, data, sizeof(int32_t) * length);
+    return v;
+}
+
+value_t* value_new_int32_array(const int32_t*data, int length)
+{
+    return value_new_packed(TYPE_INT32_ARRAY, data, length);
+}
+
+value_t* value_new_float32_array(const float*data, int length)
+{
+    return value_new_packed(TYPE_FLOAT32_ARRAY, data, length);
+}
+
+static arena_block_t* arena_block_new(size_t size)
+{
+    if(size == ARENA_BLOCK_SIZE) {
+        arena_block_t*b = __sync_lock_test_and_set(&spare_block, NULL);
+        if(b) {
+            b->prev = NULL;
+            b->pos = 0;
+            return b;
+        }
+    }
+    arena_block_t*b = malloc(sizeof(arena_block_t) + size);
+    if(!b)
+        return NULL;
+    b->prev = NULL;
+    b->size = size;
+    b->pos = 0;
+    return b;
+}
+
+static void arena_block_free(arena_block_t*b)
+{
+    if(b->size != ARENA_BLOCK_SIZE || !__sync_bool_compare_and_swap(&spare_block, NULL, b)) {
+        free(b);
+    }
+}
+
+static void* arena_alloc(value_arena_t*arena, size_t size)
+{
+    arena_block_t*b = arena->block;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if(b->size - b->pos < size) {
+        size_t block_size = b->size * 2;
+        while(block_size < size)
+            block_size *= 2;
+        arena_block_t*n = arena_block_new(block_size);
+        if(!n) {
+            fprintf(stderr, "out of memory allocating %zu bytes\n", block_size);
+            abort();
+        }
+        n->prev = b;
+        arena->block = b = n;
+    }
+    void*p = b->data + b->pos;
+    b->pos += size;
+    return p;
+}
+
+value_arena_t* value_arena_new()
+{
+    arena_block_t*b = arena_block_new(ARENA_BLOCK_SIZE);
+    if(!b)
+        return NULL;
+    value_arena_t*arena = (value_arena_t*)b->data;
+    b->pos = (sizeof(value_arena_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    arena->first = arena->block = b;
+    arena->owned = NULL;
+    return arena;
+}
+
+void value_arena_destroy(value_arena_t*arena)
+{
+    arena_owned_t*o;
+    for(o = arena->owned; o; o = o->next) {
+        value_destroy(o->value);
+    }
+    arena_block_t*b = arena->block;
+    while(b) {
+        /* the first block, holding the arena itself, goes last */
+        arena_block_t*prev = b->prev;
+        arena_block_free(b);
+        b = prev;
+    }
+}
+
+static void arena_own(value_arena_t*arena, value_t*value)
+{
+    arena_owned_t*o = arena_alloc(arena, sizeof(arena_owned_t));
+    o->value = value;
+    o->next = arena->owned;
+    arena->owned = o;
+}
+
+/* Nodes are released along with their arena */
+static void value_destroy_in_arena(value_t*v)
+{
+}
+
+static void value_destroy_arena_root(value_t*v)
+{
+    if(v->type == TYPE_ARRAY) {
+        value_arena_destroy(((array_internal_t*)v->internal)->arena);
+    } else {
+        value_arena_destroy(v->internal);
+    }
+}
+
+value_t* value_arena_finish(value_arena_t*arena, value_t*root)
+{
+    root->destroy = value_destroy_arena_root;
+    return root;
+}
+
+static value_t* arena_value(value_arena_t*arena, type_t type)
+{
+    value_t*v = arena_alloc(arena, sizeof(value_t));
+    memset(v, 0, sizeof(value_t));
+    v->type = type;
+    v->internal = arena;
+    v->destroy = value_destroy_in_arena;
+    return v;
+}
+
+value_t* value_arena_void(value_arena_t*arena)
+{
+    return arena_value(arena, TYPE_VOID);
+}
+
+value_t* value_arena_int32(value_arena_t*arena, int32_t i32)
+{
+    value_t*v = arena_value(arena, TYPE_INT32);
+    v->i32 = i32;
+    return v;
+}
+
+value_t* value_arena_float32(value_arena_t*arena, float f32)
+{
+    value_t*v = arena_value(arena, TYPE_FLOAT32);
+    v->f32 = f32;
+    return v;
+}
+
+value_t* value_arena_boolean(value_arena_t*arena, bool b)
+{
+    value_t*v = arena_value(arena, TYPE_BOOLEAN);
+    v->b = b;
+    return v;
+}
+
+value_t* value_arena_string(value_arena_t*arena, const char*s, int len)
+{
+    value_t*v = arena_value(arena, TYPE_STRING);
+    v->str = arena_alloc(arena, len + 1);
+    memcpy(v->str, s, len);
+    v->str[len] = 0;
+    return v;
+}
+
+static value_t* arena_packed(value_arena_t*arena, type_t type, const void*data, int length)
+{
+    value_t*v = arena_value(arena, type);
+    v->length = length;
+    v->i32s = arena_alloc(arena, sizeof(int32_t) * length);
+    if(data && length) {
+        memcpy(v->i32s, data, sizeof(int32_t) * length);
+    } else {
+        memset(v->i32s, 0, sizeof(int32_t) * length);
+    }
+    return v;
+}
+
+value_t* value_arena_int32_array(value_arena_t*arena, const int32_t*data, int length)
+{
+    return arena_packed(arena, TYPE_INT32_ARRAY, data, length);
+}
+
+value_t* value_arena_float32_array(value_arena_t*arena, const float*data, int length)
+{
+    return arena_packed(arena, TYPE_FLOAT32_ARRAY, data, length);
+}
+
+/* size is how many entries to make room for */
+value_t* value_arena_array(value_arena_t*arena, int size)
+{
+    value_t*v = arena_value(arena, TYPE_ARRAY);
+    array_internal_t*internal = arena_alloc(arena, sizeof(array_internal_t));
+    internal->size = size;
+    internal->arena = arena;
+    v->internal = internal;
+    v->slots = size ? arena_alloc(arena, size * sizeof(value_slot_t)) : NULL;
+    return v;
+}
+
 value_t* value_new_cfunction(void*runtime, const char*name, fptr_t call, void*context, const char*params, const char*ret)
 {
     c_function_def_t*f = calloc(sizeof(c_function_def_t), 1);
@@ -638,6 +1088,7 @@ value_t* value_new_cfunction(void*runtime, const char*name, fptr_t call, void*co
     f->context = context;
     f->params = (char*)strdup(params);
     f->ret = (char*)strdup(ret);
+    cfunction_prepare(f);
 
     value_t*v = calloc(sizeof(value_t),1);
     v->destroy = value_destroy_cfunction;
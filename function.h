@@ -2,6 +2,7 @@
 #define  __function_h__
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 typedef enum _type {
@@ -12,6 +13,8 @@ typedef enum _type {
     TYPE_STRING,
     TYPE_ARRAY,
     TYPE_FUNCTION,
+    TYPE_INT32_ARRAY,
+    TYPE_FLOAT32_ARRAY,
 } type_t;
 
 const char* type_to_string(type_t type);
@@ -19,6 +22,11 @@ const char* type_to_string(type_t type);
 typedef struct _value value_t;
 typedef struct _value function_t;
 
+/* An array entry. Void, int32, float32 and boolean entries are stored
+   inline, as a tag and 32 bits of payload; strings, arrays and functions
+   are pointers to their (boxed) value_t. Use array_get() to read them. */
+typedef uint64_t value_slot_t;
+
 struct _value {
     type_t type;
     void*internal;
@@ -31,9 +39,16 @@ struct _value {
             value_t* (*call)(value_t*v, value_t*params);
             int num_params;
         };
+        /* Arrays used to expose their entries as value_t**data. Entries
+           are tagged slots now (scalars are stored inline): read them with
+           array_get(), and add them with the array_append functions. */
         struct {
             int length;
-            struct _value**data;
+            union {
+                value_slot_t*slots;
+                int32_t*i32s; /* TYPE_INT32_ARRAY */
+                float*f32s; /* TYPE_FLOAT32_ARRAY */
+            };
         };
     };
     void (*destroy)(value_t*destroy);
@@ -49,13 +64,30 @@ value_t* value_new_int32(int32_t i32);
 value_t* value_new_cfunction(void*runtime, const char*name, fptr_t call, void*context, const char*params, const char*ret);
 value_t* value_new_array();
 
+/* Packed numeric arrays: one contiguous buffer, which crosses the sandbox
+   boundary as a block, and which host functions can take as a pointer
+   plus a length ("I" and "F" in define_function() signatures). data is
+   copied, and may be NULL to start out with zeroes. */
+value_t* value_new_int32_array(const int32_t*data, int length);
+value_t* value_new_float32_array(const float*data, int length);
+
 value_t* value_clone(const value_t*src);
 void value_dump(value_t*v);
 void value_destroy(value_t*v);
 
 int value_to_int(value_t*v);
 
+/* The i-th entry of array. Boxed entries are returned as they are, and
+   inline ones are unpacked into *tmp. Either way, the array keeps them. */
+value_t* array_get(const value_t*array, int i, value_t*tmp);
+
+/* Takes ownership of value: it's destroyed along with the array, and stays
+   valid until then. */
 void array_append(value_t*array, value_t* value);
+/* Also takes ownership of value, but scalars are copied into their slot,
+   and value is destroyed right away. Cheaper, for values that aren't used
+   after being appended. */
+void array_append_take(value_t*array, value_t* value);
 void array_append_int32(value_t*array, int32_t i32);
 void array_append_float32(value_t*array, float f32);
 void array_append_string(value_t*array, char* string);
@@ -66,6 +98,28 @@ void array_destroy(value_t*array);
 #define cfunction_new value_new_cfunction
 value_t* array_new();
 
+/* Values can also be bump-allocated from an arena, which is released in
+   one go, instead of node by node. Build a tree in the arena, then hand
+   the arena to the tree's root with value_arena_finish(): destroying the
+   root releases the arena (and any heap values appended to the tree in
+   the meantime). Other nodes of the tree belong to the root, and
+   value_destroy() on them does nothing. On error, discard everything
+   with value_arena_destroy(). */
+typedef struct _value_arena value_arena_t;
+
+value_arena_t* value_arena_new();
+value_t* value_arena_finish(value_arena_t*arena, value_t*root);
+void value_arena_destroy(value_arena_t*arena);
+
+value_t* value_arena_void(value_arena_t*arena);
+value_t* value_arena_int32(value_arena_t*arena, int32_t i32);
+value_t* value_arena_float32(value_arena_t*arena, float f32);
+value_t* value_arena_boolean(value_arena_t*arena, bool b);
+value_t* value_arena_string(value_arena_t*arena, const char*s, int len);
+value_t* value_arena_array(value_arena_t*arena, int size);
+value_t* value_arena_int32_array(value_arena_t*arena, const int32_t*data, int length);
+value_t* value_arena_float32_array(value_arena_t*arena, const float*data, int length);
+
 extern value_t empty_array;
 extern value_t void_value;
 #define NO_ARGS (&empty_array)
@@ -0,0 +1,100 @@
+/* histogram.c
+   latency histograms
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#include <string.h>
+#include "histogram.h"
+
+#define SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+static int bucket_of(uint64_t value)
+{
+    if(value < SUB_BUCKETS) {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + (int)(value >> shift) - SUB_BUCKETS;
+}
+
+/* the biggest value that ends up in bucket */
+static int64_t bucket_max(int bucket)
+{
+    if(bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t first = (uint64_t)(SUB_BUCKETS + (bucket & (SUB_BUCKETS - 1))) << shift;
+    uint64_t last = first + (1ull << shift) - 1;
+    return last > INT64_MAX ? INT64_MAX : last;
+}
+
+void histogram_add(histogram_t*h, int64_t value)
+{
+    if(value < 0) {
+        value = 0;
+    }
+    h->buckets[bucket_of(value)]++;
+    h->count++;
+    h->sum += value;
+    if(value > h->max) {
+        h->max = value;
+    }
+}
+
+void histogram_merge(histogram_t*h, const histogram_t*other)
+{
+    int i;
+    for(i=0;i<HISTOGRAM_BUCKETS;i++) {
+        h->buckets[i] += other->buckets[i];
+    }
+    h->count += other->count;
+    h->sum += other->sum;
+    if(other->max > h->max) {
+        h->max = other->max;
+    }
+}
+
+int64_t histogram_percentile(const histogram_t*h, double percentile)
+{
+    if(!h->count) {
+        return 0;
+    }
+    int64_t wanted = (int64_t)(h->count * percentile / 100.0 + 0.5);
+    if(wanted < 1) {
+        wanted = 1;
+    }
+    int64_t seen = 0;
+    int i;
+    for(i=0;i<HISTOGRAM_BUCKETS;i++) {
+        seen += h->buckets[i];
+        if(seen >= wanted) {
+            int64_t value = bucket_max(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+void histogram_print(const histogram_t*h, FILE*fi)
+{
+    fprintf(fi, "count=%lld mean=%lld p50=%lld p90=%lld p99=%lld max=%lld\n",
+            (long long)h->count,
+            (long long)(h->count ? h->sum / h->count : 0),
+            (long long)histogram_percentile(h, 50),
+            (long long)histogram_percentile(h, 90),
+            (long long)histogram_percentile(h, 99),
+            (long long)h->max);
+}
@@ -0,0 +1,56 @@
+/* histogram.h
+   latency histograms
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#ifndef __histogram_h__
+#define __histogram_h__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Values are kept with HISTOGRAM_SUB_BITS significant bits: every power
+   of two is split into 16 buckets, so a percentile is off by at most
+   1/16th. That's enough to tell 1us from 2us, and 1s from 2s, in 4kB. */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_BUCKETS (64 << HISTOGRAM_SUB_BITS)
+
+typedef struct _histogram {
+    int64_t count;
+    int64_t sum;
+    int64_t max;
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+/* value has to be >= 0 (negative values count as 0) */
+void histogram_add(histogram_t*h, int64_t value);
+void histogram_merge(histogram_t*h, const histogram_t*other);
+
+/* The value that percentile (0-100) percent of all values are at most, or
+   0 for an empty histogram */
+int64_t histogram_percentile(const histogram_t*h, double percentile);
+
+/* Print count, mean, median, 90th and 99th percentile and max on one line */
+void histogram_print(const histogram_t*h, FILE*fi);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,7 +4,14 @@
 #include <string.h>
 #include <setjmp.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
 #include "language.h"
+#include "dict.h"
+#include "pool.h"
+#include "zygote.h"
 #include "settings.h"
 
 void language_error(language_t*li, const char*error, ...)
@@ -28,47 +35,118 @@ void language_error(language_t*li, const char*error, ...)
     }
 }
 
-static jmp_buf timeout_jmp;
-static void sigalarm(int signal)
+/* Time limits for interpreters in our own process: every thread has a
+   timer of its own, which signals just that thread, so that several
+   threads can run guests with a time limit at once. When the timer
+   fires, we first ask the interpreter to stop (see language_t.interrupt),
+   if it can do that from a signal handler. If it's still running
+   INTERRUPT_GRACE_MS later, or can't be asked, we jump out of it. */
+#define TIMEOUT_SIGNAL SIGALRM
+#define INTERRUPT_GRACE_MS 100
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+typedef struct _thread_timer {
+    timer_t id;
+    sigjmp_buf jmp;
+    /* the interpreter we're timing, NULL while the timer isn't armed */
+    language_t* volatile li;
+    volatile sig_atomic_t fired;
+} thread_timer_t;
+
+static pthread_once_t timer_once = PTHREAD_ONCE_INIT;
+static pthread_key_t timer_key;
+static __thread thread_timer_t*thread_timer;
+
+static void on_timeout(int signal)
 {
-    longjmp(timeout_jmp, 1);
+    thread_timer_t*t = thread_timer;
+    if(!t || !t->li)
+        return;
+    if(!t->fired++ && t->li->interrupt && t->li->interrupt_signal_safe) {
+        t->li->interrupt(t->li);
+        return;
+    }
+    siglongjmp(t->jmp, 1);
 }
 
-static value_t* with_timeout(language_t*l, const char*script, const char*function, value_t*args, int max_seconds, bool*timeout)
+static void thread_timer_destroy(void*data)
 {
-    value_t*ret = NULL;
-    if(timeout) {
-        *timeout = false;
-    }
-    void*old_signal;
-    alarm(max_seconds);
-    if(setjmp(timeout_jmp)) {
-        alarm(0);
-        if(timeout) {
-            *timeout = true;
-        }
-        language_error(l, "TIMEOUT");
-        signal(SIGPROF, old_signal);
+    thread_timer_t*t = (thread_timer_t*)data;
+    timer_delete(t->id);
+    free(t);
+}
+
+static void thread_timers_init()
+{
+    pthread_key_create(&timer_key, thread_timer_destroy);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_timeout;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(TIMEOUT_SIGNAL, &sa, NULL);
+}
+
+static thread_timer_t* get_thread_timer()
+{
+    pthread_once(&timer_once, thread_timers_init);
+    if(thread_timer)
+        return thread_timer;
+
+    thread_timer_t*t = calloc(1, sizeof(thread_timer_t));
+    struct sigevent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.sigev_notify = SIGEV_THREAD_ID;
+    ev.sigev_signo = TIMEOUT_SIGNAL;
+    ev.sigev_notify_thread_id = syscall(SYS_gettid);
+    if(timer_create(CLOCK_MONOTONIC, &ev, &t->id)) {
+        free(t);
         return NULL;
     }
-    old_signal = signal(SIGPROF, sigalarm);
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, TIMEOUT_SIGNAL);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    /* deleted when the thread exits */
+    pthread_setspecific(timer_key, t);
+    thread_timer = t;
+    return t;
+}
+
+static void thread_timer_set(thread_timer_t*t, int max_ms)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if(max_ms > 0) {
+        its.it_value.tv_sec = max_ms / 1000;
+        its.it_value.tv_nsec = (max_ms % 1000) * 1000000;
+        its.it_interval.tv_nsec = INTERRUPT_GRACE_MS * 1000000;
+    }
+    timer_settime(t->id, 0, &its, NULL);
+}
 
+static value_t* compile_and_run(language_t*l, const char*script, const char*function, value_t*args)
+{
     if(script) {
         int ret = l->compile_script(l, script);
         if(!ret) {
-            alarm(0);
             language_error(l, "Couldn't compile");
             return NULL;
         }
     }
 
+    value_t*ret = NULL;
     if(function) {
         if(l->is_function(l, function)) {
             // TODO: check for errors, allow void function calls
             ret = l->call_function(l, function, args);
         } else {
             if(!script) {
-                alarm(0);
                 /* Only report an error if we're not also compiling a script;
                    startup functions are usually optional */
                 language_error(l, "No such function: %s\n", function);
@@ -76,23 +154,129 @@ static value_t* with_timeout(language_t*l, const char*script, const char*functio
             ret = value_new_void();
         }
     }
-    alarm(0);
+    return ret;
+}
+
+static value_t* with_timeout(language_t*l, const char*script, const char*function, value_t*args, int max_ms, bool*timeout)
+{
+    if(timeout) {
+        *timeout = false;
+    }
+
+    if(l->set_timeout) {
+        /* sandboxes keep track of time themselves, no signals needed */
+        l->set_timeout(l, max_ms);
+        l->timeout = false;
+        value_t*ret = compile_and_run(l, script, function, args);
+        l->set_timeout(l, 0);
+        if(timeout) {
+            *timeout = l->timeout;
+        }
+        return ret;
+    }
 
-    signal(SIGPROF, old_signal);
+    thread_timer_t*t = get_thread_timer();
+    if(!t) {
+        language_error(l, "Couldn't create a timer");
+        return NULL;
+    }
+    if(t->li) {
+        language_error(l, "Calls with a time limit can't be nested");
+        return NULL;
+    }
+    if(sigsetjmp(t->jmp, 1)) {
+        /* the interpreter didn't stop when we asked it to */
+        t->li = NULL;
+        thread_timer_set(t, 0);
+        if(timeout) {
+            *timeout = true;
+        }
+        language_error(l, "TIMEOUT");
+        return NULL;
+    }
+    t->fired = 0;
+    t->li = l;
+    thread_timer_set(t, max_ms);
+
+    value_t*ret = compile_and_run(l, script, function, args);
+
+    t->li = NULL;
+    thread_timer_set(t, 0);
+    if(t->fired) {
+        /* interrupted, or done just as we were about to */
+        if(timeout) {
+            *timeout = true;
+        }
+        language_error(l, "TIMEOUT");
+        if(ret) {
+            value_destroy(ret);
+            ret = NULL;
+        }
+    }
     return ret;
 }
 
 value_t* call_function_with_timeout(language_t*l, const char*function, value_t*args, int max_seconds, bool*timeout)
 {
-    return with_timeout(l, NULL, function, args, max_seconds, timeout);
+    return with_timeout(l, NULL, function, args, max_seconds * 1000, timeout);
+}
+
+value_t* call_function_with_timeout_ms(language_t*l, const char*function, value_t*args, int max_ms, bool*timeout)
+{
+    return with_timeout(l, NULL, function, args, max_ms, timeout);
 }
 
 value_t* compile_and_run_function_with_timeout(language_t*l, const char*script, const char*function, value_t*args, int max_seconds, bool*timeout)
 {
-    return with_timeout(l, script, function, args, max_seconds, timeout);
+    return with_timeout(l, script, function, args, max_seconds * 1000, timeout);
+}
+
+batch_t* call_function_batch(language_t*l, const char*function, value_t*args_list, int max_seconds, bool stop_on_failure)
+{
+    if(args_list->type != TYPE_ARRAY) {
+        language_error(l, "call_function_batch() needs an array of argument arrays");
+        return NULL;
+    }
+    if(l->call_function_batch) {
+        return l->call_function_batch(l, function, args_list, max_seconds, stop_on_failure);
+    }
+
+    batch_t*batch = calloc(1, sizeof(batch_t));
+    batch->num = args_list->length;
+    batch->items = calloc(batch->num ? batch->num : 1, sizeof(batch_item_t));
+    int i;
+    for(i=0;i<batch->num;i++) {
+        batch_item_t*item = &batch->items[i];
+        struct timeval start, end;
+        value_t tmp;
+        gettimeofday(&start, NULL);
+        item->value = call_function_with_timeout(l, function, array_get(args_list, i, &tmp), max_seconds, &item->timeout);
+        gettimeofday(&end, NULL);
+        item->called = true;
+        item->budget_left = l->budget_left;
+        item->usec = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+        if(!item->value && (stop_on_failure || item->timeout))
+            break;
+    }
+    return batch;
+}
+
+void batch_destroy(batch_t*batch)
+{
+    int i;
+    for(i=0;i<batch->num;i++) {
+        if(batch->items[i].value)
+            value_destroy(batch->items[i].value);
+    }
+    free(batch->items);
+    free(batch);
 }
 
 language_t* proxy_new(language_t*language);
+zygote_t* proxy_zygote_new(language_t*language);
+language_t* proxy_new_from_zygote(zygote_t*zygote);
+language_t* proxy_template_new(language_t*language);
+language_t* proxy_template_new_from_zygote(zygote_t*zygote);
 
 language_t* wrap_sandbox(language_t*language)
 {
@@ -103,27 +287,187 @@ language_t* wrap_sandbox(language_t*language)
     return proxy_new(language);
 }
 
-static language_t* raw_interpreter_by_extension(const char*filename)
+zygote_t* sandbox_zygote_new(language_t*language)
+{
+    if(language->internal) {
+        fprintf(stderr, "Can't start zygote, language already initialized\n");
+        return NULL;
+    }
+    return proxy_zygote_new(language);
+}
+
+language_t* wrap_sandbox_from_zygote(zygote_t*zygote)
+{
+    return proxy_new_from_zygote(zygote);
+}
+
+language_t* wrap_sandbox_template(language_t*language)
+{
+    if(language->internal) {
+        fprintf(stderr, "Can't wrap sandbox, language already initialized\n");
+        return NULL;
+    }
+    return proxy_template_new(language);
+}
+
+language_t* wrap_sandbox_template_from_zygote(zygote_t*zygote)
+{
+    return proxy_template_new_from_zygote(zygote);
+}
+
+language_t* sandbox_fork(language_t*template)
+{
+    if(!template->fork) {
+        language_error(template, "Only templates can be forked");
+        return NULL;
+    }
+    return template->fork(template);
+}
+
+/* maps a file name to the language it's in ("lua", "py", "rb" or "js") */
+static const char* language_by_extension(const char*filename)
 {
     const char*dot = strrchr(filename, '.');
     const char*extension = dot ? dot+1 : filename;
 
-    language_t*core = NULL;
     if(!strcmp(extension, "lua"))
-        return lua_interpreter_new();
+        return "lua";
     else if(!strcmp(extension, "py"))
-        return python_interpreter_new();
+        return "py";
     else if(!strcmp(extension, "rb"))
+        return "rb";
+    else
+        return "js";
+}
+
+static language_t* raw_interpreter_by_extension(const char*filename)
+{
+    const char*language = language_by_extension(filename);
+
+    if(!strcmp(language, "lua"))
+        return lua_interpreter_new();
+    else if(!strcmp(language, "py"))
+        return python_interpreter_new();
+    else if(!strcmp(language, "rb"))
         return ruby_interpreter_new();
     else
         return javascript_interpreter_new();
 }
 
-language_t* interpreter_by_extension(const char*filename)
+/* pools and zygotes, per language */
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static dict_t*pools = NULL;
+static dict_t*zygotes = NULL;
+
+static zygote_t* get_zygote(const char*filename)
 {
+    const char*language = language_by_extension(filename);
+
+    pthread_mutex_lock(&registry_mutex);
+    if(!zygotes) {
+        zygotes = dict_new(&charptr_type);
+    }
+    zygote_t*zygote = dict_lookup(zygotes, language);
+    if(!zygote) {
+        zygote = sandbox_zygote_new(raw_interpreter_by_extension(filename));
+        if(zygote) {
+            dict_put(zygotes, language, zygote);
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    return zygote;
+}
+
+static language_t* sandbox_by_extension(const char*filename)
+{
+    if(config_zygote) {
+        zygote_t*zygote = get_zygote(filename);
+        if(zygote) {
+            return wrap_sandbox_from_zygote(zygote);
+        }
+    }
     return wrap_sandbox(raw_interpreter_by_extension(filename));
 }
 
+static pool_t* get_pool(const char*filename, bool create)
+{
+    const char*language = language_by_extension(filename);
+
+    pthread_mutex_lock(&registry_mutex);
+    if(!pools) {
+        pools = dict_new(&charptr_type);
+    }
+    pool_t*pool = dict_lookup(pools, language);
+    if(!pool && create) {
+        pool = pool_new(language, config_pool_size, sandbox_by_extension);
+        if(pool) {
+            dict_put(pools, language, pool);
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    return pool;
+}
+
+language_t* interpreter_by_extension(const char*filename)
+{
+    if(config_pool_size > 0) {
+        pool_t*pool = get_pool(filename, true);
+        if(pool) {
+            return pool_take(pool);
+        }
+    }
+    return sandbox_by_extension(filename);
+}
+
+/* Templates aren't pooled: they're only useful once a script is compiled */
+language_t* template_interpreter_by_extension(const char*filename)
+{
+    if(config_zygote) {
+        zygote_t*zygote = get_zygote(filename);
+        if(zygote) {
+            return wrap_sandbox_template_from_zygote(zygote);
+        }
+    }
+    return wrap_sandbox_template(raw_interpreter_by_extension(filename));
+}
+
+bool interpreter_pool_stats(const char*filename, pool_stats_t*stats)
+{
+    pool_t*pool = get_pool(filename, false);
+    if(!pool) {
+        memset(stats, 0, sizeof(pool_stats_t));
+        return false;
+    }
+    pool_get_stats(pool, stats);
+    return true;
+}
+
+void interpreter_pools_destroy()
+{
+    pthread_mutex_lock(&registry_mutex);
+    if(pools) {
+        DICT_ITERATE_DATA(pools, pool_t*, pool) {
+            pool_destroy(pool);
+        }
+        dict_destroy(pools);
+        pools = NULL;
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+void interpreter_zygotes_destroy()
+{
+    pthread_mutex_lock(&registry_mutex);
+    if(zygotes) {
+        DICT_ITERATE_DATA(zygotes, zygote_t*, zygote) {
+            zygote_destroy(zygote);
+        }
+        dict_destroy(zygotes);
+        zygotes = NULL;
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
 language_t* unsafe_interpreter_by_extension(const char*filename)
 {
     language_t*li = raw_interpreter_by_extension(filename);
@@ -6,15 +6,155 @@
 #include <sys/types.h>
 #include "util.h"
 #include "function.h"
+#include "pool.h"
+#include "zygote.h"
+#include "loop.h"
+#include "histogram.h"
 
+/* result of one call in a batch */
+typedef struct _batch_item {
+    value_t*value;  /* NULL if the call failed, or wasn't made */
+    bool called;
+    bool timeout;
+    int usec;       /* time the call took (in the sandbox, if there is one) */
+    int64_t budget_left; /* see set_budget() */
+    int64_t cpu_used;    /* see language_t.cpu_used */
+} batch_item_t;
+
+typedef struct _batch {
+    int num;
+    batch_item_t*items;
+} batch_t;
+
+struct _language;
+
+/* Completion of a call made through call_function_nb(). result is NULL if
+   the call failed, and otherwise has to be destroyed by the callback. */
+typedef void (*call_done_t)(struct _language*li, value_t*result, void*user);
+
+/* What a sandbox used so far (see language_t.get_stats()) */
+typedef struct _sandbox_stats {
+    /* CPU time of the sandbox process (usec), and the most memory it ever
+       had resident (bytes) */
+    int64_t user_usec;
+    int64_t sys_usec;
+    int64_t max_rss;
+
+    /* frames we sent to the sandbox and received from it, in bytes */
+    int64_t bytes_sent;
+    int64_t bytes_received;
+
+    int callbacks;
+    int log_lines;
+
+    /* wall clock time (usec) spent in compile_script(), and in calls:
+       synchronous ones, batch items and calls from an event loop */
+    int64_t compile_usec;
+    int calls;
+    int64_t call_usec;
+    int64_t max_call_usec;
+} sandbox_stats_t;
+
+/* Phases of a call into a sandbox (see language_t.get_profile()) */
+typedef enum _call_phase {
+    PHASE_ENCODE,       /* encoding the request */
+    PHASE_TRANSIT,      /* request and result on their way, through pipes or rings */
+    PHASE_CONVERT,      /* in the sandbox: decoding the arguments, converting
+                           them and the result from and to the interpreter's
+                           objects, and encoding the result */
+    PHASE_EXECUTE,      /* running guest code */
+    PHASE_CALLBACK,     /* waiting for callbacks to return, round trip included */
+    PHASE_DECODE,       /* decoding the result */
+    NUM_PHASES
+} call_phase_t;
+
+/* Thread safety: a language_t may only be used by one thread at a time,
+   but different threads can use different sandboxes concurrently, and
+   create and destroy them (also through pools and zygotes) in parallel.
+   Interpreters created with unsafe_interpreter_by_extension() run in our
+   own process: Python and Ruby keep global state, and may only be used
+   from one thread. Calls with a time limit on unsafe interpreters (see
+   call_function_with_timeout()) use a timer per thread, which raises
+   SIGALRM; don't block it in those threads. */
 typedef struct _language {
     void*internal;
     const char*name;
 
     bool timeout;
 
+    /* What the last call left of its budget (see set_budget()). A call that
+       runs out fails, and leaves this at 0. */
+    int64_t budget_left;
+
+    /* CPU the last call used in the sandbox, in cpu_unit: instructions,
+       or nanoseconds where there are no hardware counters. Only measured
+       with config_cpu_counter set, and not for pipelined calls; -1
+       otherwise. */
+    int64_t cpu_used;
+    const char*cpu_unit;
+
+    /* Where the last call in a sandbox spent its time (usec): CPU time of
+       the sandbox process, and time the host spent in callback functions.
+       Time limits only count the former. */
+    int guest_usec;
+    int host_usec;
+
+    /* Time (nsec) the last call spent converting its arguments and its
+       result from and to the interpreter's own objects. Only measured
+       with config_profile set, 0 otherwise. */
+    int64_t convert_nsec;
+
     bool (*initialize)(struct _language*li, size_t maxmem);
 
+    /* Time limit, in milliseconds, for each call into a sandbox (0 =
+       config_maxtime). Only the sandbox's CPU time counts (see
+       guest_usec). NULL for unsandboxed interpreters. */
+    void (*set_timeout)(struct _language*li, int max_ms);
+
+    /* Make the guest code that's running right now fail with an error,
+       the way ^C would. Sandboxes call this from a signal handler to abort
+       a call that ran out of time, and stay usable. Only some interpreters
+       get away with that in every case (interrupt_signal_safe): JavaScript
+       takes a lock, and can hang if the signal arrives while it's held. */
+    void (*interrupt)(struct _language*li);
+    bool interrupt_signal_safe;
+
+    /* Limit every call to max_ops interpreter operations (0 = no limit).
+       Unlike a time limit, this doesn't depend on machine load: a call
+       either always fits into its budget, or never does. An operation is a
+       bytecode in Lua (counted in steps of 1000) and JavaScript, and a line
+       or method call in Python and Ruby. Compiling isn't counted. */
+    void (*set_budget)(struct _language*li, int64_t max_ops);
+
+    /* Interrupt calls in a sandbox once they used max CPU, in cpu_unit (0 =
+       no limit). They then fail with li->timeout set, like calls that ran
+       out of time. Needs config_cpu_counter, NULL for unsandboxed
+       interpreters. */
+    bool (*set_cpu_limit)(struct _language*li, int64_t max);
+
+    /* What the sandbox process used in all, as accounted by its cgroup
+       (see config_cgroup): the most memory it had at once, in bytes, and
+       its CPU time, in usec. Either is -1 if the kernel doesn't say. False
+       if the sandbox has no cgroup, NULL for unsandboxed interpreters. */
+    bool (*cgroup_usage)(struct _language*li, int64_t*mem_peak, int64_t*cpu_usec);
+
+    /* Fill in what the sandbox used since it was started. False if the
+       sandbox process is gone, and its CPU and memory are unknown (-1).
+       NULL for unsandboxed interpreters. */
+    bool (*get_stats)(struct _language*li, sandbox_stats_t*stats);
+
+    /* How long (nsec) call_function() calls of function spent in phase,
+       with config_profile set. NULL if there were none. dump_profile()
+       prints all of them. NULL for unsandboxed interpreters. */
+    const histogram_t* (*get_profile)(struct _language*li, const char*function, call_phase_t phase);
+    void (*dump_profile)(struct _language*li, FILE*fi);
+
+    /* Write what the host and the sandbox process did lately (spawning,
+       initializing, locking down, compiling, calls, callbacks and log
+       lines, see config_trace) as a Chrome trace (JSON). False if there is
+       no trace. NULL for unsandboxed interpreters. */
+    bool (*write_trace)(struct _language*li, FILE*fi);
+
     void (*define_constant)(struct _language*li, const char*name, value_t*value);
     void (*define_function)(struct _language*li, const char*name, function_t*f);
 
@@ -23,6 +163,31 @@ typedef struct _language {
 
     value_t* (*call_function) (struct _language*li, const char*name, value_t*args);
 
+    /* Pipelined calls (sandboxed interpreters only, NULL otherwise):
+       call_function_async() queues a call and returns a ticket (or -1),
+       call_result() waits for the result of that ticket. Several calls can
+       be in flight at once; results can be collected in any order. */
+    int (*call_function_async) (struct _language*li, const char*name, value_t*args);
+    value_t* (*call_result) (struct _language*li, int ticket);
+
+    /* Call a function once for every argument array in args_list, with one
+       round trip to the sandbox (NULL for unsandboxed interpreters, use
+       call_function_batch() below). */
+    batch_t* (*call_function_batch) (struct _language*li, const char*name, value_t*args_list, int per_item_timeout, bool stop_on_failure);
+
+    /* Calls driven by an event loop (sandboxed interpreters talking through
+       pipes only, NULL otherwise). Once attach_loop() was called, the loop
+       reads everything the sandbox sends, and dispatches callbacks. Calls
+       then have to go through call_function_nb(), which returns right away;
+       done is called from the loop once the call returned. Compile the
+       script before attaching. */
+    bool (*attach_loop) (struct _language*li, sandbox_loop_t*loop);
+    bool (*call_function_nb) (struct _language*li, const char*name, value_t*args, call_done_t done, void*user);
+
+    /* Fork a copy of this sandbox, in the state it's in right now (templates
+       only, NULL otherwise). */
+    struct _language* (*fork) (struct _language*li);
+
     void (*destroy)(struct _language*li);
 
     /* user modifiable fields: */
@@ -42,13 +207,51 @@ language_t* ruby_interpreter_new();
 
 language_t* wrap_sandbox(language_t*language);
 
+/* A zygote initializes an interpreter once, in a process of its own. Every
+   sandbox is then forked from it, sharing the interpreter's memory copy-on-
+   write. Like wrap_sandbox(), this takes ownership of the language. */
+zygote_t* sandbox_zygote_new(language_t*language);
+language_t* wrap_sandbox_from_zygote(zygote_t*zygote);
+
+/* A template is a sandbox that can fork copies of itself: e.g. compile a
+   script in it once, and then run every test case in a fresh copy of the
+   compiled program. Copies are killed along with their template.
+   A template keeps fork(), recvmsg() and prctl() (to lock down its copies)
+   allowed, so guest code only runs in it while compile_script() loads the
+   script: define functions in, and call functions of, the copies. Guest
+   code that breaks out of the interpreter at load time can still fork;
+   that's bounded by config_cgroup_pids, or else config_template_nproc,
+   which doesn't apply to root. */
+language_t* wrap_sandbox_template(language_t*language);
+language_t* wrap_sandbox_template_from_zygote(zygote_t*zygote);
+language_t* sandbox_fork(language_t*li);
+
 language_t* interpreter_by_extension(const char*filename);
+language_t* template_interpreter_by_extension(const char*filename);
 language_t* unsafe_interpreter_by_extension(const char*filename);
 
+/* With config_pool_size set, interpreter_by_extension() hands out
+   sandboxes from a pool per language, refilled in the background. */
+bool interpreter_pool_stats(const char*filename, pool_stats_t*stats);
+void interpreter_pools_destroy();
+
+/* With config_zygote set, sandboxes are forked from a zygote per language.
+   Destroy the pools first, they spawn sandboxes from the zygotes. */
+void interpreter_zygotes_destroy();
+
 void language_error(language_t*l, const char*error, ...);
 #define language_log language_error
 
 value_t* call_function_with_timeout(language_t*l, const char*function, value_t*args, int max_seconds, bool*timeout);
+value_t* call_function_with_timeout_ms(language_t*l, const char*function, value_t*args, int max_ms, bool*timeout);
 value_t* compile_and_run_function_with_timeout(language_t*l, const char*script, const char*function, value_t*args, int max_seconds, bool*timeout);
 
+/* Call function for every entry of args_list (an array of argument arrays).
+   Each call gets max_seconds. If stop_on_failure is set, no further calls
+   are made after the first one that fails. In a sandbox, a call that runs
+   out of time is interrupted, and counts as failed; without one, the
+   batch ends there. */
+batch_t* call_function_batch(language_t*l, const char*function, value_t*args_list, int max_seconds, bool stop_on_failure);
+void batch_destroy(batch_t*batch);
+
 #endif //__language_interpreter_h__
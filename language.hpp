@@ -0,0 +1,287 @@
+/* language.hpp
+   C++17 binding of host functions, with signatures deduced at compile time
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#ifndef __language_hpp__
+#define __language_hpp__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <exception>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "language.h"
+}
+
+/* Usage:
+
+       static int32_t add2(int32_t a, int32_t b) { return a + b; }
+       ...
+       sandbox::bind(li, "add2", &add2);
+       sandbox::bind(li, "greet", [&](std::string who) { return "hello " + who; });
+
+   The parameter and return types are taken from the C++ type of the
+   callable, so there's no signature string to keep in sync, and no libffi
+   between the guest and the host function: the generated thunk unpacks
+   the argument array straight into typed parameters.
+
+   Supported parameter types are int32_t (int), float, double, bool,
+   const char*, std::string, std::vector<int32_t>, std::vector<float>
+   (packed arrays, or arrays of numbers) and value_t* (arrays, passed
+   through as borrowed pointers).
+   Return types are the same, plus void. A returned value_t* is handed to
+   the guest, which takes ownership, like with define_function(). A
+   returned const char* is copied.
+
+   Argument count and types are checked against what the guest actually
+   passed, with the same conversions as define_function() (numbers and
+   booleans convert into one another, and into strings). Exceptions don't
+   cross into the interpreter; they're reported through language_error. */
+
+namespace sandbox {
+
+namespace detail {
+
+template <typename T, typename = void> struct arg;
+
+template <typename T>
+struct arg<T, std::enable_if_t<std::is_same_v<T, int32_t> || std::is_same_v<T, bool> || std::is_floating_point_v<T>>> {
+    static constexpr type_t type = std::is_floating_point_v<T> ? TYPE_FLOAT32 :
+                                   std::is_same_v<T, bool> ? TYPE_BOOLEAN : TYPE_INT32;
+    static bool accepts(const value_t*v) {
+        return v->type == TYPE_FLOAT32 || v->type == TYPE_INT32 || v->type == TYPE_BOOLEAN;
+    }
+    static T get(const value_t*v) {
+        switch(v->type) {
+            case TYPE_FLOAT32: return (T)v->f32;
+            case TYPE_INT32: return (T)v->i32;
+            default: return (T)v->b;
+        }
+    }
+};
+
+template <> struct arg<std::string> {
+    static constexpr type_t type = TYPE_STRING;
+    static bool accepts(const value_t*v) {
+        return v->type == TYPE_STRING || arg<int32_t>::accepts(v);
+    }
+    static std::string get(const value_t*v) {
+        switch(v->type) {
+            case TYPE_STRING: return v->str;
+            case TYPE_FLOAT32: return std::to_string(v->f32);
+            case TYPE_INT32: return std::to_string(v->i32);
+            default: return v->b ? "true" : "false";
+        }
+    }
+};
+
+/* Only real strings; converting numbers would need storage that outlives
+   the call into the host function. Use std::string for that. */
+template <> struct arg<const char*> {
+    static constexpr type_t type = TYPE_STRING;
+    static bool accepts(const value_t*v) { return v->type == TYPE_STRING; }
+    static const char* get(const value_t*v) { return v->str; }
+};
+
+template <> struct arg<value_t*> {
+    static constexpr type_t type = TYPE_ARRAY;
+    static bool accepts(const value_t*v) { return v->type == TYPE_ARRAY; }
+    static value_t* get(const value_t*v) { return const_cast<value_t*>(v); }
+};
+
+/* Packed arrays, or arrays of numbers, like "I" and "F" in signatures */
+template <typename T>
+struct arg<std::vector<T>, std::enable_if_t<std::is_same_v<T, int32_t> || std::is_same_v<T, float>>> {
+    static constexpr type_t type = std::is_same_v<T, float> ? TYPE_FLOAT32_ARRAY : TYPE_INT32_ARRAY;
+    static bool accepts(const value_t*v) {
+        if(v->type == TYPE_INT32_ARRAY || v->type == TYPE_FLOAT32_ARRAY)
+            return true;
+        if(v->type != TYPE_ARRAY)
+            return false;
+        for(int i = 0; i < v->length; i++) {
+            value_t tmp;
+            if(!arg<T>::accepts(array_get(v, i, &tmp)))
+                return false;
+        }
+        return true;
+    }
+    static std::vector<T> get(const value_t*v) {
+        if(v->type == type)
+            return std::vector<T>((const T*)v->i32s, (const T*)v->i32s + v->length);
+        std::vector<T> out(v->length);
+        for(int i = 0; i < v->length; i++) {
+            value_t tmp;
+            switch(v->type) {
+                case TYPE_INT32_ARRAY: out[i] = (T)v->i32s[i]; break;
+                case TYPE_FLOAT32_ARRAY: out[i] = (T)v->f32s[i]; break;
+                default: out[i] = arg<T>::get(array_get(v, i, &tmp)); break;
+            }
+        }
+        return out;
+    }
+};
+
+template <typename T> struct arg<const T&> : arg<T> {};
+
+template <typename T, typename = void> struct ret;
+
+template <> struct ret<void> {
+    template <typename F> static value_t* call(F&&f) { f(); return value_new_void(); }
+};
+template <> struct ret<int32_t> {
+    template <typename F> static value_t* call(F&&f) { return value_new_int32(f()); }
+};
+template <typename T> struct ret<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+    template <typename F> static value_t* call(F&&f) { return value_new_float32(f()); }
+};
+template <> struct ret<bool> {
+    template <typename F> static value_t* call(F&&f) { return value_new_boolean(f()); }
+};
+template <> struct ret<const char*> {
+    template <typename F> static value_t* call(F&&f) { return value_new_string(f()); }
+};
+template <> struct ret<std::string> {
+    template <typename F> static value_t* call(F&&f) { return value_new_string(f().c_str()); }
+};
+template <> struct ret<std::vector<int32_t>> {
+    template <typename F> static value_t* call(F&&f) {
+        std::vector<int32_t> r = f();
+        return value_new_int32_array(r.data(), r.size());
+    }
+};
+template <> struct ret<std::vector<float>> {
+    template <typename F> static value_t* call(F&&f) {
+        std::vector<float> r = f();
+        return value_new_float32_array(r.data(), r.size());
+    }
+};
+template <> struct ret<value_t*> {
+    template <typename F> static value_t* call(F&&f) { return f(); }
+};
+
+template <typename T, typename = void> struct is_arg : std::false_type {};
+template <typename T> struct is_arg<T, std::void_t<decltype(arg<T>::type)>> : std::true_type {};
+template <typename T, typename = void> struct is_ret : std::false_type {};
+template <typename T> struct is_ret<T, std::void_t<decltype(&ret<T>::template call<T(*)()>)>> : std::true_type {};
+
+/* Signature of a function pointer, or of a (non-generic) lambda/functor */
+template <typename F> struct signature : signature<decltype(&F::operator())> {};
+template <typename R, typename... A> struct signature<R(*)(A...)> {
+    typedef R result;
+    typedef std::tuple<A...> params;
+};
+template <typename C, typename R, typename... A> struct signature<R(C::*)(A...)> : signature<R(*)(A...)> {};
+template <typename C, typename R, typename... A> struct signature<R(C::*)(A...) const> : signature<R(*)(A...)> {};
+
+template <typename F, typename R, typename... A>
+struct binding {
+    static_assert(is_ret<R>::value, "unsupported return type for a sandbox function");
+    static_assert((is_arg<A>::value && ...), "unsupported parameter type for a sandbox function");
+
+    F f;
+    language_t*li;
+    std::string name;
+
+    static value_t* call(value_t*self, value_t*args)
+    {
+        binding*b = static_cast<binding*>(self->internal);
+        if(args->type != TYPE_ARRAY) {
+            language_error(b->li, "%s: function parameters must be an array\n", b->name.c_str());
+            return NULL;
+        }
+        if(args->length != (int)sizeof...(A)) {
+            language_error(b->li, "%s: wrong number of arguments: expected %d, got %d\n",
+                           b->name.c_str(), (int)sizeof...(A), args->length);
+            return NULL;
+        }
+        return b->invoke(args, std::index_sequence_for<A...>{});
+    }
+
+    template <size_t... I>
+    value_t* invoke(value_t*args, std::index_sequence<I...>)
+    {
+        static const type_t types[] = {arg<A>::type..., TYPE_VOID};
+        static bool (*const checks[])(const value_t*) = {arg<A>::accepts..., NULL};
+        value_t tmp[sizeof...(A) + 1];
+        value_t*data[sizeof...(A) + 1];
+        for(size_t i = 0; i < sizeof...(A); i++) {
+            data[i] = array_get(args, i, &tmp[i]);
+        }
+        for(size_t i = 0; i < sizeof...(A); i++) {
+            if(!checks[i](data[i])) {
+                language_error(li, "%s: Can't convert parameter %d from %s to %s\n",
+                               name.c_str(), (int)i+1,
+                               type_to_string(data[i]->type), type_to_string(types[i]));
+                return NULL;
+            }
+        }
+        try {
+            return ret<R>::call([&]() -> R { return f(arg<A>::get(data[I])...); });
+        } catch(const std::exception&e) {
+            language_error(li, "%s: %s\n", name.c_str(), e.what());
+        } catch(...) {
+            language_error(li, "%s: unknown exception\n", name.c_str());
+        }
+        return NULL;
+    }
+
+    static void destroy(value_t*v)
+    {
+        delete static_cast<binding*>(v->internal);
+        free(v);
+    }
+};
+
+template <typename F, typename R, typename Tuple> struct binding_for;
+template <typename F, typename R, typename... A>
+struct binding_for<F, R, std::tuple<A...>> {
+    typedef binding<F, std::decay_t<R>, A...> type;
+};
+
+} // namespace detail
+
+/* Wrap a C++ callable in a function value, like value_new_cfunction() */
+template <typename F>
+value_t* function_new(language_t*li, const char*name, F f)
+{
+    typedef std::decay_t<F> Fn;
+    typedef detail::signature<Fn> sig;
+    typedef typename detail::binding_for<Fn, typename sig::result, typename sig::params>::type binding;
+
+    value_t*v = (value_t*)calloc(sizeof(value_t), 1);
+    v->type = TYPE_FUNCTION;
+    v->internal = new binding{std::move(f), li, name};
+    v->call = binding::call;
+    v->num_params = std::tuple_size_v<typename sig::params>;
+    v->destroy = binding::destroy;
+    return v;
+}
+
+/* Define a host function in the guest, like define_function() */
+template <typename F>
+void bind(language_t*li, const char*name, F f)
+{
+    li->define_function(li, name, function_new(li, name, std::move(f)));
+}
+
+} // namespace sandbox
+
+#endif
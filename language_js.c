@@ -1,14 +1,17 @@
 #include <stdbool.h>
 #include <string.h>
+#include <signal.h>
 #ifdef _MSC_VER
 # define XP_WIN
 #else
 # define XP_UNIX
 #endif
 #include <jsapi.h>
+#include <jsdbgapi.h>
 #include <ffi.h>
 
 #include "language.h"
+#include "settings.h"
 #include "util.h"
 #include "dict.h"
 #include "function.h"
@@ -20,6 +23,8 @@ typedef struct _js_internal {
     JSObject *global;
     char*buffer;
     char noerrors;
+    volatile sig_atomic_t interrupted;
+    int64_t budget;
 
     dict_t* jsfunction_to_function;
 } js_internal_t;
@@ -39,6 +44,65 @@ static void error_callback(JSContext *cx, const char *message, JSErrorReport *re
     language_error(js->li, "line %u: %s\n", (unsigned int) report->lineno, message);
 }
 
+/* Returning false without an exception pending terminates the script,
+   in a way the guest can't catch. */
+static JSBool operation_callback(JSContext *cx)
+{
+    js_internal_t*js = JS_GetContextPrivate(cx);
+    if(js->interrupted) {
+        language_error(js->li, "Interrupted\n");
+        return JS_FALSE;
+    }
+    return JS_TRUE;
+}
+
+/* JS_TriggerOperationCallback() takes the GC lock. Should the signal arrive
+   while we hold it, we hang, and the sandbox gets killed instead. */
+static void interrupt_js(language_t*li)
+{
+    js_internal_t*js = (js_internal_t*)li->internal;
+    js->interrupted = 1;
+    JS_TriggerOperationCallback(js->cx);
+}
+
+/* Called for every bytecode. Like operation_callback(), an error without
+   an exception pending can't be caught by the guest. */
+static JSTrapStatus budget_hook(JSContext *cx, JSScript *script, jsbytecode *pc, jsval *rval, void *closure)
+{
+    js_internal_t*js = (js_internal_t*)closure;
+    if(js->li->budget_left > 0) {
+        js->li->budget_left--;
+        return JSTRAP_CONTINUE;
+    }
+    language_error(js->li, "Out of budget\n");
+    return JSTRAP_ERROR;
+}
+
+static void set_budget_js(language_t*li, int64_t max_ops)
+{
+    js_internal_t*js = (js_internal_t*)li->internal;
+    js->budget = max_ops > 0 ? max_ops : 0;
+}
+
+/* Only the interpreter calls the interrupt hook, so calls with a budget
+   run without the JIT. */
+static void arm_budget(js_internal_t*js)
+{
+    js->li->budget_left = js->budget;
+    if(js->budget) {
+        JS_SetOptions(js->cx, JSOPTION_VAROBJFIX);
+        JS_SetInterrupt(js->rt, budget_hook, js);
+    }
+}
+
+static void disarm_budget(js_internal_t*js)
+{
+    if(js->budget) {
+        JS_ClearInterrupt(js->rt, NULL, NULL);
+        JS_SetOptions(js->cx, JSOPTION_VAROBJFIX | JSOPTION_JIT);
+    }
+}
+
 static bool initialize_js(language_t*li, size_t mem_size)
 {
     if(li->internal)
@@ -62,6 +126,7 @@ static bool initialize_js(language_t*li, size_t mem_size)
     JS_SetOptions(js->cx, JSOPTION_VAROBJFIX | JSOPTION_JIT);
     JS_SetVersion(js->cx, JSVERSION_LATEST);
     JS_SetErrorReporter(js->cx, error_callback);
+    JS_SetOperationCallback(js->cx, operation_callback);
 
     js->global = JS_NewCompartmentAndGlobalObject(js->cx, &global_class, NULL);
     if (js->global == NULL)
@@ -111,7 +176,7 @@ static value_t* jsval_to_value(const js_internal_t*js, jsval v)
                 language_error(js->li, "Can't determine array length\n");
                 return NULL;
             }
-            array_append(a, jsval_to_value(js, entry));
+            array_append_take(a, jsval_to_value(js, entry));
         }
         return a;
     } else {
@@ -128,7 +193,7 @@ static value_t* js_argv_to_args(language_t*li, JSContext *cx, uintN argc, jsval
     int i;
     value_t*args = array_new();
     for(i=0;i<argc;i++) {
-        array_append(args, jsval_to_value(js, argv[i]));
+        array_append_take(args, jsval_to_value(js, argv[i]));
     }
     return args;
 }
@@ -159,12 +224,28 @@ static jsval value_to_jsval(JSContext*cx, value_t*value)
                 return OBJECT_TO_JSVAL(NULL);
             int i;
             for(i=0;i<value->length;i++) {
-                jsval entry = value_to_jsval(cx, value->data[i]);
+                value_t tmp;
+                jsval entry = value_to_jsval(cx, array_get(value, i, &tmp));
                 JS_SetElement(cx, array, i, &entry);
             }
             return OBJECT_TO_JSVAL(array);
         }
         break;
+        case TYPE_INT32_ARRAY:
+        case TYPE_FLOAT32_ARRAY: {
+            /* numbers aren't GC things, so the vector needs no rooting,
+               and the array is created from it in one call */
+            jsval*vector = malloc(sizeof(jsval) * (value->length ? value->length : 1));
+            int i;
+            for(i=0;i<value->length;i++) {
+                vector[i] = value->type == TYPE_INT32_ARRAY ?
+                    INT_TO_JSVAL(value->i32s[i]) : DOUBLE_TO_JSVAL(value->f32s[i]);
+            }
+            JSObject *array = JS_NewArrayObject(cx, value->length, vector);
+            free(vector);
+            return OBJECT_TO_JSVAL(array);
+        }
+        break;
         default: {
             return OBJECT_TO_JSVAL(NULL);
         }
@@ -236,6 +317,7 @@ static bool compile_script_js(language_t*li, const char*script)
     JSBool ok;
     
     log_dbg("[js] compiling script %p %p", script, js);
+    js->interrupted = 0;
     ok = JS_EvaluateScript(js->cx, js->global, script, strlen(script), "__main__", 1, &rval);
     if(!ok) {
         language_error(li, "Couldn't compile javascript program\n");
@@ -265,22 +347,33 @@ static value_t* call_function_js(language_t*li, const char*name, value_t* _args)
     js_internal_t*js = (js_internal_t*)li->internal;
     log_dbg("[js] calling function %s", name);
     assert(_args->type == TYPE_ARRAY);
+    js->interrupted = 0;
 
     JSBool ok;
+    /* only timed for latency profiles */
+    int64_t start = config_profile ? monotonic_nsec() : 0;
     jsval* args = malloc(sizeof(jsval)*_args->length);
     int i;
     for(i=0;i<_args->length;i++) {
-        args[i] = value_to_jsval(js->cx, _args->data[i]);
+        value_t tmp;
+        args[i] = value_to_jsval(js->cx, array_get(_args, i, &tmp));
     }
+    li->convert_nsec = config_profile ? monotonic_nsec() - start : 0;
     jsval rval;
 
+    arm_budget(js);
     ok = JS_CallFunctionName(js->cx, js->global, name, _args->length, args, &rval);
+    disarm_budget(js);
     if(!ok) {
         language_error(js->li, "execution of function %s failed\n", name);
         return NULL;
     }
 
+    start = config_profile ? monotonic_nsec() : 0;
     value_t*val = jsval_to_value(js, rval);
+    if(config_profile) {
+        li->convert_nsec += monotonic_nsec() - start;
+    }
 #ifdef DEBUG
     printf("[js] return value: ");
     value_dump(val);
@@ -313,6 +406,8 @@ language_t* javascript_interpreter_new()
     li->call_function = call_function_js;
     li->define_function = define_function_js;
     li->define_constant = define_constant_js;
+    li->interrupt = interrupt_js;
+    li->set_budget = set_budget_js;
     li->destroy = destroy_js;
     return li;
 }
@@ -7,13 +7,19 @@
 #include <lualib.h>
 #include <errno.h>
 #include "language.h"
+#include "settings.h"
 
 typedef struct _lua_internal {
     language_t*li;
     lua_State* state;
     int method_count;
+    int64_t budget;
+    int budget_step;
 } lua_internal_t;
 
+/* how many instructions the budget hook lets pass between two runs */
+#define BUDGET_STEP 1000
+
 static const luaL_reg lualibs[] =
 {
     {"base", luaopen_base}, // dofile etc.
@@ -97,14 +103,76 @@ static bool initialize_lua(language_t*li, size_t mem_size)
     lua_State*l = lua->state = lua_open();
     openlualibs(l);
 
+    /* for hooks, which only get to see the lua_State */
+    lua_pushlightuserdata(l, lua);
+    lua_setfield(l, LUA_REGISTRYINDEX, "lua_internal");
+
     return true;
 }
 
+static void interrupt_hook(lua_State*l, lua_Debug*ar)
+{
+    luaL_error(l, "Interrupted");
+}
+
+/* This is what lua.c does on ^C. The hook stays armed until the next call,
+   so that a pcall() in the guest can't catch the error and carry on. */
+static void interrupt_lua(language_t*li)
+{
+    lua_internal_t*lua = (lua_internal_t*)li->internal;
+    lua_sethook(lua->state, interrupt_hook, LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
+}
+
+static lua_internal_t* get_internal(lua_State*l)
+{
+    lua_getfield(l, LUA_REGISTRYINDEX, "lua_internal");
+    lua_internal_t*lua = (lua_internal_t*)lua_touserdata(l, -1);
+    lua_pop(l, 1);
+    return lua;
+}
+
+/* Runs every budget_step instructions. Once the budget is gone, that's
+   every instruction, so that a pcall() in the guest can't carry on. */
+static void budget_hook(lua_State*l, lua_Debug*ar)
+{
+    lua_internal_t*lua = get_internal(l);
+    language_t*li = lua->li;
+    li->budget_left -= lua->budget_step;
+    if(li->budget_left < 0) {
+        li->budget_left = 0;
+        lua->budget_step = 1;
+        lua_sethook(l, budget_hook, LUA_MASKCOUNT, 1);
+        luaL_error(l, "Out of budget");
+    }
+    lua->budget_step = li->budget_left < BUDGET_STEP ? (li->budget_left ? li->budget_left : 1) : BUDGET_STEP;
+    lua_sethook(l, budget_hook, LUA_MASKCOUNT, lua->budget_step);
+}
+
+static void set_budget_lua(language_t*li, int64_t max_ops)
+{
+    lua_internal_t*lua = (lua_internal_t*)li->internal;
+    lua->budget = max_ops > 0 ? max_ops : 0;
+}
+
+/* Also takes down the interrupt hook of a previous call */
+static void arm_budget(lua_internal_t*lua)
+{
+    lua_State*l = lua->state;
+    lua->li->budget_left = lua->budget;
+    if(!lua->budget) {
+        lua_sethook(l, NULL, 0, 0);
+        return;
+    }
+    lua->budget_step = lua->budget < BUDGET_STEP ? lua->budget : BUDGET_STEP;
+    lua_sethook(l, budget_hook, LUA_MASKCOUNT, lua->budget_step);
+}
+
 static bool compile_script_lua(language_t*li, const char*script)
 {
     lua_internal_t*lua = (lua_internal_t*)li->internal;
     lua_State*l = lua->state;
 
+    lua_sethook(l, NULL, 0, 0);
     int error = luaL_loadbuffer(l, script, strlen(script), "@file.lua");
     if(!error) {
         error = lua_pcall(l, 0, LUA_MULTRET, 0);
@@ -140,12 +208,27 @@ static void push_value(lua_State*l, value_t*value)
         case TYPE_ARRAY: {
             lua_newtable(l);
             for(i=0;i<value->length;i++) {
+                value_t tmp;
                 lua_pushinteger(l, i);
-                push_value(l, value->data[i]);
+                push_value(l, array_get(value, i, &tmp));
                 lua_settable(l, -3);
             }
         }
         break;
+        case TYPE_INT32_ARRAY:
+        case TYPE_FLOAT32_ARRAY: {
+            /* sized upfront, and filled without metamethods */
+            lua_createtable(l, value->length, 1);
+            for(i=0;i<value->length;i++) {
+                if(value->type == TYPE_INT32_ARRAY) {
+                    lua_pushinteger(l, value->i32s[i]);
+                } else {
+                    lua_pushnumber(l, value->f32s[i]);
+                }
+                lua_rawseti(l, -2, i);
+            }
+        }
+        break;
         default: {
             lua_pushnil(l);
         }
@@ -181,7 +264,7 @@ static value_t* lua_to_value(language_t*li, int idx)
                 lua_pop(l, 1);
                 break;
             }
-            array_append(array, lua_to_value(li, -1));
+            array_append_take(array, lua_to_value(li, -1));
             lua_pop(l, 1);
         }
         return array;
@@ -221,7 +304,7 @@ static int lua_function_proxy(lua_State*l)
         if(a == NULL) {
             luaL_argerror(l, i+1, "invalid or missing value");
         }
-        array_append(args, a);
+        array_append_take(args, a);
     }
     value_t*ret = f->call(f, args);
     value_destroy(args);
@@ -266,6 +349,7 @@ static value_t* call_function_lua(language_t*li, const char*name, value_t*args)
     lua_internal_t*lua = (lua_internal_t*)li->internal;
     lua_State*l = lua->state;
 
+    arm_budget(lua);
     lua_getfield(l, LUA_GLOBALSINDEX, name);
 
     if(!lua_isfunction(l, -1)) {
@@ -273,20 +357,31 @@ static value_t* call_function_lua(language_t*li, const char*name, value_t*args)
         return NULL;
     }
 
+    /* only timed for latency profiles */
+    int64_t start = config_profile ? monotonic_nsec() : 0;
     int i;
     for(i=0;i<args->length;i++) {
-        push_value(l, args->data[i]);
+        value_t tmp;
+        push_value(l, array_get(args, i, &tmp));
     }
+    li->convert_nsec = config_profile ? monotonic_nsec() - start : 0;
 
     int error = lua_pcall(l, /*nargs*/args->length, /*nresults*/1, 0);
+    if(lua->budget) {
+        lua_sethook(l, NULL, 0, 0);
+    }
     if(error) {
         show_error(li, l);
         language_error(li, "Error calling function %s: %d\n", name, error);
         return NULL;
     }
 
+    start = config_profile ? monotonic_nsec() : 0;
     value_t*ret = lua_to_value(li, -1);
     lua_pop(l, 1);
+    if(config_profile) {
+        li->convert_nsec += monotonic_nsec() - start;
+    }
 
     return ret;
 }
@@ -311,6 +406,9 @@ language_t* lua_interpreter_new()
     li->call_function = call_function_lua;
     li->define_function = define_function_lua;
     li->define_constant = define_constant_lua;
+    li->interrupt = interrupt_lua;
+    li->interrupt_signal_safe = true;
+    li->set_budget = set_budget_lua;
     li->destroy = destroy_lua;
     return li;
 }
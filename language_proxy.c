@@ -3,22 +3,147 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
 #include <signal.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include "language.h"
+#include "ring.h"
+#include "perf.h"
+#include "cgroup.h"
+#include "trace.h"
+#include "zygote.h"
+#include "loop.h"
 #include "dict.h"
 #include "seccomp.h"
 #include "settings.h"
 
+/* A shared memory area for values too big to be copied through the
+   transport. Each direction has its own; the sender allocates, the
+   receiver counts the bytes of the chunks it's done decoding. Once
+   everything has been released, the sender starts over at the beginning.
+   Both sides can write all of it, so the size isn't kept in here: each
+   side derives it from the mapping (see attach_shared_memory()). */
+typedef struct _segment {
+    volatile uint32_t head;
+    char pad1[60];
+    volatile uint32_t released;
+    char pad2[60];
+    char data[0];
+} segment_t;
+
+typedef struct _message {
+    char*data;
+    int len;
+    int size;
+    int pos;
+    /* data points into a segment, and must not be resized or freed */
+    bool borrowed;
+    segment_t*segment;
+    uint32_t segment_size;
+    /* bytes of the segment the frame's values take up (see
+       release_frame()), and how many of them we released so far */
+    uint32_t segment_bytes;
+    uint32_t segment_released;
+} message_t;
+
+typedef struct _frame {
+    message_t m;
+    struct _frame*next;
+} frame_t;
+
 typedef struct _proxy_internal {
     language_t*li;
     language_t*old;
     pid_t child_pid;
     int fd_w;
     int fd_r;
-    int timeout;
+    /* the child was forked by a zygote or a template, not by us */
+    bool foreign_child;
+    /* the child is a template: fork requests go through this socket */
+    int fork_sock;
+    void*shm;
+    int shm_size;
+    ring_t*ring_w;
+    ring_t*ring_r;
+    segment_t*segment_w;
+    segment_t*segment_r;
+    /* usable bytes in each segment, from the size of our mapping; the
+       segments themselves are shared, and can't be trusted */
+    uint32_t segment_size;
+    bool sandbox;
+    int timeout_ms;
+    /* operations every call may use (see set_budget()), 0 = no limit */
+    int64_t budget;
+    /* counts the child's CPU (see config_cpu_counter) */
+    perf_counter_t*cpu;
+    int64_t cpu_limit;
+    int64_t cpu_start;
+    /* the child's CPU clock, and where it was when the call started */
+    clockid_t guest_clock;
+    bool has_guest_clock;
+    int64_t guest_start;
+    /* the child's own cgroup (see config_cgroup) */
+    cgroup_t*cgroup;
+    /* when the call in progress started, and how long the last one took
+       (usec, wall clock) */
+    int64_t call_start;
+    int64_t call_usec;
+    sandbox_stats_t stats;
+    /* latency histograms (see config_profile): name -> call_profile_t */
+    dict_t*profiles;
+    /* the sandbox's side of the last call (see send_profile()) */
+    bool has_guest_profile;
+    int64_t guest_phases[NUM_PHASES];
+    int64_t guest_span;
+    /* in the sandbox: time the call in progress waited for callbacks */
+    int64_t callback_nsec;
+    /* in the sandbox: for frames that have to go out while proxy->out
+       holds a result */
+    message_t side_out;
+    /* what happened lately (see config_trace). In the sandbox, these are
+       the events the host hasn't seen yet (see send_trace()). */
+    trace_t*trace;
+    int64_t created;
     dict_t*callback_functions;
     bool in_call;
+    /* the call in progress ran out of time, and we asked the sandbox to
+       interrupt the guest (see interrupt_child()) */
+    bool interrupted;
+    message_t in;
+    message_t out;
+
+    /* frames that arrived while we were waiting for something else */
+    frame_t*queue_first;
+    frame_t*queue_last;
+
+    int last_ticket;
+    dict_t*async_calls;
+
+    /* the batch call in progress */
+    batch_t*batch;
+    int batch_timeout_ms;
+
+    /* driven by an event loop (see attach_loop_proxy()) */
+    sandbox_loop_t*loop;
+    message_t rx;   /* received, but not yet decoded */
+    message_t tx;   /* not yet written; tx.pos is how far we got */
+    dict_t*loop_calls;
+    bool broken;
+    bool dispatching;
+    bool destroyed;
 } proxy_internal_t;
 
 enum {
@@ -27,6 +152,11 @@ enum {
     COMPILE_SCRIPT = 3,
     IS_FUNCTION = 4,
     CALL_FUNCTION =  5,
+    CALL_FUNCTION_ASYNC = 6,
+    CALLBACK_RETURN = 7,
+    CALL_FUNCTION_BATCH = 8,
+    FORK_SANDBOX = 9,
+    SET_BUDGET = 17,
 };
 
 enum {
@@ -34,109 +164,516 @@ enum {
     RESP_RETURN = 11,
     RESP_ERROR = 12,
     RESP_LOG = 13,
+    RESP_ASYNC_RETURN = 14,
+    RESP_ASYNC_ERROR = 15,
+    RESP_BATCH_ITEM = 16,
+    RESP_BUDGET = 18,
+    RESP_PROFILE = 19,
+    RESP_TRACE = 20,
 };
 
+typedef struct _call_profile {
+    histogram_t phases[NUM_PHASES];
+} call_profile_t;
+
+/* stored for asynchronous calls that failed, or were interrupted because
+   they ran out of time */
+static value_t async_failed;
+static value_t async_timed_out;
+
 #define MAX_ARRAY_SIZE 1024
 #define MAX_STRING_SIZE 4096
 
-static void write_byte(int fd, uint8_t b)
+/* Every request and response travels as one frame: a 32 bit payload length,
+   and the number of bytes its values take up in the shared segment,
+   followed by the payload. Frames from the sandbox are bounded by this. */
+#define FRAME_HEADER_SIZE (2 * sizeof(int32_t))
+#define MAX_MESSAGE_SIZE (MAX_ARRAY_SIZE * (MAX_STRING_SIZE + 16) + 65536)
+
+/* values whose encoding is at least this big are passed through the
+   shared segment (if there is one), instead of inside the message */
+#define SEGMENT_THRESHOLD 65536
+#define WIRE_SEGMENT 0x80
+
+/* how long the guest gets to abort a call that ran out of time */
+#define INTERRUPT_GRACE_MS 1000
+
+static void message_start(message_t*m)
+{
+    m->len = FRAME_HEADER_SIZE;
+    m->pos = FRAME_HEADER_SIZE;
+    m->segment_bytes = 0;
+}
+
+static bool message_grow(message_t*m, int len)
+{
+    if(m->size >= len)
+        return true;
+    if(m->borrowed)
+        return false;
+    int size = m->size ? m->size : 256;
+    while(size < len) {
+        size <<= 1;
+    }
+    char*data = realloc(m->data, size);
+    if(!data)
+        return false;
+    m->data = data;
+    m->size = size;
+    return true;
+}
+
+static void message_free(message_t*m)
+{
+    free(m->data);
+    m->data = NULL;
+    m->size = m->len = m->pos = 0;
+}
+
+static void message_write(message_t*m, const void*data, int len)
+{
+    if(!message_grow(m, m->len + len))
+        return;
+    memcpy(m->data + m->len, data, len);
+    m->len += len;
+}
+
+static bool message_read(message_t*m, void*data, int len)
+{
+    if(len < 0 || len > m->len - m->pos)
+        return false;
+    memcpy(data, m->data + m->pos, len);
+    m->pos += len;
+    return true;
+}
+
+static int segment_alloc(message_t*m, int len)
+{
+    segment_t*s = m->segment;
+    uint32_t head = s->head;
+    __sync_synchronize();
+    uint32_t released = s->released;
+    if(head > m->segment_size || released > head) {
+        /* the other side scribbled over the segment: stop using it */
+        log_dbg("[proxy] Corrupt shared segment (head %u, released %u)", head, released);
+        m->segment = NULL;
+        return -1;
+    }
+    if(released == head) {
+        /* the receiver is done with everything we gave it, start over */
+        head = 0;
+        s->released = 0;
+    }
+    if(len > m->segment_size - head)
+        return -1;
+    s->head = head + len;
+    m->segment_bytes += len;
+    return head;
+}
+
+static void segment_release(segment_t*s, uint32_t size)
+{
+    /* chunks aren't necessarily decoded in order (the sandbox queues
+       commands it receives while waiting for a callback to return) */
+    __sync_fetch_and_add(&s->released, size);
+}
+
+/* We're done with a received frame. Values are released as they're
+   decoded, but frames we drop, or stop decoding halfway through, leave
+   chunks behind, and the sender can only start over at the beginning of
+   the segment once all of them are released. The header tells us how
+   much that is. If the other side lies about it, it only confuses its
+   own segment. */
+static void release_frame(message_t*m)
+{
+    if(m->segment && m->segment_bytes > m->segment_released) {
+        segment_release(m->segment, m->segment_bytes - m->segment_released);
+    }
+    m->segment_bytes = m->segment_released = 0;
+}
+
+/* Deadlines are absolute (in monotonic_usec() time), so a frame that
+   arrives in several pieces doesn't need any bookkeeping, and a timeout
+   is simply the deadline having passed. */
+static int64_t deadline_after(int timeout_ms)
+{
+    return monotonic_usec() + timeout_ms * 1000ll;
+}
+
+static bool deadline_passed(int64_t deadline)
+{
+    return deadline && monotonic_usec() >= deadline;
+}
+
+static bool transport_read(proxy_internal_t*proxy, void*data, int len, int64_t deadline)
+{
+    if(proxy->ring_r) {
+        return ring_read(proxy->ring_r, data, len, deadline);
+    }
+    return read_with_deadline(proxy->fd_r, data, len, deadline);
+}
+
+static bool receive_message(proxy_internal_t*proxy, message_t*m, int max_size, int64_t deadline)
+{
+    release_frame(m);
+    int32_t header[2] = {0, 0};
+    if(!transport_read(proxy, header, sizeof(header), deadline))
+        return false;
+    int32_t l = header[0];
+    /* Frames are sent in one go, so the rest is on its way. Timing out in
+       the middle of one would leave us out of sync with the other side. */
+    if(deadline) {
+        deadline = deadline_after(INTERRUPT_GRACE_MS);
+    }
+    if(l<0 || (max_size && l>max_size))
+        return false;
+    if(!message_grow(m, l + FRAME_HEADER_SIZE))
+        return false;
+    memcpy(m->data, header, sizeof(header));
+    m->len = l + FRAME_HEADER_SIZE;
+    m->pos = FRAME_HEADER_SIZE;
+    m->segment_bytes = header[1];
+    proxy->stats.bytes_received += m->len;
+    return transport_read(proxy, m->data + FRAME_HEADER_SIZE, l, deadline);
+}
+
+/* Move a received frame to the end of the queue. The message keeps its
+   segment, but starts out with an empty buffer again. */
+static void queue_push(proxy_internal_t*proxy, message_t*m)
+{
+    frame_t*frame = calloc(1, sizeof(frame_t));
+    frame->m = *m;
+    m->data = NULL;
+    m->size = m->len = m->pos = 0;
+    m->segment_bytes = m->segment_released = 0;
+
+    if(proxy->queue_last) {
+        proxy->queue_last->next = frame;
+    } else {
+        proxy->queue_first = frame;
+    }
+    proxy->queue_last = frame;
+}
+
+static bool queue_pop(proxy_internal_t*proxy, message_t*m)
+{
+    frame_t*frame = proxy->queue_first;
+    if(!frame)
+        return false;
+    proxy->queue_first = frame->next;
+    if(!proxy->queue_first) {
+        proxy->queue_last = NULL;
+    }
+    message_free(m);
+    *m = frame->m;
+    free(frame);
+    return true;
+}
+
+static void queue_free(proxy_internal_t*proxy)
+{
+    message_t m;
+    memset(&m, 0, sizeof(m));
+    while(queue_pop(proxy, &m)) {
+        message_free(&m);
+    }
+}
+
+/* The next frame from the other side, either one we queued earlier or a
+   new one from the transport */
+static bool next_message(proxy_internal_t*proxy, message_t*m, int max_size, int64_t deadline)
+{
+    release_frame(m);
+    if(queue_pop(proxy, m))
+        return true;
+    return receive_message(proxy, m, max_size, deadline);
+}
+
+/* Read a frame the child sent while we were trying to write, and queue it. */
+static bool queue_incoming(proxy_internal_t*proxy, int64_t deadline)
+{
+    message_t m;
+    memset(&m, 0, sizeof(m));
+    m.segment = proxy->in.segment;
+    m.segment_size = proxy->in.segment_size;
+    if(!receive_message(proxy, &m, MAX_MESSAGE_SIZE, deadline)) {
+        message_free(&m);
+        return false;
+    }
+    queue_push(proxy, &m);
+    return true;
+}
+
+/* Wait until we can write to the child again. */
+static bool wait_for_space(proxy_internal_t*proxy, int64_t deadline)
+{
+    int64_t left = deadline - monotonic_usec();
+    if(left <= 0)
+        return false;
+
+    if(proxy->ring_w) {
+        if(ring_readable(proxy->ring_r))
+            return queue_incoming(proxy, deadline);
+        usleep(50);
+        return true;
+    }
+
+    struct pollfd fds[2];
+    fds[0].fd = proxy->fd_w;
+    fds[0].events = POLLOUT;
+    fds[1].fd = proxy->fd_r;
+    fds[1].events = POLLIN;
+    int ret = poll(fds, 2, (left + 999) / 1000);
+    if(ret < 0)
+        return errno == EINTR;
+    if(ret == 0 || (fds[0].revents & POLLERR))
+        return false;
+    if(fds[1].revents & (POLLIN|POLLHUP))
+        return queue_incoming(proxy, deadline);
+    return true;
+}
+
+static bool transport_write(proxy_internal_t*proxy, const void*_data, int len)
+{
+    if(proxy->sandbox) {
+        if(proxy->ring_w) {
+            return ring_write(proxy->ring_w, _data, len, 0);
+        }
+        return write_with_retry(proxy->fd_w, _data, len);
+    }
+
+    /* With pipelined calls, the child might itself be blocked sending us
+       results, so we can't just block on a full pipe (or ring). Frames that
+       arrive while we wait are queued. The timeout keeps us from hanging
+       forever if the child died. */
+    const char*data = _data;
+    int64_t deadline = deadline_after(proxy->timeout_ms);
+    while(len > 0) {
+        int ret;
+        if(proxy->ring_w) {
+            ret = ring_write_some(proxy->ring_w, data, len);
+            if(ret < 0)
+                return false;
+        } else {
+            ret = write(proxy->fd_w, data, len);
+            if(ret < 0) {
+                if(errno != EINTR && errno != EAGAIN)
+                    return false;
+                ret = 0;
+            }
+        }
+        data += ret;
+        len -= ret;
+        if(len && !ret && !wait_for_space(proxy, deadline))
+            return false;
+    }
+    return true;
+}
+
+static bool loop_send(proxy_internal_t*proxy, message_t*m);
+
+static bool send_message(proxy_internal_t*proxy, message_t*m)
+{
+    int32_t header[2] = {m->len - FRAME_HEADER_SIZE, m->segment_bytes};
+    memcpy(m->data, header, sizeof(header));
+    proxy->stats.bytes_sent += m->len;
+    if(proxy->loop) {
+        return loop_send(proxy, m);
+    }
+    return transport_write(proxy, m->data, m->len);
+}
+
+static void write_int32(message_t*m, int32_t i)
+{
+    message_write(m, &i, sizeof(i));
+}
+
+static int32_t read_int32(message_t*m)
+{
+    int32_t i = 0;
+    message_read(m, &i, sizeof(i));
+    return i;
+}
+
+static void write_int64(message_t*m, int64_t i)
+{
+    message_write(m, &i, sizeof(i));
+}
+
+static int64_t read_int64(message_t*m)
 {
-    write(fd, &b, 1);
+    int64_t i = 0;
+    message_read(m, &i, sizeof(i));
+    return i;
 }
 
-static void write_string(int fd, const char*name)
+static void write_byte(message_t*m, uint8_t b)
+{
+    message_write(m, &b, 1);
+}
+
+static void write_string(message_t*m, const char*name)
 {
     int l = strlen(name);
-    write(fd, &l, sizeof(l));
-    write(fd, name, l);
+    message_write(m, &l, sizeof(l));
+    message_write(m, name, l);
+}
+
+static uint8_t read_byte(message_t*m)
+{
+    uint8_t b = 0;
+    message_read(m, &b, 1);
+    return b;
 }
 
-static char* read_string(int fd, int max_size, struct timeval* timeout)
+static char* read_string(message_t*m, int max_size)
 {
     int l = 0;
-    if(!read_with_timeout(fd, &l, sizeof(l), timeout))
+    if(!message_read(m, &l, sizeof(l)))
         return NULL;
-    if(l<0 || (max_size && l>=max_size))
+    if(l<0 || (max_size && l>=max_size) || l > m->len - m->pos)
         return NULL;
     char* s = malloc(l+1);
     if(!s)
         return NULL;
-    if(!read_with_timeout(fd, s, l, timeout))
-        return NULL;
+    message_read(m, s, l);
     s[l]=0;
     return s;
 }
 
-static const char* write_value(int fd, value_t*v)
+static void _write_value(message_t*m, value_t*v)
 { 
-    char b = v->type;
-    write(fd, &b, 1);
+    write_byte(m, v->type);
 
     switch(v->type) {
         case TYPE_VOID:
             return;
         case TYPE_FLOAT32:
-            write(fd, &v->f32, sizeof(v->f32));
+            message_write(m, &v->f32, sizeof(v->f32));
             return;
         case TYPE_INT32:
-            write(fd, &v->i32, sizeof(v->i32));
+            message_write(m, &v->i32, sizeof(v->i32));
             return;
         case TYPE_BOOLEAN:
-            write(fd, &v->b, sizeof(v->b));
+            message_write(m, &v->b, sizeof(v->b));
             return;
         case TYPE_STRING:
-            write_string(fd, v->str);
+            write_string(m, v->str);
             return;
         case TYPE_ARRAY:
-            write(fd, &v->length, sizeof(v->length));
+            message_write(m, &v->length, sizeof(v->length));
+            int i;
+            for(i=0;i<v->length;i++) {
+                value_t tmp;
+                _write_value(m, array_get(v, i, &tmp));
+            }
+            return;
+        case TYPE_INT32_ARRAY:
+        case TYPE_FLOAT32_ARRAY:
+            /* one block of machine words; both sides run on the same host */
+            message_write(m, &v->length, sizeof(v->length));
+            message_write(m, v->i32s, sizeof(int32_t) * v->length);
+            return;
+    }
+}
+
+static int value_wire_size(value_t*v)
+{
+    switch(v->type) {
+        case TYPE_FLOAT32:
+            return 1 + sizeof(v->f32);
+        case TYPE_INT32:
+            return 1 + sizeof(v->i32);
+        case TYPE_BOOLEAN:
+            return 1 + sizeof(v->b);
+        case TYPE_STRING:
+            return 1 + sizeof(int) + strlen(v->str);
+        case TYPE_ARRAY: {
+            int size = 1 + sizeof(v->length);
             int i;
             for(i=0;i<v->length;i++) {
-                write_value(fd, v->data[i]);
+                value_t tmp;
+                size += value_wire_size(array_get(v, i, &tmp));
             }
+            return size;
+        }
+        case TYPE_INT32_ARRAY:
+        case TYPE_FLOAT32_ARRAY:
+            return 1 + sizeof(v->length) + sizeof(int32_t) * v->length;
+        default:
+            return 1;
+    }
+}
+
+static void write_value(message_t*m, value_t*v)
+{
+    if(m->segment && (v->type == TYPE_ARRAY || v->type == TYPE_STRING ||
+                      v->type == TYPE_INT32_ARRAY || v->type == TYPE_FLOAT32_ARRAY)) {
+        int size = value_wire_size(v);
+        int offset;
+        if(size >= SEGMENT_THRESHOLD && (offset = segment_alloc(m, size)) >= 0) {
+            message_t chunk;
+            memset(&chunk, 0, sizeof(chunk));
+            chunk.data = m->segment->data + offset;
+            chunk.size = size;
+            chunk.borrowed = true;
+            _write_value(&chunk, v);
+
+            uint32_t ref[2] = {offset, size};
+            write_byte(m, WIRE_SEGMENT);
+            message_write(m, ref, sizeof(ref));
             return;
+        }
     }
+    _write_value(m, v);
 }
 
-static value_t* _read_value(int fd, int*count, int max_string_size, int max_array_size, struct timeval* timeout)
+/* Decoded values are allocated from one arena per value, so that the
+   whole tree is released at once when the caller destroys it. */
+static value_t* _read_value(message_t*m, value_arena_t*arena, int*count, int max_string_size, int max_array_size)
 { 
-    char b = 0;
-    if(!read_with_timeout(fd, &b, 1, timeout)) {
+    uint8_t b = 0;
+    if(!message_read(m, &b, 1)) {
         return NULL;
     }
     value_t dummy;
 
     switch(b) {
         case TYPE_VOID:
-            return value_new_void();
+            return value_arena_void(arena);
         case TYPE_FLOAT32:
-            if(!read_with_timeout(fd, &dummy.f32, sizeof(dummy.f32), timeout)) {
+            if(!message_read(m, &dummy.f32, sizeof(dummy.f32))) {
                 return NULL;
             }
-            return value_new_float32(dummy.f32);
+            return value_arena_float32(arena, dummy.f32);
         case TYPE_INT32:
-            if(!read_with_timeout(fd, &dummy.i32, sizeof(dummy.i32), timeout)) {
+            if(!message_read(m, &dummy.i32, sizeof(dummy.i32))) {
                 return NULL;
             }
-            return value_new_int32(dummy.i32);
+            return value_arena_int32(arena, dummy.i32);
         case TYPE_BOOLEAN:
-            if(!read_with_timeout(fd, &dummy.b, sizeof(dummy.b), timeout)) {
+            if(!message_read(m, &dummy.b, sizeof(dummy.b))) {
                 return NULL;
             }
-            return value_new_boolean(!!dummy.b);
+            return value_arena_boolean(arena, !!dummy.b);
         case TYPE_STRING: {
-            char*s = read_string(fd, max_string_size, timeout);
-            if(!s)
+            int l = 0;
+            if(!message_read(m, &l, sizeof(l)))
+                return NULL;
+            if(l<0 || (max_string_size && l>=max_string_size) || l > m->len - m->pos)
                 return NULL;
-            value_t* v = value_new_string(s);
-            free(s);
+            value_t* v = value_arena_string(arena, m->data + m->pos, l);
+            m->pos += l;
             return v;
         }
         case TYPE_ARRAY: {
-            if(!read_with_timeout(fd, &dummy.length, sizeof(dummy.length), timeout)) {
+            if(!message_read(m, &dummy.length, sizeof(dummy.length))) {
                 return NULL;
             }
 
             /* protect against int overflows */
+            if(dummy.length < 0 || dummy.length > m->len - m->pos)
+                return NULL;
             if(max_array_size && dummy.length >= max_array_size)
                 return NULL;
             if(dummy.length >= INT_MAX - *count)
@@ -145,34 +682,109 @@ static value_t* _read_value(int fd, int*count, int max_string_size, int max_arra
             if(max_array_size && dummy.length + *count >= max_array_size)
                 return NULL;
 
-            value_t*array = array_new();
+            value_t*array = value_arena_array(arena, dummy.length);
             int i;
             for(i=0;i<dummy.length;i++) {
-                value_t*entry = _read_value(fd, count, max_string_size, max_array_size, timeout);
+                /* numbers and booleans go straight into their slot */
+                int left = m->len - m->pos;
+                uint8_t t = left > 0 ? m->data[m->pos] : TYPE_VOID;
+                const char*p = m->data + m->pos + 1;
+                if(t == TYPE_INT32 && left > (int)sizeof(int32_t)) {
+                    int32_t i32;
+                    memcpy(&i32, p, sizeof(i32));
+                    m->pos += 1 + sizeof(i32);
+                    array_append_int32(array, i32);
+                    continue;
+                }
+                if(t == TYPE_FLOAT32 && left > (int)sizeof(float)) {
+                    float f32;
+                    memcpy(&f32, p, sizeof(f32));
+                    m->pos += 1 + sizeof(f32);
+                    array_append_float32(array, f32);
+                    continue;
+                }
+                if(t == TYPE_BOOLEAN && left > (int)sizeof(bool)) {
+                    uint8_t byte = *p;
+                    m->pos += 1 + sizeof(bool);
+                    array_append_boolean(array, !!byte);
+                    continue;
+                }
+                value_t*entry = _read_value(m, arena, count, max_string_size, max_array_size);
                 if(entry == NULL) {
-                    value_destroy(array);
                     return NULL;
                 }
-                array_append(array, entry);
+                array_append_take(array, entry);
             }
             *count += dummy.length;
             return array;
         }
+        case TYPE_INT32_ARRAY:
+        case TYPE_FLOAT32_ARRAY: {
+            int length = 0;
+            if(!message_read(m, &length, sizeof(length))) {
+                return NULL;
+            }
+            /* We allocate no more than what's in the message, so unlike
+               arrays, these don't count against max_array_size */
+            if(length < 0 || length > (m->len - m->pos) / (int)sizeof(int32_t))
+                return NULL;
+            value_t*v = b == TYPE_INT32_ARRAY ?
+                value_arena_int32_array(arena, (int32_t*)(m->data + m->pos), length) :
+                value_arena_float32_array(arena, (float*)(m->data + m->pos), length);
+            m->pos += sizeof(int32_t) * length;
+            return v;
+        }
+        case WIRE_SEGMENT: {
+            uint32_t ref[2];
+            segment_t*segment = m->segment;
+            if(!segment || m->borrowed || !message_read(m, ref, sizeof(ref))) {
+                return NULL;
+            }
+            uint32_t offset = ref[0], size = ref[1];
+            if(offset > m->segment_size || size > m->segment_size - offset) {
+                return NULL;
+            }
+            message_t chunk;
+            memset(&chunk, 0, sizeof(chunk));
+            chunk.data = segment->data;
+            chunk.len = chunk.size = offset + size;
+            chunk.pos = offset;
+            chunk.borrowed = true;
+
+            /* The segment bounds the size of what we allocate, so
+               big values don't need to obey the message limits */
+            value_t*v = _read_value(&chunk, arena, count, 0, max_array_size ? size : 0);
+            segment_release(segment, size);
+            m->segment_released += size;
+            return v;
+        }
         default:
             return NULL;
     }
 }
 
-static value_t* read_value(int fd, struct timeval* timeout)
+static value_t* read_value_limit(message_t*m, int max_string_size, int max_array_size)
 {
     int count = 0;
-    return _read_value(fd, &count, MAX_STRING_SIZE, MAX_ARRAY_SIZE, timeout);
+    value_arena_t*arena = value_arena_new();
+    if(!arena)
+        return NULL;
+    value_t*v = _read_value(m, arena, &count, max_string_size, max_array_size);
+    if(!v) {
+        value_arena_destroy(arena);
+        return NULL;
+    }
+    return value_arena_finish(arena, v);
 }
 
-static value_t* read_value_nolimit(int fd)
+static value_t* read_value(message_t*m)
 {
-    int count = 0;
-    return _read_value(fd, &count, 0, 0, NULL);
+    return read_value_limit(m, MAX_STRING_SIZE, MAX_ARRAY_SIZE);
+}
+
+static value_t* read_value_nolimit(message_t*m)
+{
+    return read_value_limit(m, 0, 0);
 }
 
 
@@ -181,9 +793,22 @@ static void define_constant_proxy(language_t*li, const char*name, value_t*value)
     proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
 
     log_dbg("[proxy] define_constant(%s)", name);
-    write_byte(proxy->fd_w, DEFINE_CONSTANT);
-    write_string(proxy->fd_w, name);
-    write_value(proxy->fd_w, value);
+    message_start(&proxy->out);
+    write_byte(&proxy->out, DEFINE_CONSTANT);
+    write_string(&proxy->out, name);
+    write_value(&proxy->out, value);
+    send_message(proxy, &proxy->out);
+}
+
+/* Templates may fork (see seccomp_lockdown_template()), so guest code only
+   runs in them to compile the script. Calls, and host functions the guest
+   could call back into, are for the copies. */
+static bool reject_template(language_t*li, const char*what)
+{
+    if(!li->fork)
+        return false;
+    language_error(li, "You can't %s in a template, only in its copies.", what);
+    return true;
 }
 
 static void define_function_proxy(language_t*li, const char*name, function_t*f)
@@ -191,11 +816,17 @@ static void define_function_proxy(language_t*li, const char*name, function_t*f)
     proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
 
     log_dbg("[proxy] define_function(%s)", name);
+    if(reject_template(li, "define functions")) {
+        value_destroy(f);
+        return;
+    }
     
     /* let the child know that we're accepting callbacks for this function name */
-    write_byte(proxy->fd_w, DEFINE_FUNCTION);
-    write_string(proxy->fd_w, name);
-    write_byte(proxy->fd_w, f->num_params);
+    message_start(&proxy->out);
+    write_byte(&proxy->out, DEFINE_FUNCTION);
+    write_string(&proxy->out, name);
+    write_byte(&proxy->out, f->num_params);
+    send_message(proxy, &proxy->out);
 
     if(dict_contains(proxy->callback_functions, name)) {
         language_error(li, "function %s already defined", name);
@@ -205,394 +836,2244 @@ static void define_function_proxy(language_t*li, const char*name, function_t*f)
     dict_put(proxy->callback_functions, name, f);
 }
 
-static bool process_callbacks(language_t*li, struct timeval* timeout)
+/* Store the result of a pipelined call. */
+static void async_result(proxy_internal_t*proxy, int ticket, value_t*value, bool interrupted)
 {
-    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    if(!dict_contains(proxy->async_calls, INT_TO_PTR(ticket))) {
+        log_dbg("[proxy] result for unknown ticket %d", ticket);
+        if(value)
+            value_destroy(value);
+        return;
+    }
+    if(!value) {
+        value = interrupted ? &async_timed_out : &async_failed;
+    }
+    dict_del(proxy->async_calls, INT_TO_PTR(ticket));
+    dict_put(proxy->async_calls, INT_TO_PTR(ticket), value);
+}
 
-    while(1) {
-        char resp = 0;
-        if(!read_with_timeout(proxy->fd_r, &resp, 1, timeout)) {
-            return false;
-        }
+/* Read the ticket of a RESP_ASYNC_RETURN or RESP_ASYNC_ERROR frame, and
+   its result, if there is one. The sandbox tells us whether the call
+   failed because we interrupted it: with calls queued up, an interrupt
+   meant for one call may have hit the next one. */
+static value_t* read_async_result(language_t*li, message_t*m, uint8_t resp, int*ticket, bool*interrupted)
+{
+    *ticket = read_int32(m);
+    *interrupted = false;
+    if(resp == RESP_ASYNC_ERROR) {
+        *interrupted = read_byte(m);
+        return NULL;
+    }
+    value_t*value = read_value(m);
+    if(!value) {
+        language_error(li, "Invalid return value for call %d\n", *ticket);
+    }
+    return value;
+}
 
-        switch(resp) {
-            case RESP_CALLBACK: {
-                char*name = read_string(proxy->fd_r, MAX_STRING_SIZE, timeout);
-                if(!name) {
-                    return false;
-                }
-                value_t*args = read_value(proxy->fd_r, timeout);
-                if(!args) {
-                    free(name);
-                    return false;
-                }
-                value_t*function = dict_lookup(proxy->callback_functions, name);
-                if(!function) {
-                    language_error(li, "Calling unknown callback function\n");
-                    value_destroy(args);
-                    free(name);
-                    return false;
-                }
-                value_t*ret = function->call(function, args);
-                if(!ret) {
-                    value_destroy(args);
-                    free(name);
-                    return false;
-                }
-                write_value(proxy->fd_w, ret);
-                value_destroy(ret);
-                value_destroy(args);
-                free(name);
-            }
-            break;
-            case RESP_LOG: {
-                char*message = read_string(proxy->fd_r, MAX_STRING_SIZE, timeout);
-                language_log(li, message);                
-            }
-            break;
-            case RESP_ERROR:
-            return false;
-            case RESP_RETURN:
-            return true;
-        }
+/* Record an event that started at start (see monotonic_nsec()), and is
+   over now */
+static void trace_span(proxy_internal_t*proxy, trace_kind_t kind, const char*detail, int64_t start)
+{
+    if(proxy->trace) {
+        trace_add(proxy->trace, kind, detail, start, monotonic_nsec() - start);
     }
 }
 
-static bool compile_script_proxy(language_t*li, const char*script)
+/* Run the host function the child called back, and send it the result */
+static bool handle_callback(language_t*li, message_t*m)
 {
     proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
 
-    log_dbg("[proxy] compile_script()");
-    write_byte(proxy->fd_w, COMPILE_SCRIPT);
-    write_string(proxy->fd_w, script);
-
-    struct timeval timeout;
-    timeout.tv_sec = proxy->timeout;
-    timeout.tv_usec = 0;
-
-    if(proxy->in_call) {
-        language_error(li, "You called (or compiled) the guest program, and the guest program called back. You can't invoke the guest again from your callback function.");
-        return NULL;
+    char*name = read_string(m, MAX_STRING_SIZE);
+    if(!name) {
+        return false;
     }
-
-    bool ret = false;
-
-    proxy->in_call = true;
-    ret = process_callbacks(li, &timeout);
-    if(!ret) {
-        if(!timeout.tv_sec && !timeout.tv_usec) {
-            li->timeout = true;
-            language_error(li, "Timeout while compiling\n");
-        }
+    value_t*args = read_value(m);
+    if(!args) {
+        free(name);
         return false;
     }
-    proxy->in_call = false;
-
-    if(!read_with_timeout(proxy->fd_r, &ret, 1, &timeout)) {
-        if(!timeout.tv_sec && !timeout.tv_usec) {
-            // TODO: verify that select does indeed set these values to 0 on timeout
-            li->timeout = true;
-            language_error(li, "Timeout while compiling.\n");
-        }
+    value_t*function = dict_lookup(proxy->callback_functions, name);
+    if(!function) {
+        language_error(li, "Calling unknown callback function\n");
+        value_destroy(args);
+        free(name);
+        return false;
+    }
+    int64_t start = monotonic_nsec();
+    value_t*ret = function->call(function, args);
+    li->host_usec += (monotonic_nsec() - start) / 1000;
+    proxy->stats.callbacks++;
+    trace_span(proxy, TRACE_CALLBACK, name, start);
+    if(!ret) {
+        value_destroy(args);
+        free(name);
         return false;
     }
-    return !!ret;
+    message_start(&proxy->out);
+    write_byte(&proxy->out, CALLBACK_RETURN);
+    write_value(&proxy->out, ret);
+    send_message(proxy, &proxy->out);
+    value_destroy(ret);
+    value_destroy(args);
+    free(name);
+    return true;
 }
 
-static bool is_function_proxy(language_t*li, const char*name)
+static void handle_log(language_t*li, message_t*m)
 {
     proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    proxy->stats.log_lines++;
+    char*message = read_string(m, MAX_STRING_SIZE);
+    if(message) {
+        if(proxy->trace) {
+            trace_add(proxy->trace, TRACE_LOG, message, monotonic_nsec(), -1);
+        }
+        language_log(li, "%s", message);
+        free(message);
+    }
+}
 
-    log_dbg("[proxy] is_function(%s)", name);
-    write_byte(proxy->fd_w, IS_FUNCTION);
-    write_string(proxy->fd_w, name);
-
-    struct timeval timeout;
-    timeout.tv_sec = proxy->timeout;
-    timeout.tv_usec = 0;
-
-    bool ret = false;
-    if(!read_with_timeout(proxy->fd_r, &ret, 1, &timeout)) {
-        return false;
+/* Events the sandbox recorded (see send_trace()) */
+static void handle_trace(proxy_internal_t*proxy, message_t*m)
+{
+    int num = read_int32(m);
+    int i;
+    for(i=0;i<num;i++) {
+        uint8_t kind = read_byte(m);
+        int64_t start = read_int64(m);
+        int64_t duration = read_int64(m);
+        char*detail = read_string(m, MAX_STRING_SIZE);
+        if(!detail) {
+            return;
+        }
+        if(proxy->trace && kind < NUM_TRACE_KINDS) {
+            trace_add(proxy->trace, kind, detail, start, duration)->sandbox = true;
+        }
+        free(detail);
     }
-    return !!ret;
 }
 
-static value_t* call_function_proxy(language_t*li, const char*name, value_t*args)
+/* The call in progress ran out of time. Ask the sandbox to interrupt the
+   guest (see interrupt_guest()): the call then fails, and the frame that
+   ends it puts us back in sync with the child, so that the sandbox can be
+   used for further calls. Returns false if we did that already, and the
+   guest didn't stop. */
+static bool interrupt_child(proxy_internal_t*proxy)
 {
-    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    if(proxy->interrupted || proxy->child_pid <= 0)
+        return false;
+    if(kill(proxy->child_pid, SIGUSR1) < 0)
+        return false;
+    proxy->interrupted = true;
+    return true;
+}
 
-    log_dbg("[proxy] call_function(%s)", name);
-    write_byte(proxy->fd_w, CALL_FUNCTION);
-    write_string(proxy->fd_w, name);
-    write_value(proxy->fd_w, args);
+/* CPU time the child used so far (usec), or -1 */
+static int64_t guest_clock(proxy_internal_t*proxy)
+{
+    struct timespec ts;
+    if(!proxy->has_guest_clock || clock_gettime(proxy->guest_clock, &ts))
+        return -1;
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    struct timeval timeout;
-    timeout.tv_sec = proxy->timeout;
-    timeout.tv_usec = 0;
+/* CPU time the child used for the call in progress (usec), or -1 */
+static int64_t guest_usec(proxy_internal_t*proxy)
+{
+    int64_t now = guest_clock(proxy);
+    if(now < 0 || proxy->guest_start < 0)
+        return -1;
+    return now - proxy->guest_start;
+}
 
+/* The deadline of the call in progress passed. Time limits only count
+   the guest's own CPU time, though: not the time the host spent in
+   callbacks, nor the time the child waited for a CPU. Returns a new
+   deadline if the guest has some of its time left, 0 otherwise. */
+static int64_t extend_deadline(proxy_internal_t*proxy, int timeout_ms)
+{
+    int64_t used = guest_usec(proxy);
+    if(used < 0 || proxy->interrupted)
+        return 0;
+    int64_t left = timeout_ms * 1000ll - used;
+    if(left <= 0)
+        return 0;
+    return deadline_after((left + 999) / 1000);
+}
+
+/* Start counting the CPU the child uses for the next call. Like time
+   limits, CPU limits count from here, for every call. */
+static void cpu_start(proxy_internal_t*proxy)
+{
+    proxy->call_start = monotonic_usec();
+    proxy->guest_start = guest_clock(proxy);
+    proxy->li->host_usec = 0;
+    if(!proxy->cpu)
+        return;
+    proxy->cpu_start = perf_counter_read(proxy->cpu);
+    if(proxy->cpu_limit) {
+        /* the child interrupts the guest on overflow, see interrupt_guest() */
+        perf_counter_set_limit(proxy->cpu, proxy->cpu_limit, SIGUSR1);
+    }
+}
+
+/* Store what the call used in li->cpu_used. Returns true if that's more
+   than its limit. */
+static bool cpu_stop(proxy_internal_t*proxy)
+{
+    language_t*li = proxy->li;
+    proxy->call_usec = monotonic_usec() - proxy->call_start;
+    li->guest_usec = guest_usec(proxy);
+    li->cpu_used = -1;
+    if(!proxy->cpu)
+        return false;
+    int64_t now = perf_counter_read(proxy->cpu);
+    if(now < 0 || proxy->cpu_start < 0)
+        return false;
+    li->cpu_used = now - proxy->cpu_start;
+    if(proxy->cpu_limit && li->cpu_used >= proxy->cpu_limit) {
+        language_error(li, "CPU limit exceeded (%lld %s)\n", (long long)li->cpu_used, proxy->cpu->unit);
+        return true;
+    }
+    return false;
+}
+
+/* Count the call cpu_stop() just ended in the stats */
+static void count_call(proxy_internal_t*proxy)
+{
+    proxy->stats.calls++;
+    proxy->stats.call_usec += proxy->call_usec;
+    if(proxy->call_usec > proxy->stats.max_call_usec)
+        proxy->stats.max_call_usec = proxy->call_usec;
+}
+
+/* Handle frames from the child until the synchronous call in progress
+   returns (ticket 0), or the result for the given ticket has arrived. If
+   the deadline passes, the guest is interrupted, and we keep waiting for
+   the end of the call (see call_timed_out()). */
+static bool process_callbacks(language_t*li, int64_t*deadline, int ticket)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    if(proxy->loop) {
+        /* the loop reads everything the child sends */
+        language_error(li, "This sandbox is driven by an event loop, use call_function_nb()");
+        proxy->in_call = false;
+        return false;
+    }
+
+    proxy->interrupted = false;
+    while(1) {
+        if(!next_message(proxy, &proxy->in, MAX_MESSAGE_SIZE, *deadline)) {
+            if(deadline_passed(*deadline)) {
+                int64_t later = extend_deadline(proxy, proxy->batch ? proxy->batch_timeout_ms : proxy->timeout_ms);
+                if(later) {
+                    *deadline = later;
+                    continue;
+                }
+                if(interrupt_child(proxy)) {
+                    *deadline = deadline_after(INTERRUPT_GRACE_MS);
+                    continue;
+                }
+                /* the guest is stuck somewhere it can't be interrupted */
+                kill(proxy->child_pid, SIGKILL);
+            }
+            return false;
+        }
+
+        uint8_t resp = read_byte(&proxy->in);
+        switch(resp) {
+            case RESP_CALLBACK:
+                if(!handle_callback(li, &proxy->in)) {
+                    return false;
+                }
+            break;
+            case RESP_LOG:
+                handle_log(li, &proxy->in);
+            break;
+            case RESP_BUDGET:
+                /* comes right before the result of the call */
+                li->budget_left = read_int64(&proxy->in);
+            break;
+            case RESP_TRACE:
+                handle_trace(proxy, &proxy->in);
+            break;
+            case RESP_PROFILE:
+                /* so does this */
+                proxy->has_guest_profile = true;
+                proxy->guest_phases[PHASE_CONVERT] = read_int64(&proxy->in);
+                proxy->guest_phases[PHASE_EXECUTE] = read_int64(&proxy->in);
+                proxy->guest_phases[PHASE_CALLBACK] = read_int64(&proxy->in);
+                proxy->guest_span = read_int64(&proxy->in);
+            break;
+            case RESP_ERROR:
+            /* the guest reported an error; the stream is still in sync */
+            proxy->in_call = false;
+            return false;
+            case RESP_RETURN:
+            return true;
+            case RESP_ASYNC_RETURN:
+            case RESP_ASYNC_ERROR: {
+                int t;
+                bool interrupted;
+                value_t*value = read_async_result(li, &proxy->in, resp, &t, &interrupted);
+                if(interrupted) {
+                    /* that's the call that ran out of time, not
+                       necessarily the one we're waiting for */
+                    proxy->interrupted = false;
+                }
+                async_result(proxy, t, value, interrupted);
+                if(ticket && t == ticket) {
+                    return true;
+                }
+            }
+            break;
+            case RESP_BATCH_ITEM: {
+                int index = read_int32(&proxy->in);
+                int usec = read_int32(&proxy->in);
+                uint8_t ok = read_byte(&proxy->in);
+                batch_t*batch = proxy->batch;
+                if(!batch || index < 0 || index >= batch->num || batch->items[index].called) {
+                    language_error(li, "Invalid batch result %d\n", index);
+                    break;
+                }
+                batch_item_t*item = &batch->items[index];
+                item->called = true;
+                item->usec = usec;
+                item->budget_left = li->budget_left;
+                if(cpu_stop(proxy)) {
+                    item->timeout = true;
+                    li->timeout = true;
+                }
+                count_call(proxy);
+                item->cpu_used = li->cpu_used;
+                cpu_start(proxy);
+                if(proxy->interrupted) {
+                    /* that's the call that ran out of time. The rest of
+                       the batch goes on as usual. */
+                    proxy->interrupted = false;
+                    item->timeout = true;
+                    li->timeout = true;
+                }
+                if(ok) {
+                    item->value = read_value(&proxy->in);
+                    if(!item->value) {
+                        language_error(li, "Invalid return value for batch call %d\n", index);
+                    }
+                    if(item->timeout && item->value) {
+                        value_destroy(item->value);
+                        item->value = NULL;
+                    }
+                }
+                /* every call in the batch gets its own time limit */
+                *deadline = deadline_after(proxy->batch_timeout_ms);
+            }
+            break;
+        }
+    }
+}
+
+/* After process_callbacks(): whether the call ran out of time. If the
+   guest could be interrupted, the call is over nonetheless, and ret says
+   whether the frame that ended it still has to be decoded. */
+static bool call_timed_out(proxy_internal_t*proxy, bool ret, int64_t deadline)
+{
+    return proxy->interrupted || (!ret && deadline_passed(deadline));
+}
+
+/* Add a call to the profile of its function. The host's phases are
+   measured here; the sandbox reported its own ones (RESP_PROFILE) with
+   the result. Whatever of the round trip the sandbox didn't see was spent
+   in transit. */
+static void record_profile(proxy_internal_t*proxy, const char*name, int64_t encode, int64_t round_trip, int64_t decode)
+{
+    if(!proxy->has_guest_profile) {
+        /* the sandbox doesn't profile (it was forked before config_profile was set) */
+        return;
+    }
+    proxy->has_guest_profile = false;
+    call_profile_t*profile = dict_lookup(proxy->profiles, name);
+    if(!profile) {
+        profile = calloc(1, sizeof(call_profile_t));
+        dict_put(proxy->profiles, name, profile);
+    }
+    histogram_t*phases = profile->phases;
+    histogram_add(&phases[PHASE_ENCODE], encode);
+    histogram_add(&phases[PHASE_TRANSIT], round_trip - proxy->guest_span);
+    histogram_add(&phases[PHASE_CONVERT], proxy->guest_phases[PHASE_CONVERT]);
+    histogram_add(&phases[PHASE_EXECUTE], proxy->guest_phases[PHASE_EXECUTE]);
+    histogram_add(&phases[PHASE_CALLBACK], proxy->guest_phases[PHASE_CALLBACK]);
+    histogram_add(&phases[PHASE_DECODE], decode);
+}
+
+static bool compile_script_proxy(language_t*li, const char*script)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    log_dbg("[proxy] compile_script()");
+    if(proxy->in_call) {
+        language_error(li, "You called (or compiled) the guest program, and the guest program called back. You can't invoke the guest again from your callback function.");
+        return NULL;
+    }
+
+    cpu_start(proxy);
+    int64_t start = monotonic_nsec();
+
+    message_start(&proxy->out);
+    write_byte(&proxy->out, COMPILE_SCRIPT);
+    write_string(&proxy->out, script);
+    send_message(proxy, &proxy->out);
+
+    int64_t deadline = deadline_after(proxy->timeout_ms);
+
+    proxy->in_call = true;
+    bool ret = process_callbacks(li, &deadline, 0);
+    bool over_cpu = cpu_stop(proxy);
+    proxy->stats.compile_usec += proxy->call_usec;
+    trace_span(proxy, TRACE_COMPILE, NULL, start);
+    if(ret) {
+        proxy->in_call = false;
+    }
+    if(call_timed_out(proxy, ret, deadline) || over_cpu) {
+        li->timeout = true;
+        language_error(li, "Timeout while compiling\n");
+        return false;
+    }
+    if(!ret) {
+        return false;
+    }
+
+    /* the compile result is part of the RESP_RETURN frame */
+    return !!read_byte(&proxy->in);
+}
+
+static bool is_function_proxy(language_t*li, const char*name)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    log_dbg("[proxy] is_function(%s)", name);
+    if(proxy->in_call) {
+        language_error(li, "You can't query the guest program from a callback function.");
+        return false;
+    }
+
+    message_start(&proxy->out);
+    write_byte(&proxy->out, IS_FUNCTION);
+    write_string(&proxy->out, name);
+    send_message(proxy, &proxy->out);
+
+    int64_t deadline = deadline_after(proxy->timeout_ms);
+
+    /* pipelined calls may still be calling back while we wait */
+    proxy->in_call = true;
+    if(!process_callbacks(li, &deadline, 0)) {
+        return false;
+    }
+    proxy->in_call = false;
+    return !!read_byte(&proxy->in);
+}
+
+static value_t* call_function_proxy(language_t*li, const char*name, value_t*args)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    log_dbg("[proxy] call_function(%s)", name);
+    if(reject_template(li, "call functions")) {
+        return NULL;
+    }
+    if(proxy->in_call) {
+        language_error(li, "You called the guest program, and the guest program called back. You can't invoke the guest again from your callback function.");
+        return NULL;
+    }
+
+    /* before the child sees the call, which might be over by the time
+       send_message() returns */
+    cpu_start(proxy);
+
+    bool profile = proxy->profiles != NULL;
+    int64_t encode_start = profile || proxy->trace ? monotonic_nsec() : 0;
+    message_start(&proxy->out);
+    write_byte(&proxy->out, CALL_FUNCTION);
+    write_string(&proxy->out, name);
+    write_value(&proxy->out, args);
+    int64_t sent = profile ? monotonic_nsec() : 0;
+    proxy->has_guest_profile = false;
+    send_message(proxy, &proxy->out);
+
+    int64_t deadline = deadline_after(proxy->timeout_ms);
+
+    proxy->in_call = true;
+    bool ret = process_callbacks(li, &deadline, 0);
+    int64_t received = profile ? monotonic_nsec() : 0;
+    bool over_cpu = cpu_stop(proxy);
+    count_call(proxy);
+    trace_span(proxy, TRACE_CALL, name, encode_start);
+    if(ret) {
+        proxy->in_call = false;
+    }
+    if(call_timed_out(proxy, ret, deadline) || over_cpu) {
+        li->timeout = true;
+        language_error(li, "Timeout while calling function %s\n", name);
+        if(ret) {
+            /* it did return, but too late */
+            value_t*value = read_value(&proxy->in);
+            if(value)
+                value_destroy(value);
+        }
+        return NULL;
+    }
+    if(!ret) {
+        return NULL;
+    }
+
+    value_t*value = read_value(&proxy->in);
+    if(!value) {
+        language_error(li, "Invalid return value from function %s\n", name);
+        return NULL;
+    }
+    if(profile) {
+        record_profile(proxy, name, sent - encode_start, received - sent, monotonic_nsec() - received);
+    }
+    return value;
+}
+
+static int next_ticket(proxy_internal_t*proxy)
+{
+    int ticket = ++proxy->last_ticket;
+    if(ticket <= 0) {
+        ticket = proxy->last_ticket = 1;
+    }
+    return ticket;
+}
+
+static int call_function_async_proxy(language_t*li, const char*name, value_t*args)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    log_dbg("[proxy] call_function_async(%s)", name);
+    if(reject_template(li, "call functions")) {
+        return -1;
+    }
+    if(proxy->in_call) {
+        language_error(li, "You called the guest program, and the guest program called back. You can't invoke the guest again from your callback function.");
+        return -1;
+    }
+
+    int ticket = next_ticket(proxy);
+
+    message_start(&proxy->out);
+    write_byte(&proxy->out, CALL_FUNCTION_ASYNC);
+    write_int32(&proxy->out, ticket);
+    write_string(&proxy->out, name);
+    write_value(&proxy->out, args);
+    if(!send_message(proxy, &proxy->out)) {
+        language_error(li, "Couldn't send call to function %s\n", name);
+        return -1;
+    }
+
+    dict_put(proxy->async_calls, INT_TO_PTR(ticket), NULL);
+    return ticket;
+}
+
+static value_t* call_result_proxy(language_t*li, int ticket)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    log_dbg("[proxy] call_result(%d)", ticket);
+    if(ticket <= 0 || !dict_contains(proxy->async_calls, INT_TO_PTR(ticket))) {
+        language_error(li, "Unknown call %d\n", ticket);
+        return NULL;
+    }
+
+    if(!dict_lookup(proxy->async_calls, INT_TO_PTR(ticket))) {
+        if(proxy->in_call) {
+            language_error(li, "You can't wait for the guest program from a callback function.");
+            return NULL;
+        }
+
+        int64_t deadline = deadline_after(proxy->timeout_ms);
+
+        proxy->in_call = true;
+        bool ret = process_callbacks(li, &deadline, ticket);
+        if(!ret) {
+            /* the sandbox didn't stop */
+            if(deadline_passed(deadline)) {
+                li->timeout = true;
+                language_error(li, "Timeout while waiting for call %d\n", ticket);
+            }
+            return NULL;
+        }
+        proxy->in_call = false;
+    }
+
+    value_t*value = dict_lookup(proxy->async_calls, INT_TO_PTR(ticket));
+    dict_del(proxy->async_calls, INT_TO_PTR(ticket));
+    if(value == &async_timed_out) {
+        li->timeout = true;
+        language_error(li, "Timeout in call %d\n", ticket);
+        return NULL;
+    }
+    if(value == &async_failed)
+        return NULL;
+    return value;
+}
+
+static batch_t* call_function_batch_proxy(language_t*li, const char*name, value_t*args_list, int per_item_timeout, bool stop_on_failure)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    log_dbg("[proxy] call_function_batch(%s), %d calls", name, args_list->length);
+    if(reject_template(li, "call functions")) {
+        return NULL;
+    }
     if(proxy->in_call) {
         language_error(li, "You called the guest program, and the guest program called back. You can't invoke the guest again from your callback function.");
         return NULL;
     }
 
-    bool ret;
+    cpu_start(proxy);
+    int64_t start = monotonic_nsec();
+
+    message_start(&proxy->out);
+    write_byte(&proxy->out, CALL_FUNCTION_BATCH);
+    write_string(&proxy->out, name);
+    write_byte(&proxy->out, stop_on_failure);
+    write_value(&proxy->out, args_list);
+    send_message(proxy, &proxy->out);
+
+    batch_t*batch = calloc(1, sizeof(batch_t));
+    batch->num = args_list->length;
+    batch->items = calloc(batch->num ? batch->num : 1, sizeof(batch_item_t));
+
+    /* results are streamed back one call at a time */
+    proxy->batch = batch;
+    proxy->batch_timeout_ms = per_item_timeout > 0 ? per_item_timeout * 1000 : proxy->timeout_ms;
+    int64_t deadline = deadline_after(proxy->batch_timeout_ms);
+
+    proxy->in_call = true;
+    bool ret = process_callbacks(li, &deadline, 0);
+    proxy->batch = NULL;
+    trace_span(proxy, TRACE_BATCH, name, start);
+    if(!ret) {
+        if(deadline_passed(deadline)) {
+            int i;
+            for(i=0;i<batch->num;i++) {
+                if(!batch->items[i].called) {
+                    batch->items[i].timeout = true;
+                    break;
+                }
+            }
+            li->timeout = true;
+            language_error(li, "Timeout while calling function %s\n", name);
+        }
+        return batch;
+    }
+    proxy->in_call = false;
+    return batch;
+}
+
+static void loop_event(void*data, int fd, uint32_t events);
+
+/* A call made through call_function_nb() */
+typedef struct _loop_call {
+    call_done_t done;
+    void*user;
+} loop_call_t;
+
+/* With an event loop, we never block on a write: what doesn't fit into
+   the pipe right away waits in tx, until the loop tells us there's room. */
+static bool loop_flush(proxy_internal_t*proxy)
+{
+    message_t*tx = &proxy->tx;
+    while(tx->pos < tx->len) {
+        int ret = write(proxy->fd_w, tx->data + tx->pos, tx->len - tx->pos);
+        if(ret < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN)
+                break;
+            return false;
+        }
+        tx->pos += ret;
+    }
+    if(tx->pos < tx->len) {
+        return sandbox_loop_watch(proxy->loop, proxy->fd_w, EPOLLOUT, loop_event, proxy);
+    }
+    tx->pos = tx->len = 0;
+    sandbox_loop_unwatch(proxy->loop, proxy->fd_w);
+    return true;
+}
+
+static bool loop_send(proxy_internal_t*proxy, message_t*m)
+{
+    if(proxy->broken)
+        return false;
+    /* if there's still something in tx, we're already waiting for room */
+    bool idle = proxy->tx.len == 0;
+    message_write(&proxy->tx, m->data, m->len);
+    return idle ? loop_flush(proxy) : true;
+}
+
+/* Like in a batch, every call gets its own time limit, counting from
+   when the call before it returned */
+static void loop_set_deadline(proxy_internal_t*proxy)
+{
+    int64_t deadline = 0;
+    if(dict_count(proxy->loop_calls)) {
+        deadline = deadline_after(proxy->timeout_ms);
+    }
+    sandbox_loop_set_deadline(proxy->loop, proxy->fd_r, deadline);
+}
+
+static void loop_complete(proxy_internal_t*proxy, int ticket, value_t*value, bool interrupted)
+{
+    loop_call_t*call = dict_lookup(proxy->loop_calls, INT_TO_PTR(ticket));
+    if(!call) {
+        /* a call_function_async() made before we were attached */
+        async_result(proxy, ticket, value, interrupted);
+        return;
+    }
+    dict_del(proxy->loop_calls, INT_TO_PTR(ticket));
+    bool over_cpu = cpu_stop(proxy);
+    count_call(proxy);
+    int host_usec = proxy->li->host_usec;
+    if(dict_count(proxy->loop_calls)) {
+        /* the next call is running already */
+        cpu_start(proxy);
+    }
+    loop_set_deadline(proxy);
+    sandbox_loop_release(proxy->loop);
+
+    /* the call may have returned before our interrupt arrived, which then
+       hit the next call instead: only the call the sandbox says it
+       interrupted ran out of time. Either way, the next call may be
+       interrupted again once its own time is up. */
+    proxy->interrupted = false;
+    bool timed_out = interrupted || over_cpu;
+    if(timed_out) {
+        proxy->li->timeout = true;
+        if(value) {
+            value_destroy(value);
+            value = NULL;
+        }
+    }
+    /* the next call can't call back before we're done with this one */
+    int next_host_usec = proxy->li->host_usec;
+    proxy->li->host_usec = host_usec;
+    call->done(proxy->li, value, call->user);
+    proxy->li->host_usec = next_host_usec;
+    if(timed_out) {
+        proxy->li->timeout = false;
+    }
+    free(call);
+}
+
+/* The child is gone, or we can't talk to it anymore: fail all calls */
+static void loop_fail(proxy_internal_t*proxy, const char*reason)
+{
+    if(proxy->broken)
+        return;
+    language_error(proxy->li, "%s", reason);
+    proxy->broken = true;
+    proxy->interrupted = false;
+    sandbox_loop_unwatch(proxy->loop, proxy->fd_r);
+    sandbox_loop_unwatch(proxy->loop, proxy->fd_w);
+
+    int num = dict_count(proxy->loop_calls);
+    int*tickets = malloc(sizeof(int) * (num ? num : 1));
+    int i = 0;
+    DICT_ITERATE_KEY(proxy->loop_calls, void*, key) {
+        tickets[i++] = PTR_TO_INT(key);
+    }
+    for(i=0;i<num;i++) {
+        loop_complete(proxy, tickets[i], NULL, false);
+    }
+    free(tickets);
+}
+
+static void loop_dispatch(proxy_internal_t*proxy, message_t*m)
+{
+    language_t*li = proxy->li;
+
+    uint8_t resp = read_byte(m);
+    switch(resp) {
+        case RESP_CALLBACK:
+            if(!handle_callback(li, m)) {
+                /* the child is still waiting for the callback to return */
+                loop_fail(proxy, "Callback function failed");
+            }
+        break;
+        case RESP_LOG:
+            handle_log(li, m);
+        break;
+        case RESP_BUDGET:
+            li->budget_left = read_int64(m);
+        break;
+        case RESP_TRACE:
+            handle_trace(proxy, m);
+        break;
+        case RESP_ASYNC_RETURN:
+        case RESP_ASYNC_ERROR: {
+            int t;
+            bool interrupted;
+            value_t*value = read_async_result(li, m, resp, &t, &interrupted);
+            loop_complete(proxy, t, value, interrupted);
+        }
+        break;
+        default:
+            /* the end of a synchronous call made before we were attached */
+        break;
+    }
+}
+
+/* Decode all complete frames we received so far, where they are */
+static void loop_decode(proxy_internal_t*proxy)
+{
+    message_t*rx = &proxy->rx;
+    int pos = 0;
+    while(!proxy->broken && !proxy->destroyed && rx->len - pos >= FRAME_HEADER_SIZE) {
+        int32_t l;
+        memcpy(&l, rx->data + pos, sizeof(l));
+        if(l < 0 || l > MAX_MESSAGE_SIZE) {
+            loop_fail(proxy, "Invalid message from sandbox");
+            return;
+        }
+        if(rx->len - pos - FRAME_HEADER_SIZE < l)
+            break;
+
+        message_t m;
+        memset(&m, 0, sizeof(m));
+        m.data = rx->data + pos;
+        m.len = m.size = l + FRAME_HEADER_SIZE;
+        m.pos = FRAME_HEADER_SIZE;
+        m.segment = proxy->in.segment;
+        m.segment_size = proxy->in.segment_size;
+        memcpy(&m.segment_bytes, rx->data + pos + sizeof(l), sizeof(m.segment_bytes));
+        pos += l + FRAME_HEADER_SIZE;
+        loop_dispatch(proxy, &m);
+        release_frame(&m);
+    }
+    if(pos) {
+        memmove(rx->data, rx->data + pos, rx->len - pos);
+        rx->len -= pos;
+    }
+}
+
+static void loop_read(proxy_internal_t*proxy)
+{
+    message_t*rx = &proxy->rx;
+    if(!message_grow(rx, rx->len + 4096)) {
+        loop_fail(proxy, "Out of memory");
+        return;
+    }
+    int ret = read(proxy->fd_r, rx->data + rx->len, rx->size - rx->len);
+    if(ret < 0) {
+        if(errno != EINTR && errno != EAGAIN)
+            loop_fail(proxy, "Couldn't read from sandbox");
+        return;
+    }
+    if(!ret) {
+        loop_fail(proxy, "Sandbox process terminated");
+        return;
+    }
+    rx->len += ret;
+    proxy->stats.bytes_received += ret;
+    loop_decode(proxy);
+}
+
+static void destroy_proxy(language_t* li);
+
+static void loop_event(void*data, int fd, uint32_t events)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)data;
+
+    /* completion callbacks may destroy the sandbox. We do that once we're
+       done with it. */
+    proxy->dispatching = true;
+    if(!events) {
+        int64_t later = extend_deadline(proxy, proxy->timeout_ms);
+        if(later) {
+            sandbox_loop_set_deadline(proxy->loop, proxy->fd_r, later);
+        } else if(interrupt_child(proxy)) {
+            /* wait for the call to fail */
+            sandbox_loop_set_deadline(proxy->loop, proxy->fd_r, deadline_after(INTERRUPT_GRACE_MS));
+        } else {
+            kill(proxy->child_pid, SIGKILL);
+            proxy->li->timeout = true;
+            loop_fail(proxy, "Timeout while waiting for the sandbox");
+        }
+    } else if(fd == proxy->fd_w) {
+        if(!loop_flush(proxy))
+            loop_fail(proxy, "Couldn't write to sandbox");
+    } else {
+        loop_read(proxy);
+    }
+    proxy->dispatching = false;
+    if(proxy->destroyed) {
+        destroy_proxy(proxy->li);
+    }
+}
+
+static bool attach_loop_proxy(language_t*li, sandbox_loop_t*loop)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    if(proxy->loop) {
+        language_error(li, "Sandbox is already attached to an event loop");
+        return false;
+    }
+    if(proxy->ring_r) {
+        language_error(li, "Sandboxes talking through shared memory rings can't be driven by an event loop");
+        return false;
+    }
+    if(proxy->in_call) {
+        language_error(li, "You can't attach the guest program to an event loop from a callback function.");
+        return false;
+    }
+
+    fcntl(proxy->fd_r, F_SETFL, fcntl(proxy->fd_r, F_GETFL) | O_NONBLOCK);
+    if(!sandbox_loop_watch(loop, proxy->fd_r, EPOLLIN, loop_event, proxy)) {
+        return false;
+    }
+    proxy->loop = loop;
+    proxy->loop_calls = dict_new(&int_type);
+
+    /* frames that arrived while we were waiting for something else */
+    release_frame(&proxy->in);
+    while(queue_pop(proxy, &proxy->in)) {
+        loop_dispatch(proxy, &proxy->in);
+        release_frame(&proxy->in);
+    }
+    return true;
+}
+
+static bool call_function_nb_proxy(language_t*li, const char*name, value_t*args, call_done_t done, void*user)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    log_dbg("[proxy] call_function_nb(%s)", name);
+    if(reject_template(li, "call functions")) {
+        return false;
+    }
+    if(!proxy->loop) {
+        language_error(li, "Attach the sandbox to an event loop first");
+        return false;
+    }
+    if(proxy->broken) {
+        language_error(li, "Sandbox isn't running anymore");
+        return false;
+    }
+
+    int ticket = next_ticket(proxy);
+    if(!dict_count(proxy->loop_calls)) {
+        cpu_start(proxy);
+    }
+
+    message_start(&proxy->out);
+    write_byte(&proxy->out, CALL_FUNCTION_ASYNC);
+    write_int32(&proxy->out, ticket);
+    write_string(&proxy->out, name);
+    write_value(&proxy->out, args);
+    /* if this fails, the loop will notice the child is gone */
+    if(!send_message(proxy, &proxy->out)) {
+        language_error(li, "Couldn't send call to function %s\n", name);
+        return false;
+    }
+
+    loop_call_t*call = calloc(1, sizeof(loop_call_t));
+    call->done = done;
+    call->user = user;
+    dict_put(proxy->loop_calls, INT_TO_PTR(ticket), call);
+    sandbox_loop_hold(proxy->loop);
+    if(dict_count(proxy->loop_calls) == 1) {
+        loop_set_deadline(proxy);
+    }
+    return true;
+}
+
+typedef struct _proxy_function {
+    language_t*li;
+    char*name;
+} proxy_function_t;
+
+static void proxy_function_destroy(value_t*v)
+{
+    proxy_function_t*f = (proxy_function_t*)v->internal; 
+    free(f->name);
+    free(v->internal);
+    free(v);
+}
+
+static value_t* proxy_function_call(value_t*v, value_t*args)
+{
+    proxy_function_t*f = (proxy_function_t*)v->internal; 
+    log_dbg("[sandbox] invoking callback %s", f->name);
+    language_t*li = f->li;
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    int64_t start = config_profile || proxy->trace ? monotonic_nsec() : 0;
+
+    message_start(&proxy->out);
+    write_byte(&proxy->out, RESP_CALLBACK);
+    write_string(&proxy->out, f->name);
+    write_value(&proxy->out, args);
+    send_message(proxy, &proxy->out);
+
+    /* the parent might have sent more commands before it saw our callback.
+       Keep them for child_loop. */
+    while(1) {
+        if(!receive_message(proxy, &proxy->in, 0, 0)) {
+            return NULL;
+        }
+        if(proxy->in.len > proxy->in.pos && proxy->in.data[proxy->in.pos] == CALLBACK_RETURN) {
+            read_byte(&proxy->in);
+            value_t*ret = read_value_nolimit(&proxy->in);
+            if(config_profile) {
+                proxy->callback_nsec += monotonic_nsec() - start;
+            }
+            trace_span(proxy, TRACE_CALLBACK, f->name, start);
+            return ret;
+        }
+        queue_push(proxy, &proxy->in);
+    }
+}
+
+static pid_t fork_copy(proxy_internal_t*proxy);
+
+/* The interpreter in this sandbox process, and whether it's running guest
+   code right now. guest_ticket is the pipelined call it's running (0 if
+   none), interrupted_ticket the one we last interrupted. */
+static language_t*guest;
+static volatile sig_atomic_t guest_running;
+static volatile sig_atomic_t guest_ticket;
+static volatile sig_atomic_t interrupted_ticket;
+
+/* Signal handler: the parent gave up waiting for the call in progress. Make
+   the interpreter abort it, so that the call fails, and we carry on with
+   the next command. */
+static void interrupt_guest(int sig)
+{
+    if(guest_running && guest->interrupt) {
+        interrupted_ticket = guest_ticket;
+        guest->interrupt(guest);
+    }
+}
+
+static bool guest_compile(proxy_internal_t*proxy, const char*script)
+{
+    language_t*old = proxy->old;
+    int64_t start = proxy->trace ? monotonic_nsec() : 0;
+    guest_running = 1;
+    bool ret = old->compile_script(old, script);
+    guest_running = 0;
+    trace_span(proxy, TRACE_COMPILE, NULL, start);
+    return ret;
+}
+
+static value_t* guest_call(proxy_internal_t*proxy, const char*name, value_t*args)
+{
+    language_t*old = proxy->old;
+    int64_t start = proxy->trace ? monotonic_nsec() : 0;
+    guest_running = 1;
+    value_t*ret = old->call_function(old, name, args);
+    guest_running = 0;
+    trace_span(proxy, TRACE_CALL, name, start);
+    return ret;
+}
+
+/* Pass the events we recorded since the last time on to the parent (see
+   handle_trace()). Goes out before the frame that ends a command. */
+static void send_trace(proxy_internal_t*proxy)
+{
+    trace_t*t = proxy->trace;
+    if(!t || !t->count)
+        return;
+    message_t*m = &proxy->side_out;
+    message_start(m);
+    write_byte(m, RESP_TRACE);
+    int num = trace_num_events(t);
+    write_int32(m, num);
+    int i;
+    for(i=0;i<num;i++) {
+        trace_event_t*e = trace_get(t, i);
+        write_byte(m, e->kind);
+        write_int64(m, e->start);
+        write_int64(m, e->duration);
+        write_string(m, e->detail);
+    }
+    send_message(proxy, m);
+    trace_clear(t);
+}
+
+/* Tell the parent how the call that started at start went: decoding the
+   arguments took until decoded, the guest returned at called, and
+   encoding the result took until now. Goes out right before the result,
+   which is already in proxy->out. */
+static void send_profile(proxy_internal_t*proxy, int64_t start, int64_t decoded, int64_t called)
+{
+    language_t*old = proxy->old;
+    int64_t now = monotonic_nsec();
+    int64_t callback = proxy->callback_nsec;
+    message_t*m = &proxy->side_out;
+    message_start(m);
+    write_byte(m, RESP_PROFILE);
+    write_int64(m, (decoded - start) + old->convert_nsec + (now - called));
+    write_int64(m, (called - decoded) - old->convert_nsec - callback);
+    write_int64(m, callback);
+    write_int64(m, now - start);
+    send_message(proxy, m);
+}
+
+/* Tell the parent what the last call left of its budget */
+static void send_budget(proxy_internal_t*proxy)
+{
+    language_t*old = proxy->old;
+    if(!proxy->budget || !old->set_budget)
+        return;
+    message_start(&proxy->out);
+    write_byte(&proxy->out, RESP_BUDGET);
+    write_int64(&proxy->out, old->budget_left);
+    send_message(proxy, &proxy->out);
+}
+
+static void child_loop(language_t*li)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    language_t*old = proxy->old;
+
+    message_t*in = &proxy->in;
+    message_t*out = &proxy->out;
+    in->segment = proxy->segment_r;
+    out->segment = proxy->segment_w;
+    in->segment_size = out->segment_size = proxy->segment_size;
+
+    while(1) {
+        if(!next_message(proxy, in, 0, 0)) {
+            log_dbg("[sandbox] Couldn't read command- parent terminated?");
+            _exit(1);
+        }
+
+        uint8_t command = read_byte(in);
+        log_dbg("[sandbox] command=%d", command);
+        switch(command) {
+            case DEFINE_CONSTANT: {
+                char*s = read_string(in, 0);
+                log_dbg("[sandbox] define constant(%s)", s);
+                value_t*v = read_value_nolimit(in);
+                old->define_constant(old, s, v);
+            }
+            break;
+            case DEFINE_FUNCTION: {
+                char*name = read_string(in, 0);
+                uint8_t num_params = read_byte(in);
+
+                log_dbg("[sandbox] define function(%s), %d parameters", name, num_params);
+
+                proxy_function_t*pf = calloc(sizeof(proxy_function_t), 1);
+                pf->li = li;
+                pf->name = name;
+
+                value_t*value = calloc(sizeof(value_t), 1);
+                value->type = TYPE_FUNCTION;
+                value->internal = pf;
+                value->destroy = proxy_function_destroy;
+                value->call = proxy_function_call;
+                value->num_params = num_params;
+
+                old->define_function(old, name, value);
+            }
+            break;
+            case COMPILE_SCRIPT: {
+                char*script = read_string(in, 0);
+                log_dbg("[sandbox] compile script");
+                bool ret = guest_compile(proxy, script);
+                send_trace(proxy);
+                message_start(out);
+                write_byte(out, RESP_RETURN);
+                write_byte(out, ret);
+                send_message(proxy, out);
+                free(script);
+            }
+            break;
+            case IS_FUNCTION: {
+                char*function_name = read_string(in, 0);
+                log_dbg("[sandbox] is_function(%s)", function_name);
+                bool ret = old->is_function(old, function_name);
+                message_start(out);
+                write_byte(out, RESP_RETURN);
+                write_byte(out, ret);
+                send_message(proxy, out);
+                free(function_name);
+            }
+            break;
+            case CALL_FUNCTION: {
+                int64_t start = config_profile ? monotonic_nsec() : 0;
+                char*function_name = read_string(in, 0);
+                log_dbg("[sandbox] call_function(%s)", function_name, old->name);
+                value_t*args = read_value_nolimit(in);
+                int64_t decoded = config_profile ? monotonic_nsec() : 0;
+                old->convert_nsec = 0;
+                proxy->callback_nsec = 0;
+                value_t*ret = guest_call(proxy, function_name, args);
+                int64_t called = config_profile ? monotonic_nsec() : 0;
+                send_budget(proxy);
+                message_start(out);
+                if(ret) {
+                    log_dbg("[sandbox] returning function value (type:%s)", type_to_string(ret->type));
+                    write_byte(out, RESP_RETURN);
+                    write_value(out, ret);
+                    value_destroy(ret);
+                } else {
+                    log_dbg("[sandbox] error calling function %s", function_name);
+                    write_byte(out, RESP_ERROR);
+                }
+                if(config_profile) {
+                    send_profile(proxy, start, decoded, called);
+                }
+                send_trace(proxy);
+                send_message(proxy, out);
+                free(function_name);
+                value_destroy(args);
+            }
+            break;
+            case CALL_FUNCTION_BATCH: {
+                char*function_name = read_string(in, 0);
+                bool stop_on_failure = read_byte(in);
+                value_t*args_list = read_value_nolimit(in);
+                log_dbg("[sandbox] call_function_batch(%s)", function_name);
+                int i;
+                for(i=0;args_list && args_list->type == TYPE_ARRAY && i<args_list->length;i++) {
+                    struct timeval start, end;
+                    gettimeofday(&start, NULL);
+                    value_t tmp;
+                    value_t*ret = guest_call(proxy, function_name, array_get(args_list, i, &tmp));
+                    gettimeofday(&end, NULL);
+                    send_budget(proxy);
+
+                    message_start(out);
+                    write_byte(out, RESP_BATCH_ITEM);
+                    write_int32(out, i);
+                    write_int32(out, (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec));
+                    write_byte(out, ret != NULL);
+                    if(ret) {
+                        write_value(out, ret);
+                        value_destroy(ret);
+                    }
+                    send_message(proxy, out);
+                    if(!ret && stop_on_failure) {
+                        break;
+                    }
+                }
+                send_trace(proxy);
+                message_start(out);
+                write_byte(out, RESP_RETURN);
+                send_message(proxy, out);
+                free(function_name);
+                if(args_list)
+                    value_destroy(args_list);
+            }
+            break;
+            case FORK_SANDBOX: {
+                log_dbg("[sandbox] fork");
+                pid_t pid = fork_copy(proxy);
+                if(!pid) {
+                    /* we're the copy, and already talking to our own parent */
+                    break;
+                }
+                message_start(out);
+                if(pid > 0) {
+                    write_byte(out, RESP_RETURN);
+                    write_int32(out, pid);
+                } else {
+                    write_byte(out, RESP_ERROR);
+                }
+                send_message(proxy, out);
+            }
+            break;
+            case SET_BUDGET: {
+                proxy->budget = read_int64(in);
+                log_dbg("[sandbox] set_budget(%lld)", (long long)proxy->budget);
+                if(old->set_budget) {
+                    old->set_budget(old, proxy->budget);
+                }
+            }
+            break;
+            case CALL_FUNCTION_ASYNC: {
+                int32_t ticket = read_int32(in);
+                char*function_name = read_string(in, 0);
+                log_dbg("[sandbox] call_function_async(%s), ticket %d", function_name, ticket);
+                value_t*args = read_value_nolimit(in);
+                interrupted_ticket = 0;
+                guest_ticket = ticket;
+                value_t*ret = guest_call(proxy, function_name, args);
+                guest_ticket = 0;
+                send_budget(proxy);
+                send_trace(proxy);
+                message_start(out);
+                if(ret) {
+                    write_byte(out, RESP_ASYNC_RETURN);
+                    write_int32(out, ticket);
+                    write_value(out, ret);
+                    value_destroy(ret);
+                } else {
+                    log_dbg("[sandbox] error calling function %s", function_name);
+                    write_byte(out, RESP_ASYNC_ERROR);
+                    write_int32(out, ticket);
+                    write_byte(out, interrupted_ticket == ticket);
+                }
+                send_message(proxy, out);
+                free(function_name);
+                value_destroy(args);
+            }
+            break;
+            default: {
+                fprintf(stderr, "Invalid command %d\n", command);
+            }
+        }
+    }
+}
+
+static void sandbox_log(void*user, const char*str)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)user;
+
+    if(proxy->trace) {
+        trace_add(proxy->trace, TRACE_LOG, str, monotonic_nsec(), -1);
+    }
+    message_start(&proxy->out);
+    write_byte(&proxy->out, RESP_LOG);
+    write_string(&proxy->out, str);
+    send_message(proxy, &proxy->out);
+}
+
+static segment_t* segment_init(void*mem)
+{
+    segment_t*s = (segment_t*)mem;
+    memset(s, 0, sizeof(segment_t));
+    return s;
+}
+
+/* How the shared memory is divided up. Sandboxes forked from a zygote get
+   this along with the file descriptor of the memory. */
+typedef struct _shm_layout {
+    int32_t ring_size;
+    int32_t segment_size;
+    int32_t use_rings;
+} shm_layout_t;
+
+/* Sent to a sandbox that a zygote or a template forks for us, along with
+   its file descriptors: its ends of the pipes, then the shared memory and
+   the fork socket, if it has them. */
+typedef struct _child_setup {
+    shm_layout_t layout;
+    int32_t has_shm;
+    int32_t template;
+} child_setup_t;
+
+static void attach_shared_memory(proxy_internal_t*proxy, void*shm, shm_layout_t*layout, bool init)
+{
+    proxy->shm = shm;
+    proxy->shm_size = layout->ring_size + layout->segment_size;
+
+    if(layout->use_rings) {
+        int half = layout->ring_size / 2;
+        proxy->ring_w = ring_new(shm, half, init);
+        proxy->ring_r = ring_new((char*)shm + half, half, init);
+    }
+    if(layout->segment_size) {
+        int half = layout->segment_size / 2;
+        char*base = (char*)shm + layout->ring_size;
+        proxy->segment_size = half - sizeof(segment_t);
+        if(init) {
+            proxy->segment_w = segment_init(base);
+            proxy->segment_r = segment_init(base + half);
+        } else {
+            proxy->segment_w = (segment_t*)base;
+            proxy->segment_r = (segment_t*)(base + half);
+        }
+    }
+}
+
+static void detach_shared_memory(proxy_internal_t*proxy)
+{
+    if(proxy->shm) {
+        munmap(proxy->shm, proxy->shm_size);
+        proxy->shm = NULL;
+    }
+    if(proxy->ring_r)
+        ring_free(proxy->ring_r);
+    if(proxy->ring_w)
+        ring_free(proxy->ring_w);
+    proxy->ring_r = proxy->ring_w = NULL;
+    proxy->segment_r = proxy->segment_w = NULL;
+    proxy->segment_size = 0;
+}
+
+/* Map the shared memory the rings and segments between parent and child
+   live in. This has to happen before the child locks itself down. If fd is
+   given, the memory is backed by a (deleted) file, so that it can be passed
+   to a process we didn't fork ourselves. If anything fails, we just keep
+   talking through the pipes. */
+static void map_shared_memory(proxy_internal_t*proxy, int*fd, shm_layout_t*layout)
+{
+    memset(layout, 0, sizeof(shm_layout_t));
+    int ring_size = config_shm_size > 0 ? config_shm_size : 0;
+    int segment_size = config_segment_size > 0 ? config_segment_size : 0;
+    if(segment_size && segment_size < 2 * (sizeof(segment_t) + SEGMENT_THRESHOLD)) {
+        fprintf(stderr, "Segment size %d too small, not using segments\n", segment_size);
+        segment_size = 0;
+    }
+    if(!ring_size && !segment_size)
+        return;
+
+    int size = ring_size + segment_size;
+    void*shm = MAP_FAILED;
+    if(fd) {
+        char path[] = "/dev/shm/cagekeeper-XXXXXX";
+        *fd = mkstemp(path);
+        if(*fd >= 0) {
+            unlink(path);
+            if(!ftruncate(*fd, size)) {
+                shm = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, *fd, 0);
+            }
+            if(shm == MAP_FAILED) {
+                close(*fd);
+                *fd = -1;
+            }
+        }
+    } else {
+        shm = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    }
+    if(shm == MAP_FAILED) {
+        fprintf(stderr, "Couldn't map shared memory, using pipes\n");
+        return;
+    }
+
+    layout->ring_size = ring_size;
+    layout->segment_size = segment_size;
+    layout->use_rings = ring_size > 0;
+    attach_shared_memory(proxy, shm, layout, true);
+    if(layout->use_rings && (!proxy->ring_w || !proxy->ring_r)) {
+        fprintf(stderr, "Shared memory size %d too small, using pipes\n", ring_size);
+        if(proxy->ring_w)
+            ring_free(proxy->ring_w);
+        if(proxy->ring_r)
+            ring_free(proxy->ring_r);
+        proxy->ring_w = proxy->ring_r = NULL;
+        layout->use_rings = 0;
+    }
+}
+
+/* With rings, the child reads the pipe from us only to find out whether
+   we went away (see ring_watch_fd()), which needs its end to be
+   non-blocking. We set that up before the child gets the pipe: a copy
+   forked by a template isn't allowed fcntl() anymore. */
+static void prepare_watched_pipe(proxy_internal_t*proxy, int fd)
+{
+    if(proxy->ring_r) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+}
+
+/* A template may fork, so guest code that gets hold of fork() while the
+   script is loaded can, too. A pids cgroup bounds that. Without one, all
+   we have is RLIMIT_NPROC, which counts every process of our uid: allow
+   the ones running now, and config_template_nproc more. */
+static void limit_template_processes()
+{
+    if((config_cgroup && config_cgroup_pids > 0) || config_template_nproc <= 0)
+        return;
+
+    DIR*dir = opendir("/proc");
+    if(!dir)
+        return;
+    uid_t uid = getuid();
+    rlim_t count = 0;
+    struct dirent*e;
+    while((e = readdir(dir))) {
+        struct stat st;
+        char path[300];
+        if(e->d_name[0] < '0' || e->d_name[0] > '9')
+            continue;
+        snprintf(path, sizeof(path), "/proc/%s", e->d_name);
+        if(!stat(path, &st) && st.st_uid == uid)
+            count++;
+    }
+    closedir(dir);
+
+    struct rlimit rl;
+    rl.rlim_cur = rl.rlim_max = count + config_template_nproc;
+    setrlimit(RLIMIT_NPROC, &rl);
+}
+
+/* Runs in the sandbox process, once the interpreter has been initialized
+   and all file descriptors we don't need are closed. Never returns. */
+static void sandbox_main(language_t*li)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    /* log messages are passed back to the parent */
+    proxy->old->log = sandbox_log;
+    proxy->old->user = proxy;
+
+    /* see interrupt_child() */
+    guest = proxy->old;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = interrupt_guest;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    if(config_trace && !proxy->trace) {
+        /* forked by a zygote */
+        proxy->trace = trace_new(config_trace);
+    }
+    int64_t start = proxy->trace ? monotonic_nsec() : 0;
+    if(proxy->fork_sock >= 0) {
+        /* the copies we fork are reaped automatically */
+        signal(SIGCHLD, SIG_IGN);
+        limit_template_processes();
+        seccomp_lockdown_template();
+    } else {
+        seccomp_lockdown();
+    }
+    trace_span(proxy, TRACE_LOCKDOWN, NULL, start);
+    fflush(stdout);
+
+    /* let the parent know we're ready to take commands */
+    send_trace(proxy);
+    message_start(&proxy->out);
+    write_byte(&proxy->out, RESP_RETURN);
+    send_message(proxy, &proxy->out);
+
+    child_loop(li);
+    _exit(0);
+}
+
+/* Set up our side of the pipes to the child, and the shared memory (the
+   child's view of it is the mirror image of ours) */
+static void connect_child(proxy_internal_t*proxy, int*p_to_c, int*c_to_p, bool sandbox)
+{
+    if(sandbox) {
+        proxy->sandbox = true;
+        proxy->fd_r = p_to_c[0];
+        proxy->fd_w = c_to_p[1];
+        ring_t*ring = proxy->ring_r;
+        proxy->ring_r = proxy->ring_w;
+        proxy->ring_w = ring;
+        segment_t*segment = proxy->segment_r;
+        proxy->segment_r = proxy->segment_w;
+        proxy->segment_w = segment;
+        if(proxy->ring_r) {
+            /* we won't see EOF on a ring, so watch the pipe from the
+               parent: it's hung up when the parent goes away */
+            ring_watch_fd(proxy->ring_r, proxy->fd_r);
+            ring_watch_fd(proxy->ring_w, proxy->fd_r);
+        }
+    } else {
+        close(c_to_p[1]); // close write
+        close(p_to_c[0]); // close read
+        proxy->fd_r = c_to_p[0];
+        proxy->fd_w = p_to_c[1];
+        /* see transport_write() and read_with_deadline() */
+        fcntl(proxy->fd_r, F_SETFL, fcntl(proxy->fd_r, F_GETFL) | O_NONBLOCK);
+        fcntl(proxy->fd_w, F_SETFL, fcntl(proxy->fd_w, F_GETFL) | O_NONBLOCK);
+    }
+    proxy->in.segment = proxy->segment_r;
+    proxy->out.segment = proxy->segment_w;
+    proxy->in.segment_size = proxy->out.segment_size = proxy->segment_size;
+}
+
+static void close_connection(proxy_internal_t*proxy)
+{
+    close(proxy->fd_r);
+    close(proxy->fd_w);
+    if(proxy->fork_sock >= 0) {
+        close(proxy->fork_sock);
+    }
+    message_free(&proxy->in);
+    detach_shared_memory(proxy);
+}
+
+/* A cgroup of its own for the child (see config_cgroup). Limits we can't
+   set are reported, but the group is used anyway. */
+static cgroup_t* new_cgroup(proxy_internal_t*proxy)
+{
+    cgroup_t*cg = cgroup_new(config_cgroup);
+    if(!cg) {
+        language_error(proxy->li, "Can't create a cgroup below %s\n", config_cgroup);
+        return NULL;
+    }
+    if(!cgroup_set_limits(cg, config_maxmem, config_cgroup_cpu, config_cgroup_pids)) {
+        language_error(proxy->li, "Can't set the limits of cgroup %s\n", cg->path);
+    }
+    return cg;
+}
+
+/* Wait until the interpreter is initialized and locked down, so that a
+   sandbox we return is ready to use (and initialization errors show up
+   here, not in the first call) */
+static bool wait_for_child(proxy_internal_t*proxy)
+{
+    int64_t deadline = deadline_after(proxy->timeout_ms);
+    uint8_t resp = 0;
+    while(receive_message(proxy, &proxy->in, MAX_MESSAGE_SIZE, deadline) &&
+          (resp = read_byte(&proxy->in)) == RESP_TRACE) {
+        handle_trace(proxy, &proxy->in);
+    }
+    if(resp == RESP_RETURN) {
+        trace_span(proxy, TRACE_SPAWN, NULL, proxy->created);
+        proxy->has_guest_clock = !clock_getcpuclockid(proxy->child_pid, &proxy->guest_clock);
+        if(config_cgroup && !proxy->cgroup) {
+            /* forked by a zygote or a template: memory the child still
+               shares with its parent stays charged to the parent's group */
+            proxy->cgroup = new_cgroup(proxy);
+            if(proxy->cgroup && !cgroup_add(proxy->cgroup, proxy->child_pid)) {
+                language_error(proxy->li, "Can't move sandbox process %d into %s\n", proxy->child_pid, proxy->cgroup->path);
+            }
+        }
+        if(config_cpu_counter) {
+            /* the child is our own, or the zygote's: either way, it runs
+               under our uid, so we're allowed to count it */
+            proxy->cpu = perf_counter_new(proxy->child_pid);
+            if(proxy->cpu) {
+                proxy->li->cpu_unit = proxy->cpu->unit;
+            } else {
+                language_error(proxy->li, "Can't count the CPU of sandbox process %d\n", proxy->child_pid);
+            }
+        }
+        return true;
+    }
+
+    fprintf(stderr, "Sandbox process %d failed to start\n", proxy->child_pid);
+    kill(proxy->child_pid, SIGKILL);
+    if(!proxy->foreign_child) {
+        waitpid(proxy->child_pid, NULL, 0);
+    }
+    if(proxy->cgroup) {
+        cgroup_destroy(proxy->cgroup);
+        proxy->cgroup = NULL;
+    }
+    close_connection(proxy);
+    return false;
+}
+
+static bool spawn_child(language_t*li, bool template)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    int p_to_c[2];
+    int c_to_p[2];
+    int stdout_pipe[2];
+    int stderr_pipe[2];
+
+    if(pipe(p_to_c) || pipe(c_to_p) || pipe(stdout_pipe) || pipe(stderr_pipe)) {
+        perror("create pipe");
+        return false;
+    }
+
+    int fork_sock[2] = {-1, -1};
+    if(template && socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fork_sock)) {
+        perror("socketpair");
+        return false;
+    }
+
+    shm_layout_t layout;
+    map_shared_memory(proxy, NULL, &layout);
+    prepare_watched_pipe(proxy, p_to_c[0]);
+
+    /* don't let the child inherit (and later flush) our buffered output */
+    fflush(stdout);
+    fflush(stderr);
+
+    if(config_cgroup) {
+        proxy->cgroup = new_cgroup(proxy);
+    }
+
+    proxy->child_pid = fork();
+    if(proxy->child_pid < 0) {
+        perror("fork");
+        int i;
+        for(i = 0; i < 2; i++) {
+            close(p_to_c[i]);
+            close(c_to_p[i]);
+            close(stdout_pipe[i]);
+            close(stderr_pipe[i]);
+            if(fork_sock[i] >= 0)
+                close(fork_sock[i]);
+        }
+        if(proxy->cgroup) {
+            cgroup_destroy(proxy->cgroup);
+            proxy->cgroup = NULL;
+        }
+        detach_shared_memory(proxy);
+        return false;
+    }
+    if(!proxy->child_pid) {
+        //child
+        if(proxy->cgroup && !cgroup_add(proxy->cgroup, 0)) {
+            /* better no sandbox than one without the limits we asked for */
+            _exit(45);
+        }
+        connect_child(proxy, p_to_c, c_to_p, true);
+        proxy->fork_sock = fork_sock[1];
+
+        int keep[] = {1, 2, proxy->fd_r, proxy->fd_w, proxy->fork_sock};
+        close_all_fds(keep, sizeof(keep)/sizeof(keep[0]));
+
+        /* We haven't loaded any 3rd party code yet. 
+           Give the language interpreter a chance to do some initializations 
+           (with all syscalls still available) before we switch into secure mode.
+         */
+        /* only what the child does from here on is news to the parent */
+        if(proxy->trace) {
+            trace_clear(proxy->trace);
+        }
+        int64_t start = proxy->trace ? monotonic_nsec() : 0;
+        bool ret = proxy->old->initialize(proxy->old, config_maxmem);
+        if(!ret) {
+            _exit(44);
+        }
+        trace_span(proxy, TRACE_INITIALIZE, NULL, start);
+
+        sandbox_main(li);
+    }
+
+    //parent
+    connect_child(proxy, p_to_c, c_to_p, false);
+    if(template) {
+        close(fork_sock[1]);
+        proxy->fork_sock = fork_sock[0];
+    }
+    return wait_for_child(proxy);
+}
+
+static bool zygote_init(void*data)
+{
+    language_t*old = (language_t*)data;
+    return old->initialize(old, config_maxmem);
+}
+
+/* Runs in a sandbox forked by a zygote or a template: attach to the file
+   descriptors it got from the parent. */
+static bool attach_child(proxy_internal_t*proxy, int*fds, int num_fds, const void*message, int len)
+{
+    child_setup_t setup;
+    if(len != sizeof(setup)) {
+        return false;
+    }
+    memcpy(&setup, message, sizeof(setup));
+    if(num_fds != 2 + !!setup.has_shm + !!setup.template) {
+        return false;
+    }
+
+    int pos = 2;
+    if(setup.has_shm) {
+        int fd = fds[pos++];
+        void*shm = mmap(NULL, setup.layout.ring_size + setup.layout.segment_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if(shm == MAP_FAILED) {
+            return false;
+        }
+        attach_shared_memory(proxy, shm, &setup.layout, false);
+    }
+    proxy->fork_sock = setup.template ? fds[pos++] : -1;
+
+    int p_to_c[2] = {fds[0], -1};
+    int c_to_p[2] = {-1, fds[1]};
+    connect_child(proxy, p_to_c, c_to_p, true);
+    return true;
+}
+
+/* Runs in a process forked from the zygote, with the interpreter already
+   initialized. */
+static void zygote_child(void*data, int*fds, int num_fds, const void*message, int len)
+{
+    language_t*li = calloc(1, sizeof(language_t));
+    proxy_internal_t*proxy = calloc(1, sizeof(proxy_internal_t));
+    li->internal = proxy;
+    proxy->li = li;
+    proxy->old = (language_t*)data;
+
+    if(!attach_child(proxy, fds, num_fds, message, len)) {
+        _exit(1);
+    }
+
+    int keep[] = {1, 2, proxy->fd_r, proxy->fd_w, proxy->fork_sock};
+    close_all_fds(keep, sizeof(keep)/sizeof(keep[0]));
+
+    sandbox_main(li);
+}
+
+/* Create the pipes, shared memory and (for a template) fork socket for a
+   sandbox that a zygote or a template forks for us. fds is filled with
+   the ends the child gets. Returns the number of those, or -1. */
+static int open_child_fds(proxy_internal_t*proxy, int*p_to_c, int*c_to_p, int*fds, child_setup_t*setup, bool template)
+{
+    memset(setup, 0, sizeof(child_setup_t));
+    if(pipe(p_to_c) || pipe(c_to_p)) {
+        perror("create pipe");
+        return -1;
+    }
+
+    int num_fds = 0;
+    fds[num_fds++] = p_to_c[0];
+    fds[num_fds++] = c_to_p[1];
+
+    int shm_fd = -1;
+    map_shared_memory(proxy, &shm_fd, &setup->layout);
+    prepare_watched_pipe(proxy, p_to_c[0]);
+    if(shm_fd >= 0) {
+        setup->has_shm = 1;
+        fds[num_fds++] = shm_fd;
+    }
+
+    if(template) {
+        int sv[2];
+        if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv)) {
+            perror("socketpair");
+            sv[0] = sv[1] = -1;
+        }
+        proxy->fork_sock = sv[0];
+        setup->template = 1;
+        fds[num_fds++] = sv[1];
+    }
+    return num_fds;
+}
+
+/* Once the child's ends have been passed on, we don't need them anymore */
+static void close_child_fds(proxy_internal_t*proxy, int*p_to_c, int*c_to_p, int*fds, int num_fds)
+{
+    int i;
+    for(i=2;i<num_fds;i++) {
+        if(fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    connect_child(proxy, p_to_c, c_to_p, false);
+}
+
+static bool spawn_from_zygote(language_t*li, zygote_t*zygote, bool template)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
 
-    proxy->in_call = true;
-    ret = process_callbacks(li, &timeout);
-    if(!ret) {
-        if(!timeout.tv_sec && !timeout.tv_usec) {
-            li->timeout = true;
-            language_error(li, "Timeout while calling function %s\n", name);
-        }
-        return NULL;
+    int p_to_c[2];
+    int c_to_p[2];
+    int fds[ZYGOTE_MAX_FDS];
+    child_setup_t setup;
+    int num_fds = open_child_fds(proxy, p_to_c, c_to_p, fds, &setup, template);
+    if(num_fds < 0) {
+        return false;
     }
-    proxy->in_call = false;
 
-    value_t*value = read_value(proxy->fd_r, &timeout);
-    if(!value) {
-        if(!timeout.tv_sec && !timeout.tv_usec) {
-            li->timeout = true;
-            language_error(li, "Timeout while calling function %s.\n", name);
+    proxy->child_pid = zygote_fork(zygote, fds, num_fds, &setup, sizeof(setup));
+    proxy->foreign_child = true;
+    close_child_fds(proxy, p_to_c, c_to_p, fds, num_fds);
+
+    if(proxy->child_pid < 0 || (template && proxy->fork_sock < 0)) {
+        fprintf(stderr, "Couldn't fork from zygote\n");
+        if(proxy->child_pid > 0) {
+            kill(proxy->child_pid, SIGKILL);
         }
-        return NULL;
+        close_connection(proxy);
+        return false;
     }
-    return value;
+    return wait_for_child(proxy);
 }
 
-typedef struct _proxy_function {
-    language_t*li;
-    char*name;
-} proxy_function_t;
-
-static void proxy_function_destroy(value_t*v)
+/* Runs in a template: fork a copy of ourselves, for the file descriptors
+   the parent sent through the fork socket. Returns 0 in the copy. */
+static pid_t fork_copy(proxy_internal_t*proxy)
 {
-    proxy_function_t*f = (proxy_function_t*)v->internal; 
-    free(f->name);
-    free(v->internal);
-    free(v);
+    int fds[ZYGOTE_MAX_FDS];
+    int num_fds = 0;
+    char message[ZYGOTE_MAX_MESSAGE];
+    int len = 0;
+    if(proxy->fork_sock < 0 || !zygote_receive_request(proxy->fork_sock, fds, &num_fds, message, &len)) {
+        return -1;
+    }
+
+    /* glibc's fork() uses clone(), which the seccomp filter doesn't allow */
+    pid_t pid = syscall(__NR_fork);
+    if(pid) {
+        int i;
+        for(i=0;i<num_fds;i++) {
+            close(fds[i]);
+        }
+        return pid;
+    }
+
+    /* we're the copy. Drop the template's connection to the parent, and
+       anything the parent queued up for the template. */
+    close(proxy->fd_r);
+    close(proxy->fd_w);
+    close(proxy->fork_sock);
+    queue_free(proxy);
+    detach_shared_memory(proxy);
+
+    if(!attach_child(proxy, fds, num_fds, message, len)) {
+        _exit(1);
+    }
+
+    if(proxy->trace) {
+        trace_clear(proxy->trace);
+    }
+    int64_t start = proxy->trace ? monotonic_nsec() : 0;
+
+    /* we can't be reaped by the parent, so die with the template instead */
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    seccomp_lockdown_copy();
+    trace_span(proxy, TRACE_LOCKDOWN, NULL, start);
+
+    send_trace(proxy);
+    message_start(&proxy->out);
+    write_byte(&proxy->out, RESP_RETURN);
+    send_message(proxy, &proxy->out);
+    return 0;
 }
 
-static value_t* proxy_function_call(value_t*v, value_t*args)
+static language_t* proxy_alloc(language_t*old);
+
+/* Free what proxy_alloc() allocated, for a sandbox that has no process
+   (anymore) */
+static void proxy_free_internal(language_t*li)
 {
-    proxy_function_t*f = (proxy_function_t*)v->internal; 
-    log_dbg("[sandbox] invoking callback %s", f->name);
-    language_t*li = f->li;
     proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
-
-    write_byte(proxy->fd_w, RESP_CALLBACK);
-    write_string(proxy->fd_w, f->name);
-    write_value(proxy->fd_w, args);
-    return read_value_nolimit(proxy->fd_r);
+    if(proxy->trace) {
+        trace_destroy(proxy->trace);
+    }
+    if(proxy->profiles) {
+        DICT_ITERATE_DATA(proxy->profiles, call_profile_t*, profile) {
+            free(profile);
+        }
+        dict_destroy(proxy->profiles);
+    }
+    free(proxy);
+    free(li);
 }
 
-static void child_loop(language_t*li)
+static language_t* fork_proxy(language_t*li)
 {
     proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
-    language_t*old = proxy->old;
-
-    int r = proxy->fd_r;
-    int w = proxy->fd_w;
 
-    while(1) {
-        char command;
-        if(!read_with_retry(r, &command, 1)) {
-            log_dbg("[sandbox] Couldn't read command- parent terminated?");
-            _exit(1);
-        }
+    log_dbg("[proxy] fork()");
+    if(proxy->in_call) {
+        language_error(li, "You can't fork the guest program from a callback function.");
+        return NULL;
+    }
 
-        log_dbg("[sandbox] command=%d", command);
-        switch(command) {
-            case DEFINE_CONSTANT: {
-                char*s = read_string(r, 0, NULL);
-                log_dbg("[sandbox] define constant(%s)", s);
-                value_t*v = read_value_nolimit(r);
-                old->define_constant(old, s, v);
-            }
-            break;
-            case DEFINE_FUNCTION: {
-                char*name = read_string(r, 0, NULL);
-                uint8_t num_params = 0;
-                read_with_retry(r, &num_params, 1);
+    language_t*copy = proxy_alloc(NULL);
+    proxy_internal_t*c = (proxy_internal_t*)copy->internal;
+    c->timeout_ms = proxy->timeout_ms;
+    c->budget = proxy->budget;
+    c->cpu_limit = proxy->cpu_limit;
 
-                log_dbg("[sandbox] define function(%s), %d parameters", name, num_params);
+    int p_to_c[2];
+    int c_to_p[2];
+    int fds[ZYGOTE_MAX_FDS];
+    child_setup_t setup;
+    int num_fds = open_child_fds(c, p_to_c, c_to_p, fds, &setup, false);
+    if(num_fds < 0) {
+        proxy_free_internal(copy);
+        return NULL;
+    }
 
-                proxy_function_t*pf = calloc(sizeof(proxy_function_t), 1);
-                pf->li = li;
-                pf->name = name;
+    /* the file descriptors go first, so the template doesn't have to wait
+       for them once it sees the command */
+    bool ok = zygote_send_request(proxy->fork_sock, fds, num_fds, &setup, sizeof(setup));
+    close_child_fds(c, p_to_c, c_to_p, fds, num_fds);
+    if(ok) {
+        message_start(&proxy->out);
+        write_byte(&proxy->out, FORK_SANDBOX);
+        ok = send_message(proxy, &proxy->out);
+    }
 
-                value_t*value = calloc(sizeof(value_t), 1);
-                value->type = TYPE_FUNCTION;
-                value->internal = pf;
-                value->destroy = proxy_function_destroy;
-                value->call = proxy_function_call;
-                value->num_params = num_params;
+    if(ok) {
+        int64_t deadline = deadline_after(proxy->timeout_ms);
 
-                old->define_function(old, name, value);
-            }
-            break;
-            case COMPILE_SCRIPT: {
-                char*script = read_string(r, 0, NULL);
-                log_dbg("[sandbox] compile script");
-                bool ret = old->compile_script(old, script);
-                write_byte(w, RESP_RETURN);
-                write_byte(w, ret);
-                free(script);
-            }
-            break;
-            case IS_FUNCTION: {
-                char*function_name = read_string(r, 0, NULL);
-                log_dbg("[sandbox] is_function(%s)", function_name);
-                bool ret = old->is_function(old, function_name);
-                write_byte(w, ret);
-                free(function_name);
-            }
-            break;
-            case CALL_FUNCTION: {
-                char*function_name = read_string(r, 0, NULL);
-                log_dbg("[sandbox] call_function(%s)", function_name, old->name);
-                value_t*args = read_value_nolimit(r);
-                value_t*ret = old->call_function(old, function_name, args);
-                if(ret) {
-                    log_dbg("[sandbox] returning function value (type:%s)", type_to_string(ret->type));
-                    write_byte(w, RESP_RETURN);
-                    write_value(w, ret);
-                    value_destroy(ret);
-                } else {
-                    log_dbg("[sandbox] error calling function %s", function_name);
-                    write_byte(w, RESP_ERROR);
-                }
-                free(function_name);
-                value_destroy(args);
-            }
-            break;
-            default: {
-                fprintf(stderr, "Invalid command %d\n", command);
-            }
+        proxy->in_call = true;
+        ok = process_callbacks(li, &deadline, 0);
+        if(ok) {
+            proxy->in_call = false;
+            c->child_pid = read_int32(&proxy->in);
+        } else if(call_timed_out(proxy, ok, deadline)) {
+            li->timeout = true;
+            language_error(li, "Timeout while forking\n");
         }
     }
+    if(!ok || c->child_pid <= 0) {
+        language_error(li, "Couldn't fork sandbox\n");
+        close_connection(c);
+        proxy_free_internal(copy);
+        return NULL;
+    }
+
+    /* the copy is a child of the template */
+    c->foreign_child = true;
+    if(!wait_for_child(c)) {
+        proxy_free_internal(copy);
+        return NULL;
+    }
+
+    c->callback_functions = dict_new(&charptr_type);
+    c->async_calls = dict_new(&int_type);
+    return copy;
 }
 
-static void close_all_fds(int*keep, int keep_num)
+static void destroy_proxy(language_t* li)
 {
-    int max=sysconf(_SC_OPEN_MAX);
-    int fd;
-    for(fd=0; fd<max; fd++) {
-        int j;
-        bool do_keep = false;
-        for(j=0;j<keep_num;j++) {
-            do_keep |= keep[j] == fd;
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    if(proxy->dispatching) {
+        /* called from a completion callback, see loop_event() */
+        proxy->destroyed = true;
+        return;
+    }
+
+    language_t*old = proxy->old;
+
+    if(proxy->loop) {
+        /* pending calls are dropped, without calling their callbacks */
+        sandbox_loop_unwatch(proxy->loop, proxy->fd_r);
+        sandbox_loop_unwatch(proxy->loop, proxy->fd_w);
+        DICT_ITERATE_DATA(proxy->loop_calls, loop_call_t*, call) {
+            sandbox_loop_release(proxy->loop);
+            free(call);
+        }
+        dict_destroy(proxy->loop_calls);
+        message_free(&proxy->rx);
+        message_free(&proxy->tx);
+    }
+
+    if(proxy->foreign_child) {
+        /* the zygote (or template) reaps its own children */
+        log_dbg("killing sandbox process %d\n", proxy->child_pid);
+        kill(proxy->child_pid, SIGKILL);
+    } else {
+        int status = 0;
+        struct rusage usage;
+        int ret = wait4(proxy->child_pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage);
+
+        if(ret == 0) {
+            log_dbg("killing sandbox process %d\n", proxy->child_pid);
+            kill(proxy->child_pid, SIGKILL);
+            ret = wait4(proxy->child_pid, &status, 0, &usage);
         }
-        if(!do_keep) {
-            close(fd);
+        if(ret > 0) {
+            log_dbg("sandbox process %d: user=%ld.%06ld sys=%ld.%06ld maxrss=%ldkB calls=%d callbacks=%d sent=%lld received=%lld\n",
+                    proxy->child_pid,
+                    (long)usage.ru_utime.tv_sec, (long)usage.ru_utime.tv_usec,
+                    (long)usage.ru_stime.tv_sec, (long)usage.ru_stime.tv_usec,
+                    usage.ru_maxrss, proxy->stats.calls, proxy->stats.callbacks,
+                    (long long)proxy->stats.bytes_sent, (long long)proxy->stats.bytes_received);
         }
+        if(WIFSIGNALED(status)) {
+            log_dbg("%08x %08x signal=%d\n", ret, status, WTERMSIG(status));
+        } else if(WIFEXITED(status)) {
+            log_dbg("%08x %08x exit=%d\n", ret, status, WEXITSTATUS(status));
+        } else {
+            log_dbg("%08x %08x unknown exit reason. status=%d\n", ret, status, status);
+        }
+    }
+    close(proxy->fd_r);
+    close(proxy->fd_w);
+    if(proxy->fork_sock >= 0) {
+        close(proxy->fork_sock);
+    }
+    if(proxy->cpu) {
+        perf_counter_destroy(proxy->cpu);
+    }
+    if(proxy->cgroup) {
+        cgroup_destroy(proxy->cgroup);
+    }
+    message_free(&proxy->in);
+    message_free(&proxy->out);
+    queue_free(proxy);
+    DICT_ITERATE_DATA(proxy->async_calls, value_t*, v) {
+        if(v && v != &async_failed && v != &async_timed_out)
+            value_destroy(v);
+    }
+    dict_destroy(proxy->async_calls);
+    dict_destroy(proxy->callback_functions);
+    detach_shared_memory(proxy);
+    proxy_free_internal(li);
+
+    if(old) {
+        old->destroy(old);
     }
 }
 
-static void sandbox_log(void*user, const char*str)
+bool initialize_proxy(language_t*li, size_t memsize)
 {
-    proxy_internal_t*proxy = (proxy_internal_t*)user;
+    return true;
+}
 
-    write_byte(proxy->fd_w, RESP_LOG);
-    write_string(proxy->fd_w, str);
+static void set_timeout_proxy(language_t*li, int max_ms)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    proxy->timeout_ms = max_ms > 0 ? max_ms : config_maxtime * 1000;
 }
 
-static bool spawn_child(language_t*li)
+static void set_budget_proxy(language_t*li, int64_t max_ops)
 {
     proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
 
-    int p_to_c[2];
-    int c_to_p[2];
-    int stdout_pipe[2];
-    int stderr_pipe[2];
+    log_dbg("[proxy] set_budget(%lld)", (long long)max_ops);
+    proxy->budget = max_ops > 0 ? max_ops : 0;
+    li->budget_left = 0;
+    message_start(&proxy->out);
+    write_byte(&proxy->out, SET_BUDGET);
+    write_int64(&proxy->out, proxy->budget);
+    send_message(proxy, &proxy->out);
+}
 
-    if(pipe(p_to_c) || pipe(c_to_p) || pipe(stdout_pipe) || pipe(stderr_pipe)) {
-        perror("create pipe");
+static bool set_cpu_limit_proxy(language_t*li, int64_t max)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    if(!proxy->cpu) {
+        language_error(li, "CPU limits need config_cpu_counter, and a kernel that lets us count");
         return false;
     }
+    proxy->cpu_limit = max > 0 ? max : 0;
+    if(!proxy->cpu_limit) {
+        perf_counter_set_limit(proxy->cpu, 0, SIGUSR1);
+    }
+    return true;
+}
 
-    proxy->child_pid = fork();
-    if(!proxy->child_pid) {
-        //child
-        proxy->fd_r = p_to_c[0];
-        proxy->fd_w = c_to_p[1];
+static bool cgroup_usage_proxy(language_t*li, int64_t*mem_peak, int64_t*cpu_usec)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
 
-        int keep[] = {1, 2, proxy->fd_r, proxy->fd_w};
-        close_all_fds(keep, sizeof(keep)/sizeof(keep[0]));
+    if(!proxy->cgroup) {
+        return false;
+    }
+    *mem_peak = cgroup_memory_peak(proxy->cgroup);
+    *cpu_usec = cgroup_cpu_usec(proxy->cgroup);
+    return true;
+}
 
-        /* We haven't loaded any 3rd party code yet. 
-           Give the language interpreter a chance to do some initializations 
-           (with all syscalls still available) before we switch into secure mode.
-         */
-        bool ret = proxy->old->initialize(proxy->old, config_maxmem);
-        if(!ret) {
-            _exit(44);
-        }
+/* Read the CPU time and peak RSS of a running process from /proc. That's
+   a few hundred bytes of text, so it's cheap enough to do after every
+   call. */
+static bool read_proc_usage(pid_t pid, sandbox_stats_t*stats)
+{
+    char filename[64];
+    char buffer[2048];
 
-        /* log messages are passed back to the parent */
-        proxy->old->log = sandbox_log;
-        proxy->old->user = proxy;
+    sprintf(filename, "/proc/%d/stat", pid);
+    int fd = open(filename, O_RDONLY|O_CLOEXEC);
+    if(fd < 0) {
+        return false;
+    }
+    int len = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if(len <= 0) {
+        return false;
+    }
+    buffer[len] = 0;
+    /* the process name may contain spaces and parentheses, so start
+       counting fields after it. utime and stime are fields 14 and 15. */
+    char*p = strrchr(buffer, ')');
+    unsigned long utime, stime;
+    if(!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+        return false;
+    }
+    long ticks = sysconf(_SC_CLK_TCK);
+    stats->user_usec = (int64_t)utime * 1000000 / ticks;
+    stats->sys_usec = (int64_t)stime * 1000000 / ticks;
+
+    stats->max_rss = -1;
+    sprintf(filename, "/proc/%d/status", pid);
+    fd = open(filename, O_RDONLY|O_CLOEXEC);
+    if(fd >= 0) {
+        len = read(fd, buffer, sizeof(buffer) - 1);
+        close(fd);
+        buffer[len > 0 ? len : 0] = 0;
+        p = strstr(buffer, "VmHWM:");
+        if(p) {
+            stats->max_rss = atoll(p + strlen("VmHWM:")) * 1024;
+        }
+    }
+    return true;
+}
 
-        seccomp_lockdown();
-        fflush(stdout);
+static bool get_stats_proxy(language_t*li, sandbox_stats_t*stats)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
 
-        child_loop(li);
-        _exit(0);
+    *stats = proxy->stats;
+    if(!read_proc_usage(proxy->child_pid, stats)) {
+        stats->user_usec = stats->sys_usec = stats->max_rss = -1;
+        return false;
     }
-
-    //parent
-    close(c_to_p[1]); // close write
-    close(p_to_c[0]); // close read
-    proxy->fd_r = c_to_p[0];
-    proxy->fd_w = p_to_c[1];
     return true;
 }
 
-static void destroy_proxy(language_t* li)
+static const histogram_t* get_profile_proxy(language_t*li, const char*function, call_phase_t phase)
 {
     proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
 
-    language_t*old = proxy->old;
+    if(!proxy->profiles || phase < 0 || phase >= NUM_PHASES) {
+        return NULL;
+    }
+    call_profile_t*profile = dict_lookup(proxy->profiles, function);
+    return profile ? &profile->phases[phase] : NULL;
+}
 
-    int status = 0;
-    int ret = waitpid(proxy->child_pid, &status, WNOHANG | WUNTRACED | WCONTINUED);
+static void dump_profile_proxy(language_t*li, FILE*fi)
+{
+    static const char*phase_names[NUM_PHASES] = {"encode", "transit", "convert", "execute", "callback", "decode"};
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
 
-    if(ret == 0) {
-#ifdef PROCSTAT
-        char buffer[256];
-        sprintf(buffer, "procstat /proc/%d/stat", proxy->child_pid);
-        system(buffer);
-#endif
-        log_dbg("killing sandbox process %d\n", proxy->child_pid);
-        kill(proxy->child_pid, SIGKILL);
-        ret = waitpid(proxy->child_pid, &status, 0);
+    if(!proxy->profiles) {
+        return;
     }
-    if(WIFSIGNALED(status)) {
-        log_dbg("%08x %08x signal=%d\n", ret, status, WTERMSIG(status));
-    } else if(WIFEXITED(status)) {
-        log_dbg("%08x %08x exit=%d\n", ret, status, WEXITSTATUS(status));
-    } else {
-        log_dbg("%08x %08x unknown exit reason. status=%d\n", ret, status, status);
+    DICT_ITERATE_ITEMS(proxy->profiles, const char*, name, call_profile_t*, profile) {
+        fprintf(fi, "%s:\n", name);
+        int i;
+        for(i=0;i<NUM_PHASES;i++) {
+            fprintf(fi, "  %-8s ", phase_names[i]);
+            histogram_print(&profile->phases[i], fi);
+        }
     }
-    free(proxy);
-    free(li);
-
-    old->destroy(old);
 }
 
-bool initialize_proxy(language_t*li, size_t memsize)
+static bool write_trace_proxy(language_t*li, FILE*fi)
 {
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    if(!proxy->trace) {
+        return false;
+    }
+    trace_write_json(proxy->trace, fi, getpid(), proxy->child_pid);
     return true;
 }
 
-language_t* proxy_new(language_t*old)
+static language_t* proxy_alloc(language_t*old)
 {
     language_t * li = calloc(1, sizeof(language_t));
     li->name = "proxy";
     li->initialize = initialize_proxy;
+    li->set_timeout = set_timeout_proxy;
+    li->set_budget = set_budget_proxy;
+    li->set_cpu_limit = set_cpu_limit_proxy;
+    li->cgroup_usage = cgroup_usage_proxy;
+    li->get_stats = get_stats_proxy;
+    li->get_profile = get_profile_proxy;
+    li->dump_profile = dump_profile_proxy;
+    li->write_trace = write_trace_proxy;
     li->compile_script = compile_script_proxy;
     li->is_function = is_function_proxy;
     li->call_function = call_function_proxy;
+    li->call_function_async = call_function_async_proxy;
+    li->call_result = call_result_proxy;
+    li->call_function_batch = call_function_batch_proxy;
+    li->attach_loop = attach_loop_proxy;
+    li->call_function_nb = call_function_nb_proxy;
     li->define_function = define_function_proxy;
     li->define_constant = define_constant_proxy;
     li->destroy = destroy_proxy;
@@ -601,16 +3082,85 @@ language_t* proxy_new(language_t*old)
     proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
     proxy->li = li;
     proxy->old = old;
-    proxy->timeout = config_maxtime;
+    proxy->timeout_ms = config_maxtime * 1000;
+    proxy->fork_sock = -1;
+    li->cpu_used = -1;
+    li->guest_usec = -1;
+    proxy->guest_start = -1;
+    if(config_profile) {
+        proxy->profiles = dict_new(&charptr_type);
+    }
+    if(config_trace) {
+        proxy->trace = trace_new(config_trace);
+        proxy->created = monotonic_nsec();
+    }
+    return li;
+}
+
+static language_t* proxy_spawn(language_t*old, bool template)
+{
+    language_t*li = proxy_alloc(old);
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
 
-    if(!spawn_child(li)) {
+    if(!spawn_child(li, template)) {
         fprintf(stderr, "Couldn't spawn child process\n");
-        free(proxy);
-        free(li);
+        proxy_free_internal(li);
+        return NULL;
+    }
+
+    proxy->callback_functions = dict_new(&charptr_type);
+    proxy->async_calls = dict_new(&int_type);
+    if(template) {
+        li->fork = fork_proxy;
+    }
+
+    return li;
+}
+
+language_t* proxy_new(language_t*old)
+{
+    return proxy_spawn(old, false);
+}
+
+language_t* proxy_template_new(language_t*old)
+{
+    return proxy_spawn(old, true);
+}
+
+zygote_t* proxy_zygote_new(language_t*old)
+{
+    zygote_t*zygote = zygote_new(zygote_init, zygote_child, old);
+
+    /* the zygote has its own copy of the interpreter, ours was never initialized */
+    old->destroy(old);
+    return zygote;
+}
+
+static language_t* proxy_spawn_from_zygote(zygote_t*zygote, bool template)
+{
+    language_t*li = proxy_alloc(NULL);
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    if(!spawn_from_zygote(li, zygote, template)) {
+        proxy_free_internal(li);
         return NULL;
     }
 
     proxy->callback_functions = dict_new(&charptr_type);
+    proxy->async_calls = dict_new(&int_type);
+    if(template) {
+        li->fork = fork_proxy;
+    }
 
     return li;
 }
+
+language_t* proxy_new_from_zygote(zygote_t*zygote)
+{
+    return proxy_spawn_from_zygote(zygote, false);
+}
+
+language_t* proxy_template_new_from_zygote(zygote_t*zygote)
+{
+    return proxy_spawn_from_zygote(zygote, true);
+}
@@ -4,6 +4,7 @@
 #include <signal.h>
 #include "util.h"
 #include "language.h"
+#include "settings.h"
 
 #include <frameobject.h>
 
@@ -12,6 +13,10 @@ typedef struct _py_internal {
     PyObject*module;
     language_t*li;
     char*buffer;
+    volatile sig_atomic_t interrupted;
+    int64_t budget;
+    PyObject*capsule; /* passed to budget_trace() */
+    PyObject*array_type; /* array.array, for packed arrays */
 } py_internal_t;
 
 static PyTypeObject FunctionProxyClass;
@@ -25,10 +30,20 @@ typedef struct {
 
 static value_t* pyobject_to_value(language_t*li, PyObject*o)
 {
+    py_internal_t*py = (py_internal_t*)li->internal;
     if(o == Py_None) {
         return value_new_void();
     } else if(PyUnicode_Check(o)) {
-        return value_new_string(PyUnicode_AS_DATA(o));
+        /* PyUnicode_AS_DATA() would be the interpreter's UCS-2/UCS-4 buffer */
+        PyObject*utf8 = PyUnicode_AsUTF8String(o);
+        if(!utf8) {
+            PyErr_Clear();
+            language_error(li, "Can't encode string as UTF-8");
+            return NULL;
+        }
+        value_t*v = value_new_string(PyString_AsString(utf8));
+        Py_DECREF(utf8);
+        return v;
     } else if(PyString_Check(o)) {
         return value_new_string(PyString_AsString(o));
     } else if(PyLong_Check(o)) {
@@ -43,6 +58,21 @@ static value_t* pyobject_to_value(language_t*li, PyObject*o)
 #endif
     } else if(PyBool_Check(o)) {
         return value_new_boolean(o == Py_True);
+    } else if(py->array_type && PyObject_TypeCheck(o, (PyTypeObject*)py->array_type)) {
+        PyObject*typecode = PyObject_GetAttrString(o, "typecode");
+        const char*c = typecode ? PyString_AsString(typecode) : NULL;
+        const void*data;
+        Py_ssize_t size;
+        value_t*v = NULL;
+        if(c && (*c == 'i' || *c == 'f') && !PyObject_AsReadBuffer(o, &data, &size)) {
+            v = *c == 'i' ? value_new_int32_array(data, size / sizeof(int32_t)) :
+                            value_new_float32_array(data, size / sizeof(float));
+        } else {
+            PyErr_Clear();
+            language_error(li, "Can't convert array of type %s", c ? c : "?");
+        }
+        Py_XDECREF(typecode);
+        return v;
     } else if(PyList_Check(o)) {
         int i;
         int l = PyList_GET_SIZE(o);
@@ -52,7 +82,7 @@ static value_t* pyobject_to_value(language_t*li, PyObject*o)
             PyObject*e = PyList_GetItem(o, i);
             if(e == NULL)
                 return NULL;
-            array_append(array, pyobject_to_value(li, e));
+            array_append_take(array, pyobject_to_value(li, e));
         }
         return array;
     } else if(PyTuple_Check(o)) {
@@ -63,7 +93,7 @@ static value_t* pyobject_to_value(language_t*li, PyObject*o)
             PyObject*e = PyTuple_GetItem(o, i);
             if(e == NULL)
                 return NULL;
-            array_append(array, pyobject_to_value(li, e));
+            array_append_take(array, pyobject_to_value(li, e));
         }
         return array;
     } else {
@@ -96,7 +126,8 @@ static PyObject* value_to_pyobject(language_t*li, value_t*value, bool arrays_as_
                 PyObject *array = PyTuple_New(value->length);
                 int i;
                 for(i=0;i<value->length;i++) {
-                    PyObject*entry = value_to_pyobject(li, value->data[i], false);
+                    value_t tmp;
+                    PyObject*entry = value_to_pyobject(li, array_get(value, i, &tmp), false);
                     if(!entry)
                         return NULL;
                     PyTuple_SetItem(array, i, entry);
@@ -106,7 +137,8 @@ static PyObject* value_to_pyobject(language_t*li, value_t*value, bool arrays_as_
                 PyObject *array = PyList_New(value->length);
                 int i;
                 for(i=0;i<value->length;i++) {
-                    PyObject*entry = value_to_pyobject(li, value->data[i], false);
+                    value_t tmp;
+                    PyObject*entry = value_to_pyobject(li, array_get(value, i, &tmp), false);
                     if(!entry)
                         return NULL;
                     PyList_SetItem(array, i, entry);
@@ -115,6 +147,24 @@ static PyObject* value_to_pyobject(language_t*li, value_t*value, bool arrays_as_
             }
         }
         break;
+        case TYPE_INT32_ARRAY:
+        case TYPE_FLOAT32_ARRAY: {
+            py_internal_t*py = (py_internal_t*)li->internal;
+            bool is_int = value->type == TYPE_INT32_ARRAY;
+            if(py->array_type && !arrays_as_tuples) {
+                /* array.array() copies the block in one go */
+                return PyObject_CallFunction(py->array_type, "ss#", is_int ? "i" : "f",
+                                             (char*)value->i32s, (int)(sizeof(int32_t) * value->length));
+            }
+            PyObject *array = PyTuple_New(value->length);
+            int i;
+            for(i=0;i<value->length;i++) {
+                PyTuple_SET_ITEM(array, i, is_int ? PyInt_FromLong(value->i32s[i]) :
+                                                    PyFloat_FromDouble(value->f32s[i]));
+            }
+            return array;
+        }
+        break;
         default: {
             return NULL;
         }
@@ -185,10 +235,52 @@ static void handle_exception(language_t*li)
     Py_DECREF(_tb);
 }
 
+/* Runs from the eval loop. As long as we're interrupted, we keep raising
+   KeyboardInterrupt, so a bare except: in the guest doesn't get far. */
+static int raise_interrupt(void*data)
+{
+    py_internal_t*py = (py_internal_t*)data;
+    if(!py->interrupted)
+        return 0;
+    Py_AddPendingCall(raise_interrupt, py);
+    PyErr_SetNone(PyExc_KeyboardInterrupt);
+    return -1;
+}
+
+/* Python's own signal handlers use Py_AddPendingCall(), too */
+static void interrupt_py(language_t*li)
+{
+    py_internal_t*py = (py_internal_t*)li->internal;
+    py->interrupted = 1;
+    Py_AddPendingCall(raise_interrupt, py);
+}
+
+/* A trace function sees every line, and every call. Once the budget is
+   gone, each of them raises again, like raise_interrupt() does. */
+static int budget_trace(PyObject*capsule, PyFrameObject*frame, int what, PyObject*arg)
+{
+    if(what != PyTrace_LINE && what != PyTrace_CALL)
+        return 0;
+    py_internal_t*py = (py_internal_t*)PyCapsule_GetPointer(capsule, NULL);
+    if(py->li->budget_left > 0) {
+        py->li->budget_left--;
+        return 0;
+    }
+    PyErr_SetString(PyExc_RuntimeError, "Out of budget");
+    return -1;
+}
+
+static void set_budget_py(language_t*li, int64_t max_ops)
+{
+    py_internal_t*py = (py_internal_t*)li->internal;
+    py->budget = max_ops > 0 ? max_ops : 0;
+}
+
 static bool compile_script_py(language_t*li, const char*script)
 {
     py_internal_t*py = (py_internal_t*)li->internal;
     log_dbg("[python] compiling script");
+    py->interrupted = 0;
 
     // test memory allocation
     PyObject* tmp = PyString_FromString("test");
@@ -223,6 +315,7 @@ static value_t* call_function_py(language_t*li, const char*name, value_t*_args)
 {
     py_internal_t*py = (py_internal_t*)li->internal;
     log_dbg("[python] calling function %s", name);
+    py->interrupted = 0;
 
     PyObject*function = PyDict_GetItemString(py->globals, name);
     if(function == NULL) {
@@ -241,12 +334,22 @@ static value_t* call_function_py(language_t*li, const char*name, value_t*_args)
         return NULL;
     }
 
+    /* only timed for latency profiles */
+    int64_t start = config_profile ? monotonic_nsec() : 0;
     PyObject*args = value_to_pyobject(li, _args, true);
     if(!args)
         return NULL;
+    li->convert_nsec = config_profile ? monotonic_nsec() - start : 0;
     PyObject*kwargs = PyDict_New();
+    li->budget_left = py->budget;
+    if(py->budget) {
+        PyEval_SetTrace(budget_trace, py->capsule);
+    }
     //PyObject*ret = PyObject_Call(function, args, kwargs);
     PyObject*ret = PyObject_CallObject(function, args);
+    if(py->budget) {
+        PyEval_SetTrace(NULL, NULL);
+    }
     Py_DECREF(kwargs);
     Py_DECREF(args);
 
@@ -256,7 +359,12 @@ static value_t* call_function_py(language_t*li, const char*name, value_t*_args)
         PyErr_Clear();
         return NULL;
     } else {
-        return pyobject_to_value(li, ret);
+        start = config_profile ? monotonic_nsec() : 0;
+        value_t*value = pyobject_to_value(li, ret);
+        if(config_profile) {
+            li->convert_nsec += monotonic_nsec() - start;
+        }
+        return value;
     }
 }
 
@@ -336,6 +444,7 @@ static bool initialize_py(language_t*li, size_t mem_size)
 
     py->globals = PyDict_New();
     py->buffer = malloc(65536);
+    py->capsule = PyCapsule_New(py, NULL, NULL);
 
     py->module = PyImport_AddModule("__main__");
     PyObject* globals = PyModule_GetDict(py->module);
@@ -346,6 +455,16 @@ static bool initialize_py(language_t*li, size_t mem_size)
     
     PyDict_SetItem(py->globals, PyString_FromString("math"), PyImport_ImportModule("math"));
 
+    /* packed arrays become array.array objects. Import it now, while we
+       can still load extension modules. */
+    PyObject*array_module = PyImport_ImportModule("array");
+    if(array_module) {
+        py->array_type = PyObject_GetAttrString(array_module, "array");
+        Py_DECREF(array_module);
+    } else {
+        PyErr_Clear();
+    }
+
     /* compile an empty script so Python has a chance to load all the things
        it needs for compiling (encodingsmodule etc.) */
     PyRun_String("None", Py_file_input, py->globals, NULL);
@@ -358,6 +477,8 @@ static void destroy_py(language_t* li)
     if(li->internal) {
         py_internal_t*py = (py_internal_t*)li->internal;
         free(py->buffer);
+        Py_DECREF(py->capsule);
+        Py_XDECREF(py->array_type);
         free(py);
         if(--py_reference_count==0) {
             Py_Finalize();
@@ -376,6 +497,9 @@ language_t* python_interpreter_new()
     li->call_function = call_function_py;
     li->define_constant = define_constant_py;
     li->define_function = define_function_py;
+    li->interrupt = interrupt_py;
+    li->interrupt_signal_safe = true;
+    li->set_budget = set_budget_py;
     li->destroy = destroy_py;
     return li;
 }
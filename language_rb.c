@@ -1,18 +1,26 @@
 #include <ruby.h>
+#include <rubysig.h>
 #include <stdbool.h>
 #include <string.h>
+#include <signal.h>
 #include "language.h"
+#include "settings.h"
 #include "dict.h"
 
 typedef struct _rb_internal {
     language_t*li;
     VALUE object;
     dict_t*functions;
+    int64_t budget;
 } rb_internal_t;
 
 static rb_internal_t*global;
 static int rb_reference_count = 0;
 
+/* The handler ruby_init() installed for SIGINT, if any. It only notes the
+   signal; Ruby raises Interrupt at the next safe point. */
+static void (*ruby_sigint)(int);
+
 static bool initialize_rb(language_t*li, size_t mem_size)
 {
     if(li->internal)
@@ -27,6 +35,12 @@ static bool initialize_rb(language_t*li, size_t mem_size)
     if(rb_reference_count==0) {
         ruby_init();
         global = rb;
+
+        struct sigaction sa;
+        if(!sigaction(SIGINT, NULL, &sa) && !(sa.sa_flags & SA_SIGINFO) &&
+           sa.sa_handler != SIG_DFL && sa.sa_handler != SIG_IGN) {
+            ruby_sigint = sa.sa_handler;
+        }
     }
     rb_reference_count++;
 
@@ -70,7 +84,7 @@ static value_t* ruby_to_value(VALUE v)
       int i;
       for(i=0;i<len;i++) {
           volatile VALUE item = RARRAY(v)->ptr[i];
-          array_append(array, ruby_to_value(item));
+          array_append_take(array, ruby_to_value(item));
       }
       return array;
     }
@@ -107,7 +121,26 @@ static VALUE value_to_ruby(value_t*v)
             volatile VALUE a = rb_ary_new2(v->length);
             int i;
             for(i=0;i<v->length;i++) {
-                rb_ary_store(a, i, value_to_ruby(v->data[i]));
+                value_t tmp;
+                rb_ary_store(a, i, value_to_ruby(array_get(v, i, &tmp)));
+            }
+            return a;
+        }
+        break;
+        case TYPE_INT32_ARRAY: {
+            volatile VALUE a = rb_ary_new2(v->length);
+            int i;
+            for(i=0;i<v->length;i++) {
+                rb_ary_store(a, i, INT2FIX(v->i32s[i]));
+            }
+            return a;
+        }
+        break;
+        case TYPE_FLOAT32_ARRAY: {
+            volatile VALUE a = rb_ary_new2(v->length);
+            int i;
+            for(i=0;i<v->length;i++) {
+                rb_ary_store(a, i, rb_float_new(v->f32s[i]));
             }
             return a;
         }
@@ -142,9 +175,20 @@ static VALUE compile_script_exception(VALUE _dfunc, VALUE exc)
     return Qfalse;
 }
 
+/* Does what ^C would. Unless the guest trapped SIGINT, that raises
+   Interrupt, which isn't a StandardError, so it only ends up in our own
+   rescue. */
+static void interrupt_rb(language_t*li)
+{
+    if(ruby_sigint) {
+        ruby_sigint(SIGINT);
+    }
+}
+
 static bool compile_script_rb(language_t*li, const char*script)
 {
     log_dbg("[ruby] compile_script");
+    rb_trap_pending = 0;
     ruby_dfunc_t dfunc;
     dfunc.li = li;
     dfunc.script = script;
@@ -214,6 +258,31 @@ static bool is_function_rb(language_t*li, const char*name)
     return rb_respond_to(rb->object, id);
 }
 
+/* the interpreter whose call is counted by budget_hook() */
+static rb_internal_t*budgeted;
+
+/* we're raising "Out of budget", which calls C methods, too */
+static bool raising;
+
+/* Called for every line, and every method call. Once the budget is gone,
+   each of them raises again, so a rescue in the guest doesn't get far.
+   Loops with an empty body don't produce any events; for those, there's
+   still the time limit. */
+static void budget_hook(rb_event_t event, NODE*node, VALUE self, ID mid, VALUE klass)
+{
+    if(event != RUBY_EVENT_C_CALL)
+        raising = false;
+    if(raising)
+        return;
+    language_t*li = budgeted->li;
+    if(li->budget_left > 0) {
+        li->budget_left--;
+        return;
+    }
+    raising = true;
+    rb_raise(rb_eRuntimeError, "Out of budget");
+}
+
 typedef struct _ruby_fcall {
     language_t*li;
     const char*function_name;
@@ -231,22 +300,44 @@ static VALUE call_function_internal(VALUE _fcall)
     int num_args = fcall->args->length;
     volatile ID fname = rb_intern(fcall->function_name);
 
+    /* only timed for latency profiles */
+    int64_t start = config_profile ? monotonic_nsec() : 0;
     volatile VALUE*args = alloca(sizeof(VALUE)*num_args);
     int i;
     for(i=0;i<num_args;i++) {
-        args[i] = value_to_ruby(fcall->args->data[i]);
+        value_t tmp;
+        args[i] = value_to_ruby(array_get(fcall->args, i, &tmp));
     }
-    
+    li->convert_nsec = config_profile ? monotonic_nsec() - start : 0;
+
     volatile VALUE ret = rb_funcall2(rb->object, fname, num_args, (VALUE*)args);
     return ret;
 }
+
+static void disarm_budget()
+{
+    if(budgeted) {
+        rb_remove_event_hook(budget_hook);
+        budgeted = NULL;
+    }
+}
+
 static VALUE call_function_exception(VALUE _fcall, VALUE exc)
 {
     log_dbg("[rb] call_function_exception");
+    /* reporting the error calls methods, too */
+    disarm_budget();
     ruby_fcall_t*fcall = (ruby_fcall_t*)_fcall;
     rb_report_error(exc);
     fcall->fail = true;
 }
+
+static void set_budget_rb(language_t*li, int64_t max_ops)
+{
+    rb_internal_t*rb = (rb_internal_t*)li->internal;
+    rb->budget = max_ops > 0 ? max_ops : 0;
+}
+
 static value_t* call_function_rb(language_t*li, const char*name, value_t*args)
 {
     log_dbg("[ruby] calling function %s", name);
@@ -256,12 +347,27 @@ static value_t* call_function_rb(language_t*li, const char*name, value_t*args)
     fcall.args = args;
     fcall.function_name = name;
 
-    volatile VALUE ret = rb_rescue(call_function_internal, (VALUE)&fcall, call_function_exception, (VALUE)&fcall);
+    /* forget about an interrupt that came in after the last call */
+    rb_trap_pending = 0;
+    rb_internal_t*rb = (rb_internal_t*)li->internal;
+    li->budget_left = rb->budget;
+    if(rb->budget) {
+        budgeted = rb;
+        raising = false;
+        rb_add_event_hook(budget_hook, RUBY_EVENT_LINE | RUBY_EVENT_CALL | RUBY_EVENT_C_CALL);
+    }
+    volatile VALUE ret = rb_rescue2(call_function_internal, (VALUE)&fcall, call_function_exception, (VALUE)&fcall, rb_eException, (VALUE)0);
+    disarm_budget();
 
     if(fcall.fail) {
         return NULL;
     } else {
-        return ruby_to_value(ret);
+        int64_t start = config_profile ? monotonic_nsec() : 0;
+        value_t*value = ruby_to_value(ret);
+        if(config_profile) {
+            li->convert_nsec += monotonic_nsec() - start;
+        }
+        return value;
     }
 }
 
@@ -287,6 +393,9 @@ language_t* ruby_interpreter_new()
     li->define_constant = define_constant_rb;
     li->define_function = define_function_rb;
     li->call_function = call_function_rb;
+    li->interrupt = interrupt_rb;
+    li->interrupt_signal_safe = true;
+    li->set_budget = set_budget_rb;
     li->destroy = destroy_rb;
     return li;
 }
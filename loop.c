@@ -0,0 +1,207 @@
+/* loop.c
+   epoll based event loop for driving many sandboxes from one thread
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include "util.h"
+#include "loop.h"
+#include "timer.h"
+
+#define MAX_EVENTS 256
+
+typedef struct _watch {
+    int fd;
+    loop_handler_t handler;
+    void*data;
+    uint32_t events;
+    wheel_timer_t deadline;
+} watch_t;
+
+struct _sandbox_loop {
+    int epoll_fd;
+
+    /* indexed by file descriptor. Watches are allocated one by one, so
+       that growing the table doesn't move their timers. */
+    watch_t**watches;
+    int size;
+
+    /* the deadlines of all watches */
+    timer_wheel_t*timers;
+
+    int pending;
+};
+
+static int64_t now_ms()
+{
+    return monotonic_usec() / 1000;
+}
+
+sandbox_loop_t* sandbox_loop_new()
+{
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(epoll_fd < 0) {
+        perror("epoll_create");
+        return NULL;
+    }
+    sandbox_loop_t*loop = calloc(1, sizeof(sandbox_loop_t));
+    loop->epoll_fd = epoll_fd;
+    loop->timers = timer_wheel_new(now_ms());
+    return loop;
+}
+
+static watch_t* get_watch(sandbox_loop_t*loop, int fd)
+{
+    if(fd < 0 || fd >= loop->size)
+        return NULL;
+    return loop->watches[fd];
+}
+
+bool sandbox_loop_watch(sandbox_loop_t*loop, int fd, uint32_t events, loop_handler_t handler, void*data)
+{
+    if(fd < 0)
+        return false;
+    if(fd >= loop->size) {
+        int size = loop->size ? loop->size : 64;
+        while(size <= fd) {
+            size <<= 1;
+        }
+        watch_t**watches = realloc(loop->watches, size * sizeof(watch_t*));
+        if(!watches)
+            return false;
+        memset(watches + loop->size, 0, (size - loop->size) * sizeof(watch_t*));
+        loop->watches = watches;
+        loop->size = size;
+    }
+
+    watch_t*w = loop->watches[fd];
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    if(epoll_ctl(loop->epoll_fd, w ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return false;
+    }
+    if(!w) {
+        w = loop->watches[fd] = calloc(1, sizeof(watch_t));
+        w->fd = fd;
+    }
+    w->handler = handler;
+    w->data = data;
+    w->events = events;
+    return true;
+}
+
+void sandbox_loop_unwatch(sandbox_loop_t*loop, int fd)
+{
+    watch_t*w = get_watch(loop, fd);
+    if(!w)
+        return;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    timer_del(loop->timers, &w->deadline);
+    loop->watches[fd] = NULL;
+    free(w);
+}
+
+static void deadline_expired(wheel_timer_t*t, void*data)
+{
+    watch_t*w = (watch_t*)data;
+    /* the handler might unwatch (and free) w */
+    w->handler(w->data, w->fd, 0);
+}
+
+void sandbox_loop_set_deadline(sandbox_loop_t*loop, int fd, int64_t deadline)
+{
+    watch_t*w = get_watch(loop, fd);
+    if(!w)
+        return;
+    if(!deadline) {
+        timer_del(loop->timers, &w->deadline);
+        return;
+    }
+    /* round up, so we never fire early */
+    timer_add(loop->timers, &w->deadline, (deadline + 999) / 1000, deadline_expired, w);
+}
+
+void sandbox_loop_hold(sandbox_loop_t*loop)
+{
+    loop->pending++;
+}
+
+void sandbox_loop_release(sandbox_loop_t*loop)
+{
+    loop->pending--;
+}
+
+int sandbox_loop_run_once(sandbox_loop_t*loop, int timeout_ms)
+{
+    int64_t next = timer_wheel_next(loop->timers);
+    if(next >= 0) {
+        int64_t left = next - now_ms();
+        int ms = left > 0 ? left : 0;
+        if(timeout_ms < 0 || ms < timeout_ms)
+            timeout_ms = ms;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int num = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout_ms);
+    if(num < 0) {
+        if(errno == EINTR)
+            return 0;
+        perror("epoll_wait");
+        return -1;
+    }
+
+    int called = 0;
+    int i;
+    for(i=0;i<num;i++) {
+        /* an earlier handler might have unwatched this one */
+        watch_t*w = get_watch(loop, events[i].data.fd);
+        if(w) {
+            w->handler(w->data, events[i].data.fd, events[i].events);
+            called++;
+        }
+    }
+
+    called += timer_wheel_advance(loop->timers, now_ms());
+    return called;
+}
+
+bool sandbox_loop_run(sandbox_loop_t*loop)
+{
+    while(loop->pending > 0) {
+        if(sandbox_loop_run_once(loop, -1) < 0)
+            return false;
+    }
+    return true;
+}
+
+void sandbox_loop_destroy(sandbox_loop_t*loop)
+{
+    close(loop->epoll_fd);
+    int fd;
+    for(fd=0;fd<loop->size;fd++) {
+        free(loop->watches[fd]);
+    }
+    free(loop->watches);
+    timer_wheel_destroy(loop->timers);
+    free(loop);
+}
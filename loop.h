@@ -0,0 +1,65 @@
+/* loop.h
+   epoll based event loop for driving many sandboxes from one thread
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#ifndef __loop_h__
+#define __loop_h__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _sandbox_loop sandbox_loop_t;
+
+/* Called with the epoll events that occurred on fd, or with events = 0 if
+   the deadline for fd passed. */
+typedef void (*loop_handler_t)(void*data, int fd, uint32_t events);
+
+/* A loop, and everything registered with it, belongs to the thread that
+   runs it. Use one loop per thread to spread sandboxes over several. */
+sandbox_loop_t* sandbox_loop_new();
+
+/* Start watching fd for events (EPOLLIN, EPOLLOUT), or change the events
+   we're watching it for. */
+bool sandbox_loop_watch(sandbox_loop_t*loop, int fd, uint32_t events, loop_handler_t handler, void*data);
+void sandbox_loop_unwatch(sandbox_loop_t*loop, int fd);
+
+/* Call fd's handler (with events = 0) once monotonic_usec() passes
+   deadline. 0 = no deadline. Deadlines have millisecond resolution, and
+   live in a timer wheel, so thousands of them cost next to nothing. */
+void sandbox_loop_set_deadline(sandbox_loop_t*loop, int fd, int64_t deadline);
+
+/* Work that's in progress (e.g. calls waiting for a result). The loop
+   runs until there's none left. */
+void sandbox_loop_hold(sandbox_loop_t*loop);
+void sandbox_loop_release(sandbox_loop_t*loop);
+
+/* Wait up to timeout_ms (-1 = forever) for events, and dispatch them.
+   Returns the number of handlers called, or -1. */
+int sandbox_loop_run_once(sandbox_loop_t*loop, int timeout_ms);
+bool sandbox_loop_run(sandbox_loop_t*loop);
+
+/* Sandboxes attached to the loop have to be destroyed first */
+void sandbox_loop_destroy(sandbox_loop_t*loop);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,96 @@
+/* perf.c
+   per-process CPU counters
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perf.h"
+
+/* The counters are sampling events, so that a limit can be set with
+   PERF_EVENT_IOC_PERIOD later on. Without one, the period is too long
+   to ever run out. */
+#define NO_LIMIT (1ll << 62)
+
+static int open_counter(pid_t pid, uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.sample_period = NO_LIMIT;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+perf_counter_t* perf_counter_new(pid_t pid)
+{
+    const char*unit = "instructions";
+    int fd = open_counter(pid, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    if(fd < 0) {
+        unit = "nsec";
+        fd = open_counter(pid, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK);
+    }
+    if(fd < 0) {
+        return NULL;
+    }
+    perf_counter_t*c = calloc(1, sizeof(perf_counter_t));
+    c->fd = fd;
+    c->pid = pid;
+    c->unit = unit;
+    return c;
+}
+
+void perf_counter_destroy(perf_counter_t*c)
+{
+    close(c->fd);
+    free(c);
+}
+
+int64_t perf_counter_read(perf_counter_t*c)
+{
+    uint64_t count = 0;
+    if(read(c->fd, &count, sizeof(count)) != sizeof(count)) {
+        return -1;
+    }
+    return count;
+}
+
+bool perf_counter_set_limit(perf_counter_t*c, int64_t max, int sig)
+{
+    if(max > 0 && c->sig != sig) {
+        /* on overflow, the kernel signals whoever owns the fd */
+        struct f_owner_ex owner;
+        owner.type = F_OWNER_PID;
+        owner.pid = c->pid;
+        if(fcntl(c->fd, F_SETOWN_EX, &owner) ||
+           fcntl(c->fd, F_SETSIG, sig) ||
+           fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_ASYNC)) {
+            return false;
+        }
+        c->sig = sig;
+    }
+    /* this also restarts the count towards the next overflow */
+    uint64_t period = max > 0 ? max : NO_LIMIT;
+    return !ioctl(c->fd, PERF_EVENT_IOC_PERIOD, &period);
+}
@@ -0,0 +1,56 @@
+/* perf.h
+   per-process CPU counters
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#ifndef __perf_h__
+#define __perf_h__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Counts the instructions another process retires in user space, or,
+   where there are no hardware counters (e.g. in most VMs), the CPU time
+   it uses, in nanoseconds. Either way, time the process spends waiting
+   isn't counted, so the numbers don't depend on how busy the machine
+   is. */
+typedef struct _perf_counter {
+    int fd;
+    pid_t pid;
+    const char*unit;    /* "instructions" or "nsec" */
+    int sig;            /* what we send on overflow, once set up */
+} perf_counter_t;
+
+/* NULL if the kernel won't let us count pid (see perf_event_paranoid) */
+perf_counter_t* perf_counter_new(pid_t pid);
+void perf_counter_destroy(perf_counter_t*c);
+
+/* Total count since perf_counter_new(), or -1 */
+int64_t perf_counter_read(perf_counter_t*c);
+
+/* Send sig to the process once it used up another max (counting from
+   now). Replaces any limit set before; max=0 removes it. */
+bool perf_counter_set_limit(perf_counter_t*c, int64_t max, int sig);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,165 @@
+/* pool.c
+   Pools of pre-spawned sandboxes
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "language.h"
+#include "pool.h"
+
+struct _pool {
+    char*language;
+    spawn_func_t spawn;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool stop;
+
+    /* a stack, so that handing out a sandbox is O(1) */
+    language_t**ready;
+    int num;
+    int size;
+
+    int hits;
+    int misses;
+    int refills;
+    int refill_failures;
+    int64_t refill_usec_total;
+    int refill_usec_last;
+    int refill_usec_max;
+};
+
+/* give up refilling after this many spawns in a row failed */
+#define MAX_REFILL_FAILURES 3
+
+static void* refill_thread(void*data)
+{
+    pool_t*pool = (pool_t*)data;
+
+    pthread_mutex_lock(&pool->mutex);
+    while(!pool->stop) {
+        if(pool->num >= pool->size || pool->refill_failures >= MAX_REFILL_FAILURES) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        int64_t start = monotonic_usec();
+        language_t*li = pool->spawn(pool->language);
+        int usec = monotonic_usec() - start;
+
+        pthread_mutex_lock(&pool->mutex);
+        if(!li) {
+            pool->refill_failures++;
+            continue;
+        }
+        pool->refill_failures = 0;
+        pool->refills++;
+        pool->refill_usec_last = usec;
+        pool->refill_usec_total += usec;
+        if(usec > pool->refill_usec_max)
+            pool->refill_usec_max = usec;
+
+        if(pool->stop || pool->num >= pool->size) {
+            pthread_mutex_unlock(&pool->mutex);
+            li->destroy(li);
+            pthread_mutex_lock(&pool->mutex);
+            continue;
+        }
+        pool->ready[pool->num++] = li;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+pool_t* pool_new(const char*language, int size, spawn_func_t spawn)
+{
+    pool_t*pool = calloc(1, sizeof(pool_t));
+    pool->language = strdup(language);
+    pool->spawn = spawn;
+    pool->size = size > 0 ? size : 1;
+    pool->ready = calloc(pool->size, sizeof(language_t*));
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    if(pthread_create(&pool->thread, NULL, refill_thread, pool)) {
+        fprintf(stderr, "Couldn't start refill thread for %s pool\n", language);
+        pthread_cond_destroy(&pool->cond);
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool->ready);
+        free(pool->language);
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+language_t* pool_take(pool_t*pool)
+{
+    language_t*li = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    if(pool->num) {
+        li = pool->ready[--pool->num];
+        pool->hits++;
+    } else {
+        pool->misses++;
+    }
+    /* if spawning failed before, try again */
+    pool->refill_failures = 0;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    if(!li) {
+        li = pool->spawn(pool->language);
+    }
+    return li;
+}
+
+void pool_get_stats(pool_t*pool, pool_stats_t*stats)
+{
+    pthread_mutex_lock(&pool->mutex);
+    stats->size = pool->num;
+    stats->capacity = pool->size;
+    stats->hits = pool->hits;
+    stats->misses = pool->misses;
+    stats->refills = pool->refills;
+    stats->refill_usec_last = pool->refill_usec_last;
+    stats->refill_usec_avg = pool->refills ? pool->refill_usec_total / pool->refills : 0;
+    stats->refill_usec_max = pool->refill_usec_max;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void pool_destroy(pool_t*pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = true;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    pthread_join(pool->thread, NULL);
+
+    int i;
+    for(i=0;i<pool->num;i++) {
+        pool->ready[i]->destroy(pool->ready[i]);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->ready);
+    free(pool->language);
+    free(pool);
+}
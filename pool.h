@@ -0,0 +1,61 @@
+/* pool.h
+   Pools of pre-spawned sandboxes
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#ifndef __pool_h__
+#define __pool_h__
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct _language;
+
+typedef struct _pool pool_t;
+
+typedef struct _pool_stats {
+    int size;           /* sandboxes ready to be handed out */
+    int capacity;
+    int hits;           /* requests served from the pool */
+    int misses;         /* requests that had to spawn a sandbox themselves */
+    int refills;
+    int refill_usec_last;
+    int refill_usec_avg;
+    int refill_usec_max;
+} pool_stats_t;
+
+/* Returns a new, fully initialized sandbox for the given language, or NULL */
+typedef struct _language* (*spawn_func_t)(const char*language);
+
+/* Create a pool that keeps up to size sandboxes ready. A background thread
+   spawns them, and replaces every sandbox that's taken out. */
+pool_t* pool_new(const char*language, int size, spawn_func_t spawn);
+
+/* Hand out a sandbox. If none is ready, spawns one right away. */
+struct _language* pool_take(pool_t*pool);
+
+void pool_get_stats(pool_t*pool, pool_stats_t*stats);
+
+/* Stop the refill thread and kill all sandboxes still in the pool */
+void pool_destroy(pool_t*pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,256 @@
+/* ring.c
+   Single-producer/single-consumer byte rings in shared memory
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "util.h"
+#include "ring.h"
+
+/* how often to poll the ring before going to sleep in the kernel. We only
+   spin on SMP machines: on a single CPU, the other side can't make progress
+   while we're spinning. */
+#define SPIN_COUNT 2000
+
+#define CACHE_LINE 64
+
+/* how often (usec) to check the watched descriptor while waiting without
+   a deadline (see ring_watch_fd()) */
+#define WATCH_INTERVAL 1000000
+
+/* The part of a ring that lives in shared memory. The other side can
+   scribble over all of it, so nothing in here is trusted: sizes come from
+   our own ring_t, and positions are checked against them before use. */
+typedef struct _ring_shared {
+    /* written by the producer */
+    volatile uint32_t head;
+    volatile int32_t data_seq;
+    volatile int32_t writer_waiting;
+    char pad1[CACHE_LINE - 12];
+
+    /* written by the consumer */
+    volatile uint32_t tail;
+    volatile int32_t space_seq;
+    volatile int32_t reader_waiting;
+    char pad2[CACHE_LINE - 12];
+
+    char data[0];
+} ring_shared_t;
+
+struct _ring {
+    ring_shared_t*shared;
+    uint32_t capacity;
+    int32_t spin_count;
+    int watch_fd;
+};
+
+ring_t* ring_new(void*mem, int size, bool init)
+{
+    if(size < (int)sizeof(ring_shared_t) + CACHE_LINE)
+        return NULL;
+
+    /* capacity is a power of two, so we can wrap positions with a mask.
+       Both sides derive it from the size of the mapping. */
+    uint32_t capacity = CACHE_LINE;
+    while(capacity * 2 <= size - sizeof(ring_shared_t)) {
+        capacity *= 2;
+    }
+
+    ring_t*r = malloc(sizeof(ring_t));
+    r->shared = (ring_shared_t*)mem;
+    r->capacity = capacity;
+    r->spin_count = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_COUNT : 0;
+    r->watch_fd = -1;
+    if(init) {
+        memset(r->shared, 0, sizeof(ring_shared_t));
+    }
+    return r;
+}
+
+void ring_free(ring_t*r)
+{
+    free(r);
+}
+
+void ring_watch_fd(ring_t*r, int fd)
+{
+    r->watch_fd = fd;
+}
+
+/* poll() isn't allowed in the sandbox, but read() is: nothing is ever
+   written to the watched pipe, so reading it fails with EAGAIN until the
+   other end is closed, and then returns 0 (EOF) */
+static bool hung_up(int fd)
+{
+    char c;
+    ssize_t ret = read(fd, &c, 1);
+    return ret == 0 || (ret < 0 && errno != EAGAIN && errno != EINTR);
+}
+
+static void futex_wake(volatile int32_t*addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* Sleep until *seq changes from the value it had when we last looked at
+   the ring, or the deadline passes. Returns false on timeout, or if the
+   watched descriptor was hung up. */
+static bool futex_wait(ring_t*r, volatile int32_t*seq, int32_t seen, int64_t deadline)
+{
+    struct timespec ts, *tsp = NULL;
+    int64_t left = 0;
+    if(deadline) {
+        left = deadline - monotonic_usec();
+        if(left <= 0)
+            return false;
+    }
+    if(r->watch_fd >= 0 && (!left || left > WATCH_INTERVAL)) {
+        left = WATCH_INTERVAL;
+    }
+    if(left) {
+        ts.tv_sec = left / 1000000;
+        ts.tv_nsec = (left % 1000000) * 1000;
+        tsp = &ts;
+    }
+    if(syscall(SYS_futex, seq, FUTEX_WAIT, seen, tsp, NULL, 0) < 0 &&
+       errno == ETIMEDOUT && r->watch_fd >= 0 && hung_up(r->watch_fd)) {
+        return false;
+    }
+    return true;
+}
+
+int ring_write_some(ring_t*r, const void*data, int len)
+{
+    ring_shared_t*s = r->shared;
+    uint32_t head = s->head;
+    uint32_t used = head - s->tail;
+    if(used > r->capacity)
+        return -1;
+    uint32_t space = r->capacity - used;
+    if(!space || len <= 0)
+        return 0;
+
+    uint32_t n = space < (uint32_t)len ? space : (uint32_t)len;
+    uint32_t pos = head & (r->capacity - 1);
+    uint32_t first = r->capacity - pos;
+    if(first > n)
+        first = n;
+    memcpy(s->data + pos, data, first);
+    memcpy(s->data, (const char*)data + first, n - first);
+
+    __sync_synchronize();
+    s->head = head + n;
+    __sync_fetch_and_add(&s->data_seq, 1);
+    if(s->reader_waiting) {
+        futex_wake(&s->data_seq);
+    }
+    return n;
+}
+
+bool ring_readable(ring_t*r)
+{
+    __sync_synchronize();
+    return r->shared->head != r->shared->tail;
+}
+
+bool ring_write(ring_t*r, const void*_data, int len, int64_t deadline)
+{
+    ring_shared_t*s = r->shared;
+    const char*data = _data;
+
+    int spin = 0;
+    while(len > 0) {
+        int32_t seen = s->space_seq;
+        __sync_synchronize();
+        uint32_t head = s->head;
+        if(head - s->tail == r->capacity) {
+            if(spin++ < r->spin_count)
+                continue;
+            s->writer_waiting = 1;
+            __sync_synchronize();
+            if(head - s->tail == r->capacity) {
+                if(!futex_wait(r, &s->space_seq, seen, deadline)) {
+                    s->writer_waiting = 0;
+                    return false;
+                }
+            }
+            s->writer_waiting = 0;
+            continue;
+        }
+        spin = 0;
+
+        int n = ring_write_some(r, data, len);
+        if(n < 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool ring_read(ring_t*r, void*_data, int len, int64_t deadline)
+{
+    ring_shared_t*s = r->shared;
+    char*data = _data;
+
+    int spin = 0;
+    while(len > 0) {
+        int32_t seen = s->data_seq;
+        __sync_synchronize();
+        uint32_t tail = s->tail;
+        uint32_t available = s->head - tail;
+        if(available > r->capacity)
+            return false;
+        if(!available) {
+            if(spin++ < r->spin_count)
+                continue;
+            s->reader_waiting = 1;
+            __sync_synchronize();
+            if(s->head == tail) {
+                if(!futex_wait(r, &s->data_seq, seen, deadline)) {
+                    s->reader_waiting = 0;
+                    return false;
+                }
+            }
+            s->reader_waiting = 0;
+            continue;
+        }
+        spin = 0;
+        __sync_synchronize();
+
+        uint32_t n = available < (uint32_t)len ? available : (uint32_t)len;
+        uint32_t pos = tail & (r->capacity - 1);
+        uint32_t first = r->capacity - pos;
+        if(first > n)
+            first = n;
+        memcpy(data, s->data + pos, first);
+        memcpy(data + first, s->data, n - first);
+
+        __sync_synchronize();
+        s->tail = tail + n;
+        __sync_fetch_and_add(&s->space_seq, 1);
+        if(s->writer_waiting) {
+            futex_wake(&s->space_seq);
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
@@ -0,0 +1,64 @@
+/* ring.h
+   Single-producer/single-consumer byte rings in shared memory
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#ifndef __ring_h__
+#define __ring_h__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _ring ring_t;
+
+/* Attach to a ring in (shared) memory of the given size, laying it out
+   first if init is set. The returned handle is private to the caller and
+   holds everything that mustn't be under the other side's control (the
+   capacity, and how long to spin); only the read and write positions live
+   in the shared memory. Returns NULL if the memory is too small to hold a
+   ring. */
+ring_t* ring_new(void*mem, int size, bool init);
+void ring_free(ring_t*r);
+
+/* There's no EOF on a ring. While waiting, also give up once fd (our end
+   of a pipe whose other end the other process holds) is hung up, i.e. the
+   other side went away. fd must be non-blocking, and nothing may be
+   written to it: it's checked by reading from it. */
+void ring_watch_fd(ring_t*r, int fd);
+
+/* Both functions block until all of the data has been transferred, or
+   monotonic_usec() passes deadline (0 = wait forever). The other side is
+   only woken up (through a futex) if it's actually sleeping. They also
+   fail if the positions in shared memory are impossible, i.e. the other
+   side corrupted them. */
+bool ring_write(ring_t*r, const void*data, int len, int64_t deadline);
+bool ring_read(ring_t*r, void*data, int len, int64_t deadline);
+
+/* Non-blocking versions: write as much as fits (returns the number of
+   bytes written, or -1 if the ring is corrupt), and check whether there's
+   anything to read. */
+int ring_write_some(ring_t*r, const void*data, int len);
+bool ring_readable(ring_t*r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -11,6 +11,7 @@
 #include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <linux/net.h>
 #include <asm/unistd_32.h>
 #define __USE_GNU
 #include <dlfcn.h>
@@ -88,7 +89,7 @@ static void direct_exit(int code)
 
 void stdout_printf(const char*format, ...)
 {
-    static char buffer[256];
+    char buffer[256];
     va_list arglist;
     va_start(arglist, format);
     int length = vsnprintf(buffer, sizeof(buffer), format, arglist);
@@ -128,7 +129,7 @@ static void _syscall_log_return_value(int edi, int esi, int edx, int ecx, int eb
             eax, eax, ebx, ecx, edx, esi, edi);
 }
 
-static bool refused[512];
+static __thread bool refused[512];
 static void _syscall_refuse(int edi, int esi, int edx, int ecx, int ebx, int eax) 
 {
     if(eax>=512 || eax<0) {
@@ -220,41 +221,37 @@ static void handle_signal(int signal, siginfo_t*siginfo, void*ucontext)
 static struct sigaction sig;
 #endif
 
-void seccomp_lockdown()
-{
-    setenv("MALLOC_CHECK_", "0", 1);
-
-#ifdef CATCH_SIGNALS
-    sig.sa_sigaction = handle_signal;
-    sig.sa_flags = SA_SIGINFO;
-    sigaction(11, &sig, NULL);
-    sigaction(6, &sig, NULL);
-#endif
-
-    struct rlimit rlimit;
-    rlimit.rlim_cur = rlimit.rlim_max = config_maxmem + MEM_PAD;
-    setrlimit(RLIMIT_DATA, &rlimit);
+/* offset k=0: syscall number
+          k=4: architecture
+          k=16: first argument (lower 32 bits)
+ */
+#define ALLOW_ANYARGS(syscall_nr) \
+        {code: BPF_LD+BPF_W+BPF_ABS,  jt: 0, jf: 0, k: 0}, \
+        {code: BPF_JMP+BPF_JEQ+BPF_K, jt: 0, jf: 1, k: syscall_nr}, \
+        {code: BPF_RET+BPF_K,         jt: 0, jf: 0, k: SECCOMP_RET_ALLOW}
 
-#ifdef HIJACK_SYSCALLS
-    errno_location = __errno_location();
-    hijack_linux_gate();
-#endif
+#define ALLOW_ARG0(syscall_nr, arg) \
+        {code: BPF_LD+BPF_W+BPF_ABS,  jt: 0, jf: 0, k: 0}, \
+        {code: BPF_JMP+BPF_JEQ+BPF_K, jt: 0, jf: 3, k: syscall_nr}, \
+        {code: BPF_LD+BPF_W+BPF_ABS,  jt: 0, jf: 0, k: 16}, \
+        {code: BPF_JMP+BPF_JEQ+BPF_K, jt: 0, jf: 1, k: arg}, \
+        {code: BPF_RET+BPF_K,         jt: 0, jf: 0, k: SECCOMP_RET_ALLOW}
 
-    /* offset k=0: syscall number
-              k=4: architecture 
-     */
-    struct sock_filter seccomp_filter[] = {
+static bool install_filter(bool template)
+{
+    struct sock_filter filter_start[] = {
         {code: BPF_LD+BPF_W+BPF_ABS,  jt: 0, jf: 0, k: 4},
         {code: BPF_JMP+BPF_JEQ+BPF_K, jt: 1, jf: 0, k: AUDIT_ARCH_I386},
         {code: BPF_RET+BPF_K,         jt: 0, jf: 0, k: SECCOMP_RET_KILL},
 
-#define ALLOW_ANYARGS(syscall_nr) \
-        {code: BPF_LD+BPF_W+BPF_ABS,  jt: 0, jf: 0, k: 0}, \
-        {code: BPF_JMP+BPF_JEQ+BPF_K, jt: 0, jf: 1, k: syscall_nr}, \
-        {code: BPF_RET+BPF_K,         jt: 0, jf: 0, k: SECCOMP_RET_ALLOW}
-
         ALLOW_ANYARGS(__NR_gettimeofday),
         ALLOW_ANYARGS(__NR_time),
+        /* where there's no vDSO for it (call profiles, see config_profile) */
+        ALLOW_ANYARGS(__NR_clock_gettime),
+#ifdef __NR_clock_gettime64
+        /* what glibc 2.34 and later try first on i386 */
+        ALLOW_ANYARGS(__NR_clock_gettime64),
+#endif
         ALLOW_ANYARGS(__NR_read),
         ALLOW_ANYARGS(__NR_readv),
         ALLOW_ANYARGS(__NR_write),
@@ -264,17 +261,72 @@ void seccomp_lockdown()
         ALLOW_ANYARGS(__NR_munmap),
         ALLOW_ANYARGS(__NR_futex),
         ALLOW_ANYARGS(__NR_sigprocmask),
+        /* returning from the handler of the signal that interrupts the guest */
+        ALLOW_ANYARGS(__NR_sigreturn),
+        ALLOW_ANYARGS(__NR_rt_sigreturn),
         ALLOW_ANYARGS(__NR_exit),
+    };
+
+    /* what a template needs to fork copies of itself: receive the copy's
+       file descriptors, fork, and, in the copy, close the template's file
+       descriptors and lock itself down further */
+    struct sock_filter filter_template[] = {
+        ALLOW_ANYARGS(__NR_fork),
+        ALLOW_ANYARGS(__NR_close),
+        ALLOW_ARG0(__NR_socketcall, SYS_RECVMSG),
+#ifdef __NR_recvmsg
+        ALLOW_ANYARGS(__NR_recvmsg),
+#endif
+        ALLOW_ARG0(__NR_prctl, PR_SET_PDEATHSIG),
+        ALLOW_ARG0(__NR_prctl, PR_SET_SECCOMP),
+    };
 
+    struct sock_filter filter_end[] = {
         {code: BPF_RET+BPF_K,         jt: 0, jf: 0, k: SECCOMP_RET_ERRNO | 1},
     };
+
+    struct sock_filter seccomp_filter[sizeof(filter_start)/sizeof(filter_start[0]) +
+                                      sizeof(filter_template)/sizeof(filter_template[0]) +
+                                      sizeof(filter_end)/sizeof(filter_end[0])];
+    int len = 0;
+    memcpy(&seccomp_filter[len], filter_start, sizeof(filter_start));
+    len += sizeof(filter_start)/sizeof(filter_start[0]);
+    if(template) {
+        memcpy(&seccomp_filter[len], filter_template, sizeof(filter_template));
+        len += sizeof(filter_template)/sizeof(filter_template[0]);
+    }
+    memcpy(&seccomp_filter[len], filter_end, sizeof(filter_end));
+    len += sizeof(filter_end)/sizeof(filter_end[0]);
+
     struct sock_fprog seccomp_prog = {
-        len: sizeof(seccomp_filter) / sizeof(seccomp_filter[0]),
+        len: len,
         filter: seccomp_filter,
     };
+    return !prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &seccomp_prog, 0, 0);
+}
+
+static void lockdown(bool template)
+{
+    setenv("MALLOC_CHECK_", "0", 1);
+
+#ifdef CATCH_SIGNALS
+    sig.sa_sigaction = handle_signal;
+    sig.sa_flags = SA_SIGINFO;
+    sigaction(11, &sig, NULL);
+    sigaction(6, &sig, NULL);
+#endif
+
+    struct rlimit rlimit;
+    rlimit.rlim_cur = rlimit.rlim_max = config_maxmem + MEM_PAD;
+    setrlimit(RLIMIT_DATA, &rlimit);
+
+#ifdef HIJACK_SYSCALLS
+    errno_location = __errno_location();
+    hijack_linux_gate();
+#endif
 
     int ret = !prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0)
-           && !prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &seccomp_prog, 0, 0);
+           && install_filter(template);
 
     if(!ret) {
         fprintf(stderr, "could not enter secure computation mode\n");
@@ -283,3 +335,20 @@ void seccomp_lockdown()
     }
 }
 
+void seccomp_lockdown()
+{
+    lockdown(false);
+}
+
+void seccomp_lockdown_template()
+{
+    lockdown(true);
+}
+
+void seccomp_lockdown_copy()
+{
+    /* filters stack, so this takes away what only the template was allowed */
+    if(!install_filter(false)) {
+        _exit(1);
+    }
+}
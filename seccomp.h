@@ -5,4 +5,10 @@
 void stdout_printf(const char*format, ...);
 
 void seccomp_lockdown();
+
+/* like seccomp_lockdown(), but the process may still fork copies of itself
+   (see FORK_SANDBOX in language_proxy.c). Such a copy must call
+   seccomp_lockdown_copy() before it runs any guest code. */
+void seccomp_lockdown_template();
+void seccomp_lockdown_copy();
 #endif
@@ -1,4 +1,16 @@
+#include <stddef.h>
 #include "settings.h"
 
 int config_maxmem = 128 * 1048576;
 int config_maxtime = 10;
+int config_shm_size = 0;
+int config_segment_size = 0;
+int config_pool_size = 0;
+bool config_zygote = false;
+bool config_cpu_counter = false;
+bool config_profile = false;
+int config_trace = 0;
+const char*config_cgroup = NULL;
+int config_cgroup_cpu = 0;
+int config_cgroup_pids = 0;
+int config_template_nproc = 1024;
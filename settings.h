@@ -6,4 +6,41 @@
 extern int config_maxmem;
 extern int config_maxtime;
 
+/* size of the shared memory rings between host and sandbox (0 = use pipes) */
+extern int config_shm_size;
+
+/* size of the shared segments big values are passed through (0 = disabled) */
+extern int config_segment_size;
+
+/* number of ready sandboxes to keep around per language (0 = no pooling) */
+extern int config_pool_size;
+
+/* fork sandboxes from a pre-initialized zygote process per language */
+extern bool config_zygote;
+
+/* count the CPU every call in a sandbox uses (see language_t.cpu_used) */
+extern bool config_cpu_counter;
+
+/* keep latency histograms for the phases of every call into a sandbox
+   (see language_t.get_profile()) */
+extern bool config_profile;
+
+/* record this many of the latest events of every sandbox, for
+   language_t.write_trace() (0 = don't) */
+extern int config_trace;
+
+/* Put every sandbox process into a cgroup (v2) of its own, below this
+   one (NULL = don't). We need to be allowed to create groups there, with
+   the memory, cpu and pids controllers enabled. Memory is then limited
+   to config_maxmem by the kernel. */
+extern const char*config_cgroup;
+/* CPU each of those groups may use, in percent of one CPU (0 = no limit) */
+extern int config_cgroup_cpu;
+/* processes each of those groups may have (0 = no limit) */
+extern int config_cgroup_pids;
+
+/* Without such a limit, processes a template may fork on top of those
+   its user already has (RLIMIT_NPROC, 0 = no limit) */
+extern int config_template_nproc;
+
 #endif
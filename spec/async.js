@@ -0,0 +1,24 @@
+var calls = 0;
+
+function assert(b) {
+    if(!b) {
+        throw "assertion failed";
+    }
+}
+
+function twice(x) {
+    calls++;
+    return x * 2;
+}
+
+function hang(x) {
+    x = 0;
+    while(true) {
+        x++;
+    }
+}
+
+function test() {
+    assert(calls == 0 || calls == 4);
+    return "ok";
+}
@@ -0,0 +1,24 @@
+calls = 0
+
+function assert(b)
+    if not b then
+        error("assertion failed")
+    end
+end
+
+function twice(x)
+    calls = calls + 1
+    return x * 2
+end
+
+function hang(x)
+    x = 0
+    while true do
+        x = x + 1
+    end
+end
+
+function test()
+    assert(calls == 0 or calls == 4)
+    return "ok"
+end
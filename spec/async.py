@@ -0,0 +1,15 @@
+calls = 0
+
+def twice(x):
+    global calls
+    calls += 1
+    return x * 2
+
+def hang(x):
+    x = 0
+    while True:
+        x += 1
+
+def test():
+    assert(calls in [0,4])
+    return "ok"
@@ -0,0 +1,22 @@
+$calls = 0
+
+def assert(b)
+    raise if not b
+end
+
+def twice(x)
+    $calls += 1
+    return x * 2
+end
+
+def hang(x)
+    x = 0
+    while true
+        x += 1
+    end
+end
+
+def test()
+    assert($calls == 0 || $calls == 4)
+    return "ok"
+end
@@ -0,0 +1,22 @@
+var calls = 0;
+
+function assert(b) {
+    if(!b) {
+        throw "assertion failed";
+    }
+}
+
+function step(x) {
+    if(x < 0) {
+        throw "failed";
+    }
+    while(x == 0) {
+    }
+    calls++;
+    return x * 2;
+}
+
+function test() {
+    assert(calls == 0 || calls == 4);
+    return "ok";
+}
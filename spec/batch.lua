@@ -0,0 +1,22 @@
+calls = 0
+
+function assert(b)
+    if not b then
+        error("assertion failed")
+    end
+end
+
+function step(x)
+    if x < 0 then
+        error("failed")
+    end
+    while x == 0 do
+    end
+    calls = calls + 1
+    return x * 2
+end
+
+function test()
+    assert(calls == 0 or calls == 4)
+    return "ok"
+end
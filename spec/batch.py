@@ -0,0 +1,14 @@
+calls = 0
+
+def step(x):
+    global calls
+    if x < 0:
+        raise Exception("failed")
+    while x == 0:
+        pass
+    calls += 1
+    return x * 2
+
+def test():
+    assert(calls in [0,4])
+    return "ok"
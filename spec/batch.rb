@@ -0,0 +1,20 @@
+$calls = 0
+
+def assert(b)
+    raise if not b
+end
+
+def step(x)
+    if x < 0
+        raise "failed"
+    end
+    while x == 0
+    end
+    $calls += 1
+    return x * 2
+end
+
+def test()
+    assert($calls == 0 || $calls == 4)
+    return "ok"
+end
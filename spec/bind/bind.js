@@ -0,0 +1,18 @@
+function assert(b) {
+    if(!b) {
+        throw "Assertion failed";
+    }
+}
+
+function test() {
+    assert(add2(3,4) == 7);
+    assert(scale(1.5) == 3.0);
+    assert(greet("world") == "hello world");
+    assert(sum_ints([1,2,3]) == 6);
+
+    var r = reverse_floats([0.5,1.5,2.5]);
+    assert(r.length == 3 && r[0] == 2.5 && r[1] == 1.5 && r[2] == 0.5);
+
+    ping();
+    return "ok";
+}
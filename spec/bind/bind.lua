@@ -0,0 +1,27 @@
+function assert(b)
+    if not b then
+        error("assertion failed")
+    end
+end
+
+function test()
+    assert(add2(3,4) == 7)
+    assert(scale(1.5) == 3.0)
+    assert(greet("world") == "hello world")
+
+    a = {}
+    a[0] = 1
+    a[1] = 2
+    a[2] = 3
+    assert(sum_ints(a) == 6)
+
+    f = {}
+    f[0] = 0.5
+    f[1] = 1.5
+    f[2] = 2.5
+    r = reverse_floats(f)
+    assert(r[0] == 2.5 and r[1] == 1.5 and r[2] == 0.5)
+
+    ping()
+    return "ok"
+end
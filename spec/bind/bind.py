@@ -0,0 +1,8 @@
+def test():
+    assert(add2(3,4) == 7)
+    assert(scale(1.5) == 3.0)
+    assert(greet("world") == "hello world")
+    assert(sum_ints([1,2,3]) == 6)
+    assert(list(reverse_floats([0.5,1.5,2.5])) == [2.5,1.5,0.5])
+    ping()
+    return "ok"
@@ -0,0 +1,25 @@
+var burns = 0;
+
+function assert(b) {
+    if(!b) {
+        throw "assertion failed";
+    }
+}
+
+function burn() {
+    burns++;
+    while(true) {
+        try {
+            var x = 0;
+            while(true) {
+                x++;
+            }
+        } catch(e) {
+        }
+    }
+}
+
+function test() {
+    assert(burns == 0 || burns == 1);
+    return "ok";
+}
@@ -0,0 +1,22 @@
+burns = 0
+
+function assert(b)
+    if not b then
+        error("assertion failed")
+    end
+end
+
+function burn()
+    burns = burns + 1
+    while true do
+        pcall(function()
+            while true do
+            end
+        end)
+    end
+end
+
+function test()
+    assert(burns == 0 or burns == 1)
+    return "ok"
+end
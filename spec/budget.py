@@ -0,0 +1,16 @@
+burns = 0
+
+def burn():
+    global burns
+    burns += 1
+    while True:
+        try:
+            x = 0
+            while True:
+                x += 1
+        except:
+            pass
+
+def test():
+    assert(burns in [0,1])
+    return "ok"
@@ -0,0 +1,23 @@
+$burns = 0
+
+def assert(b)
+    raise if not b
+end
+
+def burn()
+    $burns += 1
+    while true
+        begin
+            x = 0
+            while true
+                x += 1
+            end
+        rescue
+        end
+    end
+end
+
+def test()
+    assert($burns == 0 || $burns == 1)
+    return "ok"
+end
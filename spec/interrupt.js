@@ -0,0 +1,20 @@
+var spins = 0;
+
+function assert(b) {
+    if(!b) {
+        throw "assertion failed";
+    }
+}
+
+function spin() {
+    spins++;
+    var x = 0;
+    while(true) {
+        x++;
+    }
+}
+
+function test() {
+    assert(spins == 0 || spins == 1);
+    return "ok";
+}
@@ -0,0 +1,20 @@
+spins = 0
+
+function assert(b)
+    if not b then
+        error("assertion failed")
+    end
+end
+
+function spin()
+    spins = spins + 1
+    local x = 0
+    while true do
+        x = x + 1
+    end
+end
+
+function test()
+    assert(spins == 0 or spins == 1)
+    return "ok"
+end
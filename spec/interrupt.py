@@ -0,0 +1,12 @@
+spins = 0
+
+def spin():
+    global spins
+    spins += 1
+    x = 0
+    while True:
+        x += 1
+
+def test():
+    assert(spins in [0,1])
+    return "ok"
@@ -0,0 +1,18 @@
+$spins = 0
+
+def assert(b)
+    raise if not b
+end
+
+def spin()
+    $spins += 1
+    x = 0
+    while true
+        x += 1
+    end
+end
+
+def test()
+    assert($spins == 0 || $spins == 1)
+    return "ok"
+end
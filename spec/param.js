@@ -50,8 +50,18 @@ function call_boolean_and_array(b,a) {
     ok += 1
 }
 
+function call_packed(a,f) {
+    assert(a.length == 3 && f.length == 2)
+    assert(sum_packed(a, f) == 8)
+    ok += 1
+}
+
+function call_large(s) {
+    return concat_strings(s, "!")
+}
+
 function test() {
-    assert(ok == 8)
+    assert(ok == 9)
     return "ok"
 }
 
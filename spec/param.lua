@@ -49,7 +49,18 @@ function call_boolean_and_array(b,a)
     ok = ok + 1
 end
 
+function call_packed(a,f)
+    assert(type(a) == "table")
+    assert(type(f) == "table")
+    assert(sum_packed(a, f) == 8)
+    ok = ok + 1
+end
+
+function call_large(s)
+    return concat_strings(s, "!")
+end
+
 function test()
-    assert(ok == 8)
+    assert(ok == 9)
     return "ok"
 end
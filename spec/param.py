@@ -36,7 +36,15 @@ def call_boolean_and_array(b,a):
     assert(type(a) == list)
     Count.ok += 1
 
+def call_packed(a, f):
+    assert(len(a) == 3 and len(f) == 2)
+    assert(sum_packed(a, f) == 8)
+    Count.ok += 1
+
+def call_large(s):
+    return concat_strings(s, "!")
+
 def test():
-    assert(Count.ok == 8)
+    assert(Count.ok == 9)
     return "ok"
 
@@ -47,8 +47,18 @@ def call_boolean_and_array(b,a)
     $ok += 1
 end
 
+def call_packed(a,f)
+    assert(a.size == 3 && f.size == 2)
+    assert(sum_packed(a, f) == 8)
+    $ok += 1
+end
+
+def call_large(s)
+    return concat_strings(s, "!")
+end
+
 def test()
-    assert($ok == 8)
+    assert($ok == 9)
     return "ok"
 end
 
@@ -0,0 +1,7 @@
+function profiled(x) {
+    return add2(x, 1);
+}
+
+function test() {
+    return "ok";
+}
@@ -0,0 +1,7 @@
+function profiled(x)
+    return add2(x, 1)
+end
+
+function test()
+    return "ok"
+end
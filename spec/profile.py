@@ -0,0 +1,5 @@
+def profiled(x):
+    return add2(x, 1)
+
+def test():
+    return "ok"
@@ -0,0 +1,7 @@
+def profiled(x)
+    return add2(x, 1)
+end
+
+def test()
+    return "ok"
+end
@@ -1,8 +1,13 @@
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
 #include <sys/prctl.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "../language.h"
+#include "../settings.h"
 
 static void trace(void*context, char*s)
 {
@@ -53,55 +58,300 @@ static value_t* concat_arrays(void*context, value_t*array1, value_t*array2)
     int i;
     value_t*a = array_new();
     for(i=0;i<array1->length;i++) {
-        array_append(a, value_clone(array1->data[i]));
+        value_t tmp;
+        array_append(a, value_clone(array_get(array1, i, &tmp)));
     }
     for(i=0;i<array2->length;i++) {
-        array_append(a, value_clone(array2->data[i]));
+        value_t tmp;
+        array_append(a, value_clone(array_get(array2, i, &tmp)));
     }
     return a;
 }
+static int sum_packed(void*context, int32_t*ints, int num_ints, float*floats, int num_floats)
+{
+    float sum = 0;
+    int i;
+    for(i=0;i<num_ints;i++)
+        sum += ints[i];
+    for(i=0;i<num_floats;i++)
+        sum += floats[i];
+    return (int)sum;
+}
+
 static bool negate(void*context, bool b)
 {
     return !b;
 }
 
-int main(int argn, char*argv[])
+/* bigger than what fits into a frame (see -s) */
+#define LARGE_STRING_SIZE 100000
+
+/* calls the async specs queue up at once, and the one among them that
+   runs out of time */
+#define ASYNC_CALLS 5
+#define ASYNC_HANG 2
+
+static value_t* async_args(int i)
 {
-    char*program = argv[0];
-    bool sandbox = true;
+    value_t*args = value_new_array();
+    array_append_int32(args, i);
+    return args;
+}
 
-    int i,j=0;
-    for(i=1;i<argn;i++) {
-        if(argv[i][0]=='-') {
-            switch(argv[i][1]) {
-                case 'u':
-                    sandbox = false;
-                break;
+/* Pipelined calls get tickets in the order they were made, and each
+   ticket gets its own result. The one that runs out of time fails, and
+   only that one. */
+static bool check_async(language_t*l)
+{
+    int tickets[ASYNC_CALLS];
+    int i;
+    l->set_timeout(l, 100);
+    for(i=0;i<ASYNC_CALLS;i++) {
+        value_t*args = async_args(i);
+        tickets[i] = l->call_function_async(l, i == ASYNC_HANG ? "hang" : "twice", args);
+        value_destroy(args);
+        if(tickets[i] <= 0 || (i && tickets[i] <= tickets[i-1])) {
+            fprintf(stderr, "call %d got ticket %d\n", i, tickets[i]);
+            return false;
+        }
+    }
+    bool ok = true;
+    for(i=0;i<ASYNC_CALLS;i++) {
+        value_t*r = l->call_result(l, tickets[i]);
+        if(i == ASYNC_HANG) {
+            if(r || !l->timeout) {
+                fprintf(stderr, "hang() didn't time out\n");
+                ok = false;
             }
-        } else {
-            argv[j++] = argv[i];
+        } else if(!r || r->type != TYPE_INT32 || r->i32 != 2*i || l->timeout) {
+            fprintf(stderr, "wrong result for twice(%d)\n", i);
+            ok = false;
         }
+        if(r)
+            value_destroy(r);
+        l->timeout = false;
     }
-    argn = j;
+    l->set_timeout(l, 0);
+    return ok;
+}
 
-    if(argn < 1) {
-        printf("Usage:\n\t%s <program>\n", program);
-        exit(1);
+/* the budget the batch spec gives every call */
+#define BATCH_BUDGET 100000
+
+/* step(x) doubles x, hangs for 0, and fails for negative numbers */
+static batch_t* run_batch(language_t*l, int a, int b, int c, bool stop_on_failure)
+{
+    value_t*args_list = value_new_array();
+    array_append(args_list, async_args(a));
+    array_append(args_list, async_args(b));
+    array_append(args_list, async_args(c));
+    /* no time limit of its own: every call gets set_timeout()'s */
+    batch_t*batch = call_function_batch(l, "step", args_list, 0, stop_on_failure);
+    value_destroy(args_list);
+    l->timeout = false;
+    return batch;
+}
+
+static bool batch_item_is(batch_t*batch, int i, int value)
+{
+    batch_item_t*item = &batch->items[i];
+    return item->called && !item->timeout && item->value &&
+           item->value->type == TYPE_INT32 && item->value->i32 == value;
+}
+
+static bool batch_item_failed(batch_t*batch, int i, bool timeout)
+{
+    batch_item_t*item = &batch->items[i];
+    return item->called && !item->value && item->timeout == timeout;
+}
+
+/* Every call in a batch gets its own time limit, and a call that runs
+   out of time doesn't stop the ones after it. A call that fails does,
+   if we ask for it. Each call starts with the whole budget. */
+static bool check_batch(language_t*l)
+{
+    bool ok = true;
+    l->set_timeout(l, 100);
+    batch_t*batch = run_batch(l, 1, 0, 3, false);
+    if(!batch || batch->num != 3 || !batch_item_is(batch, 0, 2) ||
+       !batch_item_failed(batch, 1, true) || !batch_item_is(batch, 2, 6)) {
+        fprintf(stderr, "a call that timed out stopped the batch\n");
+        ok = false;
     }
+    if(batch)
+        batch_destroy(batch);
 
-    char*filename = argv[0];
+    batch = run_batch(l, 1, -1, 3, true);
+    if(!batch || batch->num != 3 || !batch_item_is(batch, 0, 2) ||
+       !batch_item_failed(batch, 1, false) || batch->items[2].called) {
+        fprintf(stderr, "a call that failed didn't stop the batch\n");
+        ok = false;
+    }
+    if(batch)
+        batch_destroy(batch);
 
-    language_t*l;
-    if(sandbox) {
-        l = interpreter_by_extension(filename);
-    } else {
-        l = unsafe_interpreter_by_extension(filename);
+    if(l->set_budget) {
+        l->set_budget(l, BATCH_BUDGET);
+        batch = run_batch(l, 0, 1, -1, false);
+        if(!batch || batch->num != 3 || !batch_item_failed(batch, 0, false) ||
+           batch->items[0].budget_left || !batch_item_is(batch, 1, 2) ||
+           batch->items[1].budget_left <= 0 || batch->items[1].budget_left >= BATCH_BUDGET ||
+           !batch_item_failed(batch, 2, false)) {
+            fprintf(stderr, "batch calls didn't each get their budget\n");
+            ok = false;
+        }
+        if(batch)
+            batch_destroy(batch);
+        l->set_budget(l, 0);
     }
-    if(!l) {
-        fprintf(stderr, "Couldn't initialize %sinterpreter for %s\n", l?"sandboxed":"", filename);
-        return 1;
+    l->set_timeout(l, 0);
+    return ok;
+}
+
+/* Every call is profiled in all of its phases, callbacks included: a
+   single call adds one value to each. */
+static bool check_profile(language_t*l)
+{
+    value_t*args = async_args(1);
+    value_t*r = l->call_function(l, "profiled", args);
+    value_destroy(args);
+    bool ok = r && r->type == TYPE_INT32 && r->i32 == 2;
+    if(r)
+        value_destroy(r);
+    if(!ok) {
+        fprintf(stderr, "profiled() failed\n");
+        return false;
+    }
+    int i;
+    for(i=0;i<NUM_PHASES;i++) {
+        const histogram_t*h = l->get_profile(l, "profiled", i);
+        if(!h || h->count != 1) {
+            fprintf(stderr, "phase %d of profiled() counted %d times\n", i, h ? (int)h->count : 0);
+            ok = false;
+        }
+    }
+
+    char*dump = NULL;
+    size_t size = 0;
+    FILE*fi = open_memstream(&dump, &size);
+    l->dump_profile(l, fi);
+    fclose(fi);
+    if(!strstr(dump, "profiled:") || !strstr(dump, "callback")) {
+        fprintf(stderr, "dump_profile() left out profiled():\n%s", dump);
+        ok = false;
+    }
+    free(dump);
+    return ok;
+}
+
+/* events the specs keep (see -r) */
+#define TRACE_EVENTS 256
+
+/* whether the JSON has an event of that kind, category and detail (one
+   event per line) */
+static bool has_event(const char*json, const char*name, const char*cat, const char*detail)
+{
+    char event[64], args[64];
+    snprintf(event, sizeof(event), "{\"name\":\"%s\",\"cat\":\"%s\",", name, cat);
+    snprintf(args, sizeof(args), "\"args\":{\"detail\":\"%s\"}", detail);
+    const char*line = json;
+    while(line) {
+        const char*end = strchr(line, '\n');
+        if(!strncmp(line, event, strlen(event))) {
+            const char*a = strstr(line, args);
+            if(a && (!end || a < end))
+                return true;
+        }
+        line = end ? end+1 : NULL;
     }
+    return false;
+}
 
+/* The host and the sandbox both trace the call to profiled(), and the
+   callback it makes */
+static bool check_trace(language_t*l)
+{
+    char*json = NULL;
+    size_t size = 0;
+    FILE*fi = open_memstream(&json, &size);
+    bool ok = l->write_trace(l, fi);
+    fclose(fi);
+    ok = ok && has_event(json, "call", "host", "profiled") &&
+         has_event(json, "call", "sandbox", "profiled") &&
+         has_event(json, "callback", "host", "add2") &&
+         has_event(json, "callback", "sandbox", "add2");
+    if(!ok) {
+        fprintf(stderr, "write_trace() left out the call to profiled():\n%s", json);
+    }
+    free(json);
+    return ok;
+}
+
+typedef struct _nb_call {
+    int*completed;  /* calls completed so far, of all of them */
+    int order;
+    value_t*result;
+    bool timeout;
+} nb_call_t;
+
+static void nb_done(language_t*l, value_t*result, void*user)
+{
+    nb_call_t*call = (nb_call_t*)user;
+    call->order = (*call->completed)++;
+    call->result = result;
+    call->timeout = l->timeout;
+}
+
+/* The same, with the calls driven by an event loop. They complete in the
+   order they were made. */
+static bool check_loop(language_t*l)
+{
+    sandbox_loop_t*loop = sandbox_loop_new();
+    if(!l->attach_loop(l, loop)) {
+        sandbox_loop_destroy(loop);
+        return false;
+    }
+    nb_call_t calls[ASYNC_CALLS];
+    memset(calls, 0, sizeof(calls));
+    int completed = 0;
+    int i;
+    l->set_timeout(l, 100);
+    for(i=0;i<ASYNC_CALLS;i++) {
+        value_t*args = async_args(i);
+        calls[i].completed = &completed;
+        l->call_function_nb(l, i == ASYNC_HANG ? "hang" : "twice", args, nb_done, &calls[i]);
+        value_destroy(args);
+    }
+    sandbox_loop_run(loop);
+
+    bool ok = completed == ASYNC_CALLS;
+    for(i=0;i<ASYNC_CALLS;i++) {
+        value_t*r = calls[i].result;
+        if(calls[i].order != i) {
+            fprintf(stderr, "call %d completed as number %d\n", i, calls[i].order);
+            ok = false;
+        } else if(i == ASYNC_HANG) {
+            if(r || !calls[i].timeout) {
+                fprintf(stderr, "hang() didn't time out\n");
+                ok = false;
+            }
+        } else if(!r || r->type != TYPE_INT32 || r->i32 != 2*i || calls[i].timeout) {
+            fprintf(stderr, "wrong result for twice(%d)\n", i);
+            ok = false;
+        }
+        if(r)
+            value_destroy(r);
+    }
+    l->destroy(l);
+    sandbox_loop_destroy(loop);
+    return ok;
+}
+
+/* run the specs in a copy of a template (see -f) */
+static bool fork_template = false;
+
+static void define_functions(language_t*l)
+{
     define_function(l, "trace", trace, NULL, "s",""),
     define_function(l, "get_array", get_array, NULL, "ii","["),
     define_function(l, "add2", add2, NULL, "ii", "i"),
@@ -111,6 +361,31 @@ int main(int argn, char*argv[])
     define_function(l, "concat_strings", concat_strings, NULL, "ss", "s"),
     define_function(l, "concat_arrays", concat_arrays, NULL, "[[", "["),
     define_function(l, "negate", negate, NULL, "b", "b"),
+    define_function(l, "sum_packed", sum_packed, NULL, "IF", "i");
+}
+
+static value_t* run_script(language_t*l, bool sandbox);
+
+static value_t* run(const char*filename, bool sandbox)
+{
+    language_t*l;
+    language_t*template = NULL;
+    if(!sandbox) {
+        l = unsafe_interpreter_by_extension(filename);
+    } else if(fork_template) {
+        l = template = template_interpreter_by_extension(filename);
+    } else {
+        l = interpreter_by_extension(filename);
+    }
+    if(!l) {
+        fprintf(stderr, "Couldn't initialize %sinterpreter for %s\n", l?"sandboxed":"", filename);
+        return NULL;
+    }
+
+    /* templates only take callbacks once they're forked */
+    if(!template) {
+        define_functions(l);
+    }
     l->define_constant(l, "global_int", value_new_int32(3));
     l->define_constant(l, "global_array", value_new_array());
     l->define_constant(l, "global_boolean", value_new_boolean(true));
@@ -120,16 +395,34 @@ int main(int argn, char*argv[])
     char* script = read_file(filename);
     if(!script) {
         fprintf(stderr, "Error reading script %s\n", filename);
-        return 1;
+        return NULL;
     }
 
     bool compiled = l->compile_script(l, script);
     if(!compiled) {
         fprintf(stderr, "Error compiling script\n");
         l->destroy(l);
-        return 1;
+        return NULL;
+    }
+
+    if(!template) {
+        return run_script(l, sandbox);
+    }
+    l = sandbox_fork(template);
+    if(!l) {
+        fprintf(stderr, "Couldn't fork template for %s\n", filename);
+        template->destroy(template);
+        return NULL;
     }
-    
+    define_functions(l);
+    value_t*ret = run_script(l, sandbox);
+    template->destroy(template);
+    return ret;
+}
+
+/* calls the script's functions, and destroys l */
+static value_t* run_script(language_t*l, bool sandbox)
+{
     value_t*ret = NULL;
     if(l->is_function(l, "call_noargs")) {
         value_t*args = value_new_array();
@@ -185,14 +478,314 @@ int main(int argn, char*argv[])
         ret = l->call_function(l, "call_boolean_and_array", args);
         value_destroy(args);
     }
+    if(l->is_function(l, "call_packed")) {
+        int32_t ints[] = {1, 2, 3};
+        float floats[] = {0.5, 1.5};
+        value_t*args = value_new_array();
+        array_append(args, value_new_int32_array(ints, 3));
+        array_append(args, value_new_float32_array(floats, 2));
+        ret = l->call_function(l, "call_packed", args);
+        value_destroy(args);
+    }
+
+    /* values too big for a frame of their own go through the shared
+       segments, in both directions, and so do their callbacks */
+    if(sandbox && config_segment_size && l->is_function(l, "call_large")) {
+        int len = LARGE_STRING_SIZE;
+        char*str = malloc(len + 1);
+        memset(str, 'x', len);
+        str[len] = 0;
+        value_t*args = value_new_array();
+        array_append(args, value_new_string(str));
+        value_t*r = l->call_function(l, "call_large", args);
+        value_destroy(args);
+        bool ok = r && r->type == TYPE_STRING && strlen(r->str) == len + 1 &&
+                  !strncmp(r->str, str, len) && r->str[len] == '!';
+        free(str);
+        if(r)
+            value_destroy(r);
+        if(!ok) {
+            fprintf(stderr, "call_large() didn't return its argument\n");
+            l->destroy(l);
+            return NULL;
+        }
+    }
+
+    /* a guest that runs out of time is interrupted, and the sandbox stays
+       usable */
+    if(sandbox && l->set_timeout && l->is_function(l, "spin")) {
+        l->set_timeout(l, 50);
+        value_t*r = l->call_function(l, "spin", NO_ARGS);
+        if(r || !l->timeout) {
+            fprintf(stderr, "spin() wasn't interrupted\n");
+            if(r)
+                value_destroy(r);
+            l->destroy(l);
+            return NULL;
+        }
+        l->timeout = false;
+        l->set_timeout(l, 0);
+    }
+    /* in our own process, the thread's timer does the interrupting */
+    if(!sandbox && l->interrupt && l->is_function(l, "spin")) {
+        bool timeout = false;
+        value_t*r = call_function_with_timeout_ms(l, "spin", NO_ARGS, 50, &timeout);
+        if(r || !timeout) {
+            fprintf(stderr, "spin() wasn't interrupted\n");
+            if(r)
+                value_destroy(r);
+            l->destroy(l);
+            return NULL;
+        }
+    }
+
+    /* so does one that runs out of budget, no matter how busy we are */
+    if(l->set_budget && l->is_function(l, "burn")) {
+        l->set_budget(l, 100000);
+        value_t*r = l->call_function(l, "burn", NO_ARGS);
+        if(r || l->budget_left) {
+            fprintf(stderr, "burn() didn't run out of budget\n");
+            if(r)
+                value_destroy(r);
+            l->destroy(l);
+            return NULL;
+        }
+        l->set_budget(l, 0);
+    }
+
+    bool async = sandbox && l->call_function_async && l->is_function(l, "twice") &&
+                 l->is_function(l, "hang");
+    if(async && !check_async(l)) {
+        l->destroy(l);
+        return NULL;
+    }
+
+    if(sandbox && l->call_function_batch && l->is_function(l, "step") &&
+       !check_batch(l)) {
+        l->destroy(l);
+        return NULL;
+    }
+
+    if(sandbox && config_profile && l->get_profile && l->is_function(l, "profiled") &&
+       !check_profile(l)) {
+        l->destroy(l);
+        return NULL;
+    }
+    if(sandbox && config_trace && l->write_trace && l->is_function(l, "profiled") &&
+       !check_trace(l)) {
+        l->destroy(l);
+        return NULL;
+    }
 
     if(l->is_function(l, "test")) {
         ret = l->call_function(l, "test", NO_ARGS);
     }
 
+    /* and the sandbox kept track of what it used */
+    if(sandbox && l->get_stats) {
+        sandbox_stats_t stats;
+        if(!l->get_stats(l, &stats) || !stats.calls || !stats.bytes_sent ||
+           !stats.bytes_received) {
+            fprintf(stderr, "no stats for the sandbox\n");
+            if(ret)
+                value_destroy(ret);
+            l->destroy(l);
+            return NULL;
+        }
+    }
+
+    /* event loops only drive sandboxes that talk through pipes */
+    if(async && l->attach_loop && !config_shm_size) {
+        if(!check_loop(l)) {
+            if(ret)
+                value_destroy(ret);
+            return NULL;
+        }
+        return ret;
+    }
+
     l->destroy(l);
+    return ret;
+}
+
+static bool is_ok(value_t*ret)
+{
+    return ret && ret->type == TYPE_STRING && !strcmp(ret->str, "ok");
+}
+
+typedef struct _thread {
+    pthread_t thread;
+    const char*filename;
+    value_t*ret;
+} thread_t;
+
+#define PARALLEL_RUNS 4
+
+/* seconds an orphaned sandbox may take to notice (see orphan_exits()) */
+#define ORPHAN_TIMEOUT 10
+
+/* run the script a couple of times, in a sandbox of our own */
+static void* run_thread(void*data)
+{
+    thread_t*t = (thread_t*)data;
+    int i;
+    for(i=0;i<PARALLEL_RUNS;i++) {
+        if(t->ret)
+            value_destroy(t->ret);
+        t->ret = run(t->filename, true);
+        if(!is_ok(t->ret))
+            break;
+    }
+    return NULL;
+}
+
+/* One sandbox per core, all driven at the same time */
+static value_t* run_parallel(const char*filename)
+{
+    int num = sysconf(_SC_NPROCESSORS_ONLN);
+    if(num < 2)
+        num = 2;
+    thread_t*threads = calloc(num, sizeof(thread_t));
+    int i;
+    for(i=0;i<num;i++) {
+        threads[i].filename = filename;
+        pthread_create(&threads[i].thread, NULL, run_thread, &threads[i]);
+    }
+    value_t*ret = NULL;
+    for(i=0;i<num;i++) {
+        pthread_join(threads[i].thread, NULL);
+        if(!ret || (is_ok(ret) && !is_ok(threads[i].ret))) {
+            ret = threads[i].ret;
+        }
+    }
+    free(threads);
+    return ret;
+}
+
+/* A sandbox mustn't outlive its host: spawn one from a process of its
+   own, kill that process, and wait for the sandbox to exit. As the
+   subreaper, we inherit (and reap) it. */
+static bool orphan_exits(const char*filename)
+{
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+    int ready[2];
+    if(pipe(ready))
+        return false;
+    fflush(stdout);
+    fflush(stderr);
+    pid_t host = fork();
+    if(!host) {
+        close(ready[0]);
+        if(!interpreter_by_extension(filename))
+            _exit(1);
+        write(ready[1], "", 1);
+        pause();
+        _exit(0);
+    }
+    close(ready[1]);
+    char c;
+    bool spawned = host > 0 && read(ready[0], &c, 1) == 1;
+    close(ready[0]);
+    if(host > 0) {
+        kill(host, SIGKILL);
+        waitpid(host, NULL, 0);
+    }
+
+    int64_t deadline = monotonic_usec() + ORPHAN_TIMEOUT * 1000000ll;
+    while(monotonic_usec() < deadline) {
+        pid_t pid = waitpid(-1, NULL, WNOHANG);
+        if(pid < 0 && errno == ECHILD)
+            return spawned;
+        if(pid <= 0)
+            usleep(10000);
+    }
+    fprintf(stderr, "sandbox outlived its host\n");
+    return false;
+}
+
+/* The sandboxes we ran came out of the pool, ready or not */
+static bool pool_served(const char*filename)
+{
+    pool_stats_t stats;
+    if(!interpreter_pool_stats(filename, &stats) || stats.capacity != config_pool_size ||
+       !(stats.hits + stats.misses)) {
+        fprintf(stderr, "sandboxes didn't come from the pool\n");
+        return false;
+    }
+    return true;
+}
+
+int main(int argn, char*argv[])
+{
+    char*program = argv[0];
+    bool sandbox = true;
+    bool parallel = false;
+
+    int i,j=0;
+    for(i=1;i<argn;i++) {
+        if(argv[i][0]=='-') {
+            switch(argv[i][1]) {
+                case 'u':
+                    sandbox = false;
+                break;
+                case 'p':
+                    parallel = true;
+                break;
+                case 's':
+                    /* rings small enough that frames wrap around, and
+                       segments for big values */
+                    config_shm_size = 8192;
+                    config_segment_size = 1024*1024;
+                break;
+                case 'z':
+                    /* sandboxes forked from a zygote, handed out by a pool */
+                    config_zygote = true;
+                    config_pool_size = 2;
+                break;
+                case 'f':
+                    fork_template = true;
+                break;
+                case 'r':
+                    /* record where calls spend their time, and what
+                       happened when */
+                    config_profile = true;
+                    config_trace = TRACE_EVENTS;
+                break;
+            }
+        } else {
+            argv[j++] = argv[i];
+        }
+    }
+    argn = j;
+
+    if(argn < 1) {
+        printf("Usage:\n\t%s [-u|-p|-s|-z|-f|-r] <program>\n", program);
+        exit(1);
+    }
+
+    char*filename = argv[0];
+
+    value_t*ret;
+    if(parallel && sandbox) {
+        ret = run_parallel(filename);
+    } else {
+        ret = run(filename, sandbox);
+    }
+    if(!ret) {
+        return 1;
+    }
+    if(sandbox && config_pool_size && !fork_template && !pool_served(filename)) {
+        return 1;
+    }
+    /* the host we spawn in orphan_exits() starts pools and zygotes of
+       its own */
+    interpreter_pools_destroy();
+    interpreter_zygotes_destroy();
+    if(sandbox && !parallel && !orphan_exits(filename)) {
+        return 1;
+    }
 
-    if(ret && ret->type == TYPE_STRING) {
+    if(ret->type == TYPE_STRING) {
         fputs(ret->str, stdout);
         fputc('\n', stdout);
         if(!strcmp(ret->str, "ok"))
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "../language.hpp"
+
+/* Host functions bound with sandbox::bind() (see language.hpp). The
+   script's test() calls them; the argument checks are tried from here,
+   since a host function that fails aborts the guest's call. */
+
+static int32_t add2(int32_t x, int32_t y)
+{
+    return x+y;
+}
+
+static int32_t sum_ints(std::vector<int32_t> ints)
+{
+    int32_t sum = 0;
+    for(int32_t i : ints)
+        sum += i;
+    return sum;
+}
+
+static std::string last_error;
+
+static void log_error(void*user, const char*line)
+{
+    last_error = line;
+}
+
+/* Call f with args directly, and check that it refuses them */
+static bool expect_error(language_t*l, value_t*f, value_t*args, const char*expected)
+{
+    last_error.clear();
+    value_t*ret = f->call(f, args);
+    value_destroy(args);
+    if(ret) {
+        value_destroy(ret);
+        fprintf(stderr, "call with bad arguments didn't fail\n");
+        return false;
+    }
+    if(last_error.find(expected) == std::string::npos) {
+        fprintf(stderr, "expected error \"%s\", got \"%s\"\n", expected, last_error.c_str());
+        return false;
+    }
+    return true;
+}
+
+static bool check_errors(language_t*l)
+{
+    void (*old_log)(void*, const char*) = l->log;
+    l->log = log_error;
+
+    value_t*f = sandbox::function_new(l, "add2", &add2);
+    value_t*args = array_new();
+    array_append_int32(args, 1);
+    bool ok = expect_error(l, f, args, "add2: wrong number of arguments: expected 2, got 1");
+
+    args = array_new();
+    array_append_int32(args, 1);
+    array_append_string(args, (char*)"two");
+    ok = ok && expect_error(l, f, args, "add2: Can't convert parameter 2 from string to int32");
+    value_destroy(f);
+
+    f = sandbox::function_new(l, "sum_ints", &sum_ints);
+    args = array_new();
+    value_t*ints = array_new();
+    array_append_int32(ints, 1);
+    array_append_string(ints, (char*)"two");
+    array_append(args, ints);
+    ok = ok && expect_error(l, f, args, "sum_ints: Can't convert parameter 1 from array to int32 array");
+    value_destroy(f);
+
+    l->log = old_log;
+    return ok;
+}
+
+static value_t* run(const char*filename, bool sandbox)
+{
+    language_t*l;
+    if(sandbox) {
+        l = interpreter_by_extension(filename);
+    } else {
+        l = unsafe_interpreter_by_extension(filename);
+    }
+    if(!l) {
+        fprintf(stderr, "Couldn't initialize interpreter for %s\n", filename);
+        return NULL;
+    }
+
+    float factor = 2;
+    int pings = 0;
+    sandbox::bind(l, "add2", &add2);
+    sandbox::bind(l, "sum_ints", &sum_ints);
+    sandbox::bind(l, "scale", [factor](float x) { return x*factor; });
+    sandbox::bind(l, "greet", [](std::string who) { return "hello " + who; });
+    sandbox::bind(l, "reverse_floats", [](const std::vector<float>&floats) {
+        return std::vector<float>(floats.rbegin(), floats.rend());
+    });
+    sandbox::bind(l, "ping", [&pings]() { pings++; });
+
+    char* script = read_file(filename);
+    if(!script) {
+        fprintf(stderr, "Error reading script %s\n", filename);
+        l->destroy(l);
+        return NULL;
+    }
+    bool compiled = l->compile_script(l, script);
+    free(script);
+    if(!compiled) {
+        fprintf(stderr, "Error compiling script\n");
+        l->destroy(l);
+        return NULL;
+    }
+
+    value_t*ret = l->call_function(l, "test", NO_ARGS);
+    if(ret && pings != 1) {
+        fprintf(stderr, "ping() was called %d times\n", pings);
+        value_destroy(ret);
+        ret = NULL;
+    }
+    if(ret && !check_errors(l)) {
+        value_destroy(ret);
+        ret = NULL;
+    }
+
+    l->destroy(l);
+    return ret;
+}
+
+int main(int argn, char*argv[])
+{
+    char*program = argv[0];
+    bool sandbox = true;
+
+    int i,j=0;
+    for(i=1;i<argn;i++) {
+        if(argv[i][0]=='-') {
+            switch(argv[i][1]) {
+                case 'u':
+                    sandbox = false;
+                break;
+            }
+        } else {
+            argv[j++] = argv[i];
+        }
+    }
+    argn = j;
+
+    if(argn < 1) {
+        printf("Usage:\n\t%s [-u] <program>\n", program);
+        exit(1);
+    }
+
+    value_t*ret = run(argv[0], sandbox);
+    if(!ret) {
+        return 1;
+    }
+    bool ok = ret->type == TYPE_STRING && !strcmp(ret->str, "ok");
+    if(ret->type == TYPE_STRING) {
+        fputs(ret->str, stdout);
+    } else {
+        value_dump(ret);
+    }
+    fputc('\n', stdout);
+    value_destroy(ret);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,162 @@
+/* timer.c
+   hierarchical timer wheel
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#include <stdlib.h>
+#include <string.h>
+#include "timer.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_RANGE (1ll << (WHEEL_BITS * WHEEL_LEVELS))
+
+/* Level 0 has a slot for each of the next 64 milliseconds, level 1 one
+   for each of the next 64 blocks of 64 ms, and so on. Every time level 0
+   wraps around, the next slot of level 1 is spread out over level 0
+   (and likewise for the levels above), so that adding, removing and
+   firing a timer are all O(1). */
+
+timer_wheel_t* timer_wheel_new(int64_t now_ms)
+{
+    timer_wheel_t*wheel = calloc(1, sizeof(timer_wheel_t));
+    wheel->now = now_ms;
+    int level, slot;
+    for(level=0;level<WHEEL_LEVELS;level++) {
+        for(slot=0;slot<WHEEL_SLOTS;slot++) {
+            wheel_timer_t*head = &wheel->slots[level][slot];
+            head->next = head->prev = head;
+        }
+    }
+    return wheel;
+}
+
+void timer_wheel_destroy(timer_wheel_t*wheel)
+{
+    free(wheel);
+}
+
+static void unlink_timer(wheel_timer_t*t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+static void place(timer_wheel_t*wheel, wheel_timer_t*t)
+{
+    int64_t expires = t->expires < wheel->now ? wheel->now : t->expires;
+    int64_t delta = expires - wheel->now;
+    int level = 0;
+    while(level < WHEEL_LEVELS - 1 && delta >= 1ll << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    int slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+    wheel_timer_t*head = &wheel->slots[level][slot];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+bool timer_pending(wheel_timer_t*t)
+{
+    return t->next != NULL;
+}
+
+void timer_add(timer_wheel_t*wheel, wheel_timer_t*t, int64_t expires_ms, wheel_func_t func, void*data)
+{
+    timer_del(wheel, t);
+    if(expires_ms - wheel->now >= WHEEL_RANGE) {
+        expires_ms = wheel->now + WHEEL_RANGE - 1;
+    }
+    t->expires = expires_ms;
+    t->func = func;
+    t->data = data;
+    place(wheel, t);
+    wheel->count++;
+}
+
+void timer_del(timer_wheel_t*wheel, wheel_timer_t*t)
+{
+    if(!timer_pending(t))
+        return;
+    unlink_timer(t);
+    wheel->count--;
+}
+
+/* Spread the slot of the given level that covers wheel->now over the
+   levels below it. */
+static void cascade(timer_wheel_t*wheel, int level)
+{
+    if(level >= WHEEL_LEVELS)
+        return;
+    int slot = (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    if(!slot) {
+        cascade(wheel, level + 1);
+    }
+    wheel_timer_t*head = &wheel->slots[level][slot];
+    while(head->next != head) {
+        wheel_timer_t*t = head->next;
+        unlink_timer(t);
+        place(wheel, t);
+    }
+}
+
+int timer_wheel_advance(timer_wheel_t*wheel, int64_t now_ms)
+{
+    int fired = 0;
+    while(wheel->now <= now_ms) {
+        if(!wheel->count) {
+            /* nothing to cascade either */
+            wheel->now = now_ms + 1;
+            break;
+        }
+        int slot = wheel->now & WHEEL_MASK;
+        if(!slot) {
+            cascade(wheel, 1);
+        }
+        /* take them one at a time: func might delete the next one */
+        wheel_timer_t*head = &wheel->slots[0][slot];
+        while(head->next != head) {
+            wheel_timer_t*t = head->next;
+            unlink_timer(t);
+            wheel->count--;
+            t->func(t, t->data);
+            fired++;
+        }
+        wheel->now++;
+    }
+    return fired;
+}
+
+int64_t timer_wheel_next(timer_wheel_t*wheel)
+{
+    if(!wheel->count)
+        return -1;
+    int i;
+    for(i=0;i<WHEEL_SLOTS;i++) {
+        int64_t when = wheel->now + i;
+        int slot = when & WHEEL_MASK;
+        /* level 1 cascades into level 0 there (we might be right at that
+           point, with the timers due now still waiting in level 1) */
+        if(!slot)
+            return when;
+        wheel_timer_t*head = &wheel->slots[0][slot];
+        if(head->next != head)
+            return when;
+    }
+    return wheel->now + WHEEL_SLOTS;
+}
@@ -0,0 +1,76 @@
+/* timer.h
+   hierarchical timer wheel
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#ifndef __timer_h__
+#define __timer_h__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Four levels of 64 slots, with a resolution of one millisecond. Timers
+   further out than 64^4 ms (about 4.6 hours) fire at that point. */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+struct _wheel_timer;
+typedef void (*wheel_func_t)(struct _wheel_timer*t, void*data);
+
+/* Embedded in whatever has the deadline, so that adding and removing
+   timers doesn't allocate. Zero-initialize before first use. */
+typedef struct _wheel_timer {
+    struct _wheel_timer*next;
+    struct _wheel_timer*prev;
+    int64_t expires;    /* ms */
+    wheel_func_t func;
+    void*data;
+} wheel_timer_t;
+
+typedef struct _timer_wheel {
+    /* everything before this (in ms) has fired */
+    int64_t now;
+    int count;
+    wheel_timer_t slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} timer_wheel_t;
+
+timer_wheel_t* timer_wheel_new(int64_t now_ms);
+void timer_wheel_destroy(timer_wheel_t*wheel);
+
+/* (Re)schedule t to call func once the wheel advances to expires_ms */
+void timer_add(timer_wheel_t*wheel, wheel_timer_t*t, int64_t expires_ms, wheel_func_t func, void*data);
+void timer_del(timer_wheel_t*wheel, wheel_timer_t*t);
+bool timer_pending(wheel_timer_t*t);
+
+/* Fire every timer that expired at or before now_ms. Timers can be added
+   and removed (including other expired ones) from within func. Returns
+   the number of timers that fired. */
+int timer_wheel_advance(timer_wheel_t*wheel, int64_t now_ms);
+
+/* When to call timer_wheel_advance() next, or -1 if no timers are
+   pending. This can be earlier than the next timer (when one of the
+   upper levels needs to be cascaded), but never later. */
+int64_t timer_wheel_next(timer_wheel_t*wheel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,131 @@
+/* trace.c
+   event traces of sandbox activity
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+static const char*kind_names[NUM_TRACE_KINDS] = {
+    "spawn", "initialize", "lockdown", "compile", "call", "batch", "callback", "log",
+};
+
+trace_t* trace_new(int size)
+{
+    trace_t*t = calloc(1, sizeof(trace_t));
+    t->events = calloc(size, sizeof(trace_event_t));
+    if(!t->events) {
+        free(t);
+        return NULL;
+    }
+    t->size = size;
+    return t;
+}
+
+void trace_clear(trace_t*t)
+{
+    t->count = 0;
+}
+
+void trace_destroy(trace_t*t)
+{
+    free(t->events);
+    free(t);
+}
+
+trace_event_t* trace_add(trace_t*t, trace_kind_t kind, const char*detail, int64_t start, int64_t duration)
+{
+    trace_event_t*e = &t->events[t->count++ % t->size];
+    e->kind = kind;
+    e->sandbox = false;
+    e->start = start;
+    e->duration = duration;
+    e->detail[0] = 0;
+    if(detail) {
+        strncpy(e->detail, detail, TRACE_DETAIL_SIZE - 1);
+        e->detail[TRACE_DETAIL_SIZE - 1] = 0;
+        if(strlen(detail) >= TRACE_DETAIL_SIZE) {
+            /* don't leave half a UTF-8 character at the end */
+            int len = TRACE_DETAIL_SIZE - 1;
+            int pos = len;
+            while(pos > 0 && (e->detail[pos - 1] & 0xc0) == 0x80)
+                pos--;
+            if(pos > 0 && (e->detail[pos - 1] & 0x80)) {
+                unsigned char lead = e->detail[pos - 1];
+                int need = lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : 2;
+                if(len - (pos - 1) < need)
+                    e->detail[pos - 1] = 0;
+            }
+        }
+    }
+    return e;
+}
+
+int trace_num_events(trace_t*t)
+{
+    return t->count < t->size ? t->count : t->size;
+}
+
+trace_event_t* trace_get(trace_t*t, int i)
+{
+    int64_t first = t->count - trace_num_events(t);
+    return &t->events[(first + i) % t->size];
+}
+
+static void write_escaped(FILE*fi, const char*s)
+{
+    for(;*s;s++) {
+        unsigned char c = *s;
+        if(c == '"' || c == '\\') {
+            fprintf(fi, "\\%c", c);
+        } else if(c < 0x20) {
+            fprintf(fi, "\\u%04x", c);
+        } else {
+            fputc(c, fi);
+        }
+    }
+}
+
+void trace_write_json(trace_t*t, FILE*fi, pid_t host, pid_t sandbox)
+{
+    fprintf(fi, "{\"traceEvents\":[\n");
+    fprintf(fi, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"host\"}},\n", host);
+    fprintf(fi, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"sandbox %d\"}}", sandbox, sandbox);
+    int num = trace_num_events(t);
+    int i;
+    for(i=0;i<num;i++) {
+        trace_event_t*e = trace_get(t, i);
+        pid_t pid = e->sandbox ? sandbox : host;
+        /* timestamps are in usec */
+        fprintf(fi, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%lld.%03d",
+                kind_names[e->kind < NUM_TRACE_KINDS ? e->kind : TRACE_LOG],
+                e->sandbox ? "sandbox" : "host", pid, pid,
+                (long long)(e->start / 1000), (int)(e->start % 1000));
+        if(e->duration >= 0) {
+            fprintf(fi, ",\"ph\":\"X\",\"dur\":%lld.%03d",
+                    (long long)(e->duration / 1000), (int)(e->duration % 1000));
+        } else {
+            fprintf(fi, ",\"ph\":\"i\",\"s\":\"t\"");
+        }
+        if(e->detail[0]) {
+            fprintf(fi, ",\"args\":{\"detail\":\"");
+            write_escaped(fi, e->detail);
+            fprintf(fi, "\"}");
+        }
+        fprintf(fi, "}");
+    }
+    fprintf(fi, "\n]}\n");
+}
@@ -0,0 +1,80 @@
+/* trace.h
+   event traces of sandbox activity
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#ifndef __trace_h__
+#define __trace_h__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum _trace_kind {
+    TRACE_SPAWN,
+    TRACE_INITIALIZE,
+    TRACE_LOCKDOWN,
+    TRACE_COMPILE,
+    TRACE_CALL,
+    TRACE_BATCH,
+    TRACE_CALLBACK,
+    TRACE_LOG,
+    NUM_TRACE_KINDS
+} trace_kind_t;
+
+#define TRACE_DETAIL_SIZE 32
+
+typedef struct _trace_event {
+    uint8_t kind;
+    bool sandbox;           /* recorded in the sandbox process, not the host */
+    int64_t start;          /* CLOCK_MONOTONIC, nsec */
+    int64_t duration;       /* nsec, -1 for events without one (log lines) */
+    char detail[TRACE_DETAIL_SIZE];  /* function name, or start of a log line */
+} trace_event_t;
+
+/* The last size events. Once that's full, new events replace the oldest
+   ones, so recording never allocates. */
+typedef struct _trace {
+    trace_event_t*events;
+    int size;
+    int64_t count;      /* events recorded so far */
+} trace_t;
+
+trace_t* trace_new(int size);
+void trace_clear(trace_t*t);
+void trace_destroy(trace_t*t);
+
+/* detail may be NULL. Returns the event, so it can be adjusted. */
+trace_event_t* trace_add(trace_t*t, trace_kind_t kind, const char*detail, int64_t start, int64_t duration);
+
+/* Number of events we still have, and the i-th oldest of those */
+int trace_num_events(trace_t*t);
+trace_event_t* trace_get(trace_t*t, int i);
+
+/* Write the events in Chrome's trace event format (JSON), which Perfetto
+   and chrome://tracing read. host and sandbox are the process ids the
+   events are listed under. */
+void trace_write_json(trace_t*t, FILE*fi, pid_t host, pid_t sandbox);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,10 +3,12 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdarg.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <unistd.h>
+#include <time.h>
 #include "util.h"
 
 char* dbg_printf(const char*format, ...)
@@ -129,6 +131,40 @@ char*read_file(const char*filename)
     return script;
 }
 
+int64_t monotonic_usec()
+{
+    struct timespec ts;
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+        return 0;
+    }
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int64_t monotonic_nsec()
+{
+    struct timespec ts;
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+        return 0;
+    }
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void close_all_fds(int*keep, int keep_num)
+{
+    int max=sysconf(_SC_OPEN_MAX);
+    int fd;
+    for(fd=0; fd<max; fd++) {
+        int j;
+        bool do_keep = false;
+        for(j=0;j<keep_num;j++) {
+            do_keep |= keep[j] == fd;
+        }
+        if(!do_keep) {
+            close(fd);
+        }
+    }
+}
+
 bool read_with_retry(int fd, void* data, int len)
 {
     int pos = 0;
@@ -149,45 +185,59 @@ bool read_with_retry(int fd, void* data, int len)
     return true;
 }
 
-bool read_with_timeout(int fd, void* data, int len, struct timeval* timeout)
+bool write_with_retry(int fd, const void* data, int len)
 {
-    if(!timeout) {
-        return read_with_retry(fd, data, len);
-    }
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(fd, &readfds);
-
     int pos = 0;
     while(pos<len) {
-        int ret;
-        while(1) {
-            ret = select(fd+1, &readfds, NULL, NULL, timeout);
-            if(ret<0) {
-                if(errno == EINTR || errno == EAGAIN)
-                    continue;
-                return false;
-            }
-            if(ret>=0)
-                break;
-        }
-        if(!FD_ISSET(fd, &readfds)) {
-            // timeout
-            return false;
-        }
-
-        ret = read(fd, data+pos, len-pos);
+        int ret = write(fd, data+pos, len-pos);
         if(ret<0) {
             if(errno == EINTR || errno == EAGAIN)
                 continue;
-            // read error
+            // write error
             return false;
         }
+        pos += ret;
+    }
+    return true;
+}
+
+/* The fd should be non-blocking: we only poll() (and look at the clock)
+   when there's nothing to read yet. */
+bool read_with_deadline(int fd, void* data, int len, int64_t deadline)
+{
+    int pos = 0;
+    while(pos<len) {
+        int ret = read(fd, data+pos, len-pos);
+        if(ret>0) {
+            pos += ret;
+            continue;
+        }
         if(ret==0) {
             // EOF
             return false;
         }
-        pos += ret;
+        if(errno == EINTR)
+            continue;
+        if(errno != EAGAIN) {
+            // read error
+            return false;
+        }
+
+        int ms = -1;
+        if(deadline) {
+            int64_t left = deadline - monotonic_usec();
+            if(left <= 0) {
+                // timeout
+                return false;
+            }
+            ms = (left + 999) / 1000;
+        }
+        /* poll() instead of select(), which can't handle fds above FD_SETSIZE */
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if(poll(&pfd, 1, ms) < 0 && errno != EINTR)
+            return false;
     }
     return true;
 }
@@ -21,6 +21,7 @@
 #define __util_h__
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/select.h>
 #undef assert // defined by sys/select.h
 
@@ -52,8 +53,18 @@ char* concat_paths(const char*base, const char*add);
 void mkdir_p(const char*path);
 char*read_file(const char*filename);
 
+/* 0 if the clock can't be read (a sandbox whose filter doesn't allow
+   clock_gettime), so that durations come out as 0 */
+int64_t monotonic_usec();
+int64_t monotonic_nsec();
+
+/* close all file descriptors except the ones listed */
+void close_all_fds(int*keep, int keep_num);
+
 bool read_with_retry(int fd, void* data, int len);
-bool read_with_timeout(int fd, void* data, int len, struct timeval* timeout);
+bool write_with_retry(int fd, const void* data, int len);
+/* Read len bytes, unless monotonic_usec() passes deadline (0 = none) */
+bool read_with_deadline(int fd, void* data, int len, int64_t deadline);
 
 #ifdef __cplusplus
 }
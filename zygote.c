@@ -0,0 +1,215 @@
+/* zygote.c
+   Fork servers for pre-initialized sandboxes
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include "util.h"
+#include "zygote.h"
+
+struct _zygote {
+    pid_t pid;
+    int sock;
+    pthread_mutex_t mutex;
+};
+
+/* Requests are single datagrams on a SOCK_SEQPACKET socket: the message,
+   with the file descriptors attached. The reply is the new pid. */
+bool zygote_send_request(int sock, int*fds, int num_fds, const void*message, int len)
+{
+    char control[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+    char dummy = 0;
+    struct iovec iov;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+
+    /* we always send at least one byte, so the request can't be mistaken for EOF */
+    iov.iov_base = len ? (void*)message : &dummy;
+    iov.iov_len = len ? len : 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if(num_fds) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+        struct cmsghdr*cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+    }
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) >= 0;
+}
+
+bool zygote_receive_request(int sock, int*fds, int*num_fds, void*message, int*len)
+{
+    char control[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+    struct iovec iov;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+
+    iov.iov_base = message;
+    iov.iov_len = ZYGOTE_MAX_MESSAGE;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int ret;
+    do {
+        ret = recvmsg(sock, &msg, 0);
+    } while(ret < 0 && errno == EINTR);
+    if(ret <= 0)
+        return false;
+    *len = ret;
+
+    *num_fds = 0;
+    struct cmsghdr*cmsg;
+    for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *num_fds);
+        }
+    }
+    return true;
+}
+
+static void zygote_loop(int sock, zygote_main_t main, void*data)
+{
+    /* children are reaped automatically */
+    signal(SIGCHLD, SIG_IGN);
+
+    while(1) {
+        int fds[ZYGOTE_MAX_FDS];
+        int num_fds = 0;
+        char message[ZYGOTE_MAX_MESSAGE];
+        int len = 0;
+        if(!zygote_receive_request(sock, fds, &num_fds, message, &len)) {
+            break;
+        }
+
+        pid_t pid = fork();
+        if(!pid) {
+            close(sock);
+            signal(SIGCHLD, SIG_DFL);
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            main(data, fds, num_fds, message, len);
+            _exit(0);
+        }
+
+        int i;
+        for(i=0;i<num_fds;i++) {
+            close(fds[i]);
+        }
+        if(!write_with_retry(sock, &pid, sizeof(pid))) {
+            break;
+        }
+    }
+
+    /* the host went away. Take all the sandboxes with us. */
+    kill(0, SIGKILL);
+    _exit(0);
+}
+
+zygote_t* zygote_new(zygote_init_t init, zygote_main_t main, void*data)
+{
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv)) {
+        perror("socketpair");
+        return NULL;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if(pid < 0) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return NULL;
+    }
+    if(!pid) {
+        //zygote
+        int sock = sv[1];
+        /* our own process group, so we can kill all sandboxes at once. We
+           don't use PR_SET_PDEATHSIG: it fires when the thread that started
+           us exits, not the host. We notice the host is gone once the
+           socket is closed. */
+        setpgid(0, 0);
+
+        int keep[] = {1, 2, sock};
+        close_all_fds(keep, sizeof(keep)/sizeof(keep[0]));
+
+        uint8_t ok = init(data);
+        write_with_retry(sock, &ok, 1);
+        if(!ok) {
+            _exit(44);
+        }
+        zygote_loop(sock, main, data);
+    }
+
+    //parent
+    close(sv[1]);
+    uint8_t ok = 0;
+    if(!read_with_retry(sv[0], &ok, 1) || !ok) {
+        fprintf(stderr, "Zygote process %d failed to start\n", pid);
+        close(sv[0]);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return NULL;
+    }
+
+    zygote_t*zygote = calloc(1, sizeof(zygote_t));
+    zygote->pid = pid;
+    zygote->sock = sv[0];
+    pthread_mutex_init(&zygote->mutex, NULL);
+    return zygote;
+}
+
+pid_t zygote_fork(zygote_t*zygote, int*fds, int num_fds, const void*message, int len)
+{
+    if(num_fds > ZYGOTE_MAX_FDS || len > ZYGOTE_MAX_MESSAGE)
+        return -1;
+
+    pid_t pid = -1;
+    pthread_mutex_lock(&zygote->mutex);
+    if(!zygote_send_request(zygote->sock, fds, num_fds, message, len) ||
+       !read_with_retry(zygote->sock, &pid, sizeof(pid))) {
+        pid = -1;
+    }
+    pthread_mutex_unlock(&zygote->mutex);
+    return pid;
+}
+
+void zygote_destroy(zygote_t*zygote)
+{
+    /* closing the socket makes the zygote kill its process group */
+    close(zygote->sock);
+    waitpid(zygote->pid, NULL, 0);
+    pthread_mutex_destroy(&zygote->mutex);
+    free(zygote);
+}
@@ -0,0 +1,62 @@
+/* zygote.h
+   Fork servers for pre-initialized sandboxes
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#ifndef __zygote_h__
+#define __zygote_h__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _zygote zygote_t;
+
+#define ZYGOTE_MAX_FDS 4
+#define ZYGOTE_MAX_MESSAGE 256
+
+/* runs once, in the zygote process */
+typedef bool (*zygote_init_t)(void*data);
+
+/* runs in every process forked from the zygote, with the file descriptors
+   and message passed to zygote_fork(). Must not return. */
+typedef void (*zygote_main_t)(void*data, int*fds, int num_fds, const void*message, int len);
+
+/* Start a zygote process. It closes all file descriptors it inherited,
+   calls init, and then waits for fork requests. It kills all of its
+   children (and itself) as soon as we go away. */
+zygote_t* zygote_new(zygote_init_t init, zygote_main_t main, void*data);
+
+/* Fork a new process from the zygote, and pass it copies of the given file
+   descriptors. Returns the pid of the new process, or -1. The process is
+   a child of the zygote, not of ours: we can kill it, but not wait for it. */
+pid_t zygote_fork(zygote_t*zygote, int*fds, int num_fds, const void*message, int len);
+
+void zygote_destroy(zygote_t*zygote);
+
+/* The wire format of fork requests: one datagram on a SOCK_SEQPACKET
+   socket, with up to ZYGOTE_MAX_FDS file descriptors attached. Also used
+   by sandbox templates. */
+bool zygote_send_request(int sock, int*fds, int num_fds, const void*message, int len);
+bool zygote_receive_request(int sock, int*fds, int*num_fds, void*message, int*len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif